@@ -4,25 +4,481 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <memory_resource>
 #include <array>
 #include <format>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+#include <span>
+#include <limits>
+#include <random>
+#include <bit>
+#include <tuple>
+#include <map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <charconv>
 
 #include <cmath>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+
 #include <glad/glad.h>
 #include <glfw/glfw3.h>
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/intersect.hpp>
+#include <glm/gtc/quaternion.hpp>
 
 #include <imgui.h>
 #include <imgui_impl_glfw.h>
 #include <imgui_impl_opengl3.h>
 
+#include "thread_pool.hpp"
+#include "ecs.hpp"
+
+namespace mk::memory {
+    /*
+     * Allocation accounting by subsystem. Host allocations are tagged with the calling thread's
+     * current tag (set through mk::memory::scope) by the global operator new below; GPU buffers
+     * are tagged explicitly in buffer_data(). Everything else counts as general.
+     */
+    enum class tag : std::uint8_t { GENERAL, MESHES, INSTANCES, SCENE, TERRAIN, UI, FRAME, CAPTURE, PARTICLES, DEBUG_DRAW, COUNT };
+    constexpr std::size_t tag_count = static_cast<std::size_t>(tag::COUNT);
+    constexpr std::array<const char *, tag_count> tag_names{ "General", "Meshes", "Instances", "Scene", "Terrain", "UI", "Frame", "Capture", "Particles", "Debug draw" };
+
+    struct counter {
+        std::atomic<std::int64_t> live_bytes{ 0 };
+        std::atomic<std::int64_t> peak_bytes{ 0 };
+        std::atomic<std::int64_t> live_count{ 0 };
+        std::atomic<std::uint64_t> total_count{ 0 };
+
+        void add(std::size_t bytes) noexcept {
+            auto live = live_bytes.fetch_add(static_cast<std::int64_t>(bytes), std::memory_order_relaxed) + static_cast<std::int64_t>(bytes);
+            live_count.fetch_add(1, std::memory_order_relaxed);
+            total_count.fetch_add(1, std::memory_order_relaxed);
+            for (auto peak = peak_bytes.load(std::memory_order_relaxed); live > peak; ) {
+                if (peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) break;
+            }
+        }
+
+        void sub(std::size_t bytes) noexcept {
+            live_bytes.fetch_sub(static_cast<std::int64_t>(bytes), std::memory_order_relaxed);
+            live_count.fetch_sub(1, std::memory_order_relaxed);
+        }
+    };
+
+    // constant-initialized, operator new may run before any dynamic initialization
+    constinit std::array<counter, tag_count> host;
+    constinit std::array<counter, tag_count> gpu;
+    constinit thread_local tag current = tag::GENERAL;
+
+    class scope {
+    public:
+        explicit scope(tag t) noexcept : m_previous(std::exchange(current, t)) { }
+        ~scope() { current = m_previous; }
+
+        scope(const scope &) = delete;
+        scope &operator=(const scope &) = delete;
+
+    private:
+        tag m_previous;
+    };
+
+    namespace detail {
+        // keeps the default new alignment for the block that follows
+        struct alignas(16) header {
+            std::size_t size;
+            std::uint32_t tag;
+        };
+
+        void *allocate(std::size_t size) noexcept {
+            auto *h = static_cast<header *>(std::malloc(sizeof(header) + size));
+            if (h == nullptr) return nullptr;
+            h->size = size;
+            h->tag = static_cast<std::uint32_t>(current);
+            host[h->tag].add(size);
+            return h + 1;
+        }
+
+        void release(void *p) noexcept {
+            if (p == nullptr) return;
+            auto *h = static_cast<header *>(p) - 1;
+            host[h->tag].sub(h->size);
+            std::free(h);
+        }
+
+        struct buffer_record {
+            tag owner;
+            std::size_t size;
+        };
+
+        // GL objects are only created and destroyed on the thread owning the context
+        std::unordered_map<GLuint, buffer_record> buffers;
+        std::unordered_set<GLuint> vertex_arrays;
+        std::unordered_set<GLuint> textures;
+        std::unordered_set<GLuint> framebuffers;
+
+        GLenum binding_of(GLenum target) {
+            switch (target) {
+            case GL_ARRAY_BUFFER: return GL_ARRAY_BUFFER_BINDING;
+            case GL_ELEMENT_ARRAY_BUFFER: return GL_ELEMENT_ARRAY_BUFFER_BINDING;
+            case GL_UNIFORM_BUFFER: return GL_UNIFORM_BUFFER_BINDING;
+            case GL_TEXTURE_BUFFER: return GL_TEXTURE_BUFFER;
+            case GL_PIXEL_PACK_BUFFER: return GL_PIXEL_PACK_BUFFER_BINDING;
+            case GL_PIXEL_UNPACK_BUFFER: return GL_PIXEL_UNPACK_BUFFER_BINDING;
+            case GL_COPY_READ_BUFFER: return GL_COPY_READ_BUFFER;
+            case GL_COPY_WRITE_BUFFER: return GL_COPY_WRITE_BUFFER;
+#ifdef GL_VERSION_4_3
+            case GL_SHADER_STORAGE_BUFFER: return GL_SHADER_STORAGE_BUFFER_BINDING;
+            case GL_DRAW_INDIRECT_BUFFER: return GL_DRAW_INDIRECT_BUFFER_BINDING;
+#endif
+            default: throw std::runtime_error("Untracked buffer target.");
+            }
+        }
+    }
+
+    void gen_buffers(GLsizei n, GLuint *ids) {
+        glGenBuffers(n, ids);
+        for (GLsizei i = 0; i < n; ++i) detail::buffers[ids[i]] = { tag::GENERAL, 0 };
+    }
+
+    void delete_buffers(GLsizei n, const GLuint *ids) {
+        for (GLsizei i = 0; i < n; ++i) {
+            auto it = detail::buffers.find(ids[i]);
+            if (it == detail::buffers.end()) continue;
+            if (it->second.size != 0) gpu[static_cast<std::size_t>(it->second.owner)].sub(it->second.size);
+            detail::buffers.erase(it);
+        }
+        glDeleteBuffers(n, ids);
+    }
+
+    /* glBufferData for the buffer bound to `target`, charging its storage to `owner`. */
+    void buffer_data(tag owner, GLenum target, GLsizeiptr size, const void *data, GLenum usage) {
+        glBufferData(target, size, data, usage);
+        GLint bound = 0;
+        glGetIntegerv(detail::binding_of(target), &bound);
+        auto &&record = detail::buffers[static_cast<GLuint>(bound)];
+        if (record.size != 0) gpu[static_cast<std::size_t>(record.owner)].sub(record.size);
+        record = { owner, static_cast<std::size_t>(size) };
+        if (record.size != 0) gpu[static_cast<std::size_t>(owner)].add(record.size);
+    }
+
+    void gen_vertex_arrays(GLsizei n, GLuint *ids) {
+        glGenVertexArrays(n, ids);
+        detail::vertex_arrays.insert(ids, ids + n);
+    }
+
+    void delete_vertex_arrays(GLsizei n, const GLuint *ids) {
+        for (GLsizei i = 0; i < n; ++i) detail::vertex_arrays.erase(ids[i]);
+        glDeleteVertexArrays(n, ids);
+    }
+
+    void gen_textures(GLsizei n, GLuint *ids) {
+        glGenTextures(n, ids);
+        detail::textures.insert(ids, ids + n);
+    }
+
+    void delete_textures(GLsizei n, const GLuint *ids) {
+        for (GLsizei i = 0; i < n; ++i) detail::textures.erase(ids[i]);
+        glDeleteTextures(n, ids);
+    }
+
+    void gen_framebuffers(GLsizei n, GLuint *ids) {
+        glGenFramebuffers(n, ids);
+        detail::framebuffers.insert(ids, ids + n);
+    }
+
+    void delete_framebuffers(GLsizei n, const GLuint *ids) {
+        for (GLsizei i = 0; i < n; ++i) detail::framebuffers.erase(ids[i]);
+        glDeleteFramebuffers(n, ids);
+    }
+
+    std::size_t live_buffers() noexcept { return detail::buffers.size(); }
+    std::size_t live_vertex_arrays() noexcept { return detail::vertex_arrays.size(); }
+    std::size_t live_textures() noexcept { return detail::textures.size(); }
+    std::size_t live_framebuffers() noexcept { return detail::framebuffers.size(); }
+
+    /* Lists GL objects that are still alive; call right before the context goes away. */
+    void report_leaks() {
+        for (auto &&[id, record] : detail::buffers) {
+            std::cout << "Leaked GL buffer " << id << " (" << tag_names[static_cast<std::size_t>(record.owner)] << ", " << record.size << " bytes)\n";
+        }
+        for (auto id : detail::vertex_arrays) std::cout << "Leaked GL vertex array " << id << '\n';
+        for (auto id : detail::textures) std::cout << "Leaked GL texture " << id << '\n';
+        for (auto id : detail::framebuffers) std::cout << "Leaked GL framebuffer " << id << '\n';
+    }
+
+    /*
+     * Bump allocator for data that dies with the frame that made it. deallocate() does nothing,
+     * reset() drops everything at once. Requests that do not fit the block are served upstream
+     * and the block grows to the frame's high-water mark on the next reset(), so a steady frame
+     * stops touching the heap after warm-up. Only ever used from one thread at a time.
+     */
+    class frame_arena final : public std::pmr::memory_resource {
+    public:
+        explicit frame_arena(std::size_t capacity = 64 * 1024) : m_capacity(capacity) { }
+
+        ~frame_arena() override {
+            reset();
+            release_block();
+        }
+
+        frame_arena(const frame_arena &) = delete;
+        frame_arena &operator=(const frame_arena &) = delete;
+
+        void reset() {
+            m_last_used = m_used + m_overflow_bytes;
+            for (auto *block = m_overflow; block != nullptr; ) {
+                auto *next = block->next;
+                upstream()->deallocate(block, block->size, block->alignment);
+                block = next;
+            }
+            m_overflow = nullptr;
+            if (m_last_used > m_capacity) {
+                release_block();
+                m_capacity = std::bit_ceil(m_last_used);
+                ++m_overflows;
+            }
+            m_used = 0;
+            m_overflow_bytes = 0;
+        }
+
+        std::size_t get_capacity() const noexcept { return m_capacity; }
+        std::size_t get_last_used() const noexcept { return m_last_used; }
+        std::uint64_t get_overflows() const noexcept { return m_overflows; }
+
+    private:
+        struct overflow_block {
+            overflow_block *next;
+            std::size_t size;
+            std::size_t alignment;
+        };
+
+        static std::pmr::memory_resource *upstream() noexcept { return std::pmr::new_delete_resource(); }
+
+        void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+            if (m_block == nullptr) {
+                scope charge(tag::FRAME);
+                m_block = static_cast<std::byte *>(upstream()->allocate(m_capacity, alignof(std::max_align_t)));
+            }
+            std::size_t offset = (m_used + alignment - 1) & ~(alignment - 1);
+            if (offset + bytes <= m_capacity) {
+                m_used = offset + bytes;
+                return m_block + offset;
+            }
+
+            scope charge(tag::FRAME);
+            alignment = std::max(alignment, alignof(overflow_block));
+            std::size_t header = (sizeof(overflow_block) + alignment - 1) & ~(alignment - 1);
+            auto *raw = static_cast<std::byte *>(upstream()->allocate(header + bytes, alignment));
+            m_overflow = ::new (raw) overflow_block{ m_overflow, header + bytes, alignment };
+            m_overflow_bytes += bytes + alignment;
+            return raw + header;
+        }
+
+        void do_deallocate(void *, std::size_t, std::size_t) override { }
+
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+        void release_block() {
+            if (m_block != nullptr) upstream()->deallocate(m_block, m_capacity, alignof(std::max_align_t));
+            m_block = nullptr;
+        }
+
+        std::byte *m_block = nullptr;
+        std::size_t m_capacity;
+        std::size_t m_used = 0;
+        overflow_block *m_overflow = nullptr;
+        std::size_t m_overflow_bytes = 0;
+        std::size_t m_last_used = 0;
+        std::uint64_t m_overflows = 0;
+    };
+
+    /*
+     * One ring of frame_arenas per thread, indexed by frame number. begin_frame() recycles the
+     * slot of a new frame on every thread; the ring is deeper than the frame pipeline, so no
+     * frame still being simulated or submitted can own that slot.
+     */
+    class frame_arenas {
+    public:
+        static constexpr std::size_t ring = 4;
+
+        struct usage {
+            std::size_t threads = 0;
+            std::size_t capacity = 0;
+            std::size_t used = 0;       // largest frame among the ones recycled last
+            std::uint64_t overflows = 0;
+        };
+
+        /* This thread's arena for `frame`; the first call from a thread registers it. */
+        static frame_arena &local(std::uint64_t frame) {
+            thread_local thread_set *arenas = enroll();
+            return (*arenas)[frame % ring];
+        }
+
+        static void begin_frame(std::uint64_t frame) {
+            auto &&r = registry();
+            std::lock_guard lock(r.mutex);
+            for (auto &&arenas : r.threads) (*arenas)[frame % ring].reset();
+        }
+
+        static usage get_usage() {
+            auto &&r = registry();
+            std::lock_guard lock(r.mutex);
+            usage u;
+            u.threads = r.threads.size();
+            for (auto &&arenas : r.threads) {
+                for (auto &&arena : *arenas) {
+                    u.capacity += arena.get_capacity();
+                    u.used = std::max(u.used, arena.get_last_used());
+                    u.overflows += arena.get_overflows();
+                }
+            }
+            return u;
+        }
+
+    private:
+        using thread_set = std::array<frame_arena, ring>;
+
+        struct registry_state {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<thread_set>> threads;
+        };
+
+        static registry_state &registry() {
+            static registry_state state;
+            return state;
+        }
+
+        static thread_set *enroll() {
+            auto &&r = registry();
+            std::lock_guard lock(r.mutex);
+            scope charge(tag::FRAME);
+            return r.threads.emplace_back(std::make_unique<thread_set>()).get();
+        }
+    };
+
+    /*
+     * Counts host allocations per tag over a window of frames, after an optional warm-up for
+     * caches and pools to fill. A steady-state frame is expected to count zero.
+     */
+    class allocation_window {
+    public:
+        struct result {
+            std::array<std::uint64_t, tag_count> counts{};
+            std::uint64_t total = 0;
+            int frames = 0;
+
+            double per_frame() const noexcept { return frames > 0 ? static_cast<double>(total) / frames : 0.0; }
+        };
+
+        void start(int frames, int warmup = 0) noexcept {
+            m_frames = std::max(frames, 1);
+            m_warmup = std::max(warmup, 0);
+            m_left = m_frames;
+            m_result.reset();
+            if (m_warmup == 0) snapshot();
+        }
+
+        /* Call once per presented frame; true on the frame that closes the window. */
+        bool end_frame() noexcept {
+            if (m_left == 0) return false;
+            if (m_warmup > 0) {
+                if (--m_warmup == 0) snapshot();
+                return false;
+            }
+            if (--m_left > 0) return false;
+
+            result r;
+            r.frames = m_frames;
+            for (std::size_t t = 0; t < tag_count; ++t) {
+                r.counts[t] = host[t].total_count.load(std::memory_order_relaxed) - m_before[t];
+                r.total += r.counts[t];
+            }
+            m_result = r;
+            return true;
+        }
+
+        bool is_counting() const noexcept { return m_left > 0; }
+        int get_frames_left() const noexcept { return m_warmup + m_left; }
+        const std::optional<result> &get_result() const noexcept { return m_result; }
+
+    private:
+        void snapshot() noexcept {
+            for (std::size_t t = 0; t < tag_count; ++t) m_before[t] = host[t].total_count.load(std::memory_order_relaxed);
+        }
+
+        int m_frames = 0;
+        int m_warmup = 0;
+        int m_left = 0;
+        std::array<std::uint64_t, tag_count> m_before{};
+        std::optional<result> m_result;
+    };
+}
+
+void *operator new(std::size_t size) {
+    if (auto p = mk::memory::detail::allocate(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) {
+    return ::operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return mk::memory::detail::allocate(size == 0 ? 1 : size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return mk::memory::detail::allocate(size == 0 ? 1 : size);
+}
+
+void operator delete(void *p) noexcept { mk::memory::detail::release(p); }
+void operator delete[](void *p) noexcept { mk::memory::detail::release(p); }
+void operator delete(void *p, std::size_t) noexcept { mk::memory::detail::release(p); }
+void operator delete[](void *p, std::size_t) noexcept { mk::memory::detail::release(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { mk::memory::detail::release(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { mk::memory::detail::release(p); }
+
 constexpr int glfw_version_major = 3;
 constexpr int glfw_version_minor = 3;
 
+// requested first when window_init_options::p_request_indirect is set, falls back to 3.3
+constexpr int glfw_indirect_version_major = 4;
+constexpr int glfw_indirect_version_minor = 3;
+
 // log() is easier to type than puts() and it's usage is better implied
 void log(const char *msg) {
     std::cout << msg << '\n';
@@ -232,24 +688,34 @@ struct window_init_options {
     const char  *   p_title;
     GLFWmonitor *   p_monitor;
     GLFWwindow  *   p_share;
+    bool            p_request_indirect;
 };
 
 class gl_context {
 public:
     gl_context(window_init_options options) : m_window(nullptr, glfwDestroyWindow) {
         glfwInit();
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, glfw_version_major);
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, glfw_version_minor);
-        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-        glfwWindowHint(GLFW_SAMPLES, 16);
-
-        m_window.reset(glfwCreateWindow(
-            options.p_width,
-            options.p_height,
-            options.p_title,
-            options.p_monitor,
-            options.p_share
-        ));
+        auto create_window = [&](int major, int minor) {
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, major);
+            glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, minor);
+            glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+            glfwWindowHint(GLFW_SAMPLES, 16);
+
+            m_window.reset(glfwCreateWindow(
+                options.p_width,
+                options.p_height,
+                options.p_title,
+                options.p_monitor,
+                options.p_share
+            ));
+        };
+
+        if (options.p_request_indirect) {
+            create_window(glfw_indirect_version_major, glfw_indirect_version_minor);
+        }
+        if (m_window == nullptr) {
+            create_window(glfw_version_major, glfw_version_minor);
+        }
         m_window_title = options.p_title;
 
         if (m_window == nullptr) {
@@ -260,6 +726,8 @@ public:
         if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(glfwGetProcAddress))) {
             throw std::runtime_error("Failed to initialize GLAD.");
         }
+        glGetIntegerv(GL_MAJOR_VERSION, &m_version_major);
+        glGetIntegerv(GL_MINOR_VERSION, &m_version_minor);
 
         glEnable(GL_DEPTH_TEST);
         glViewport(0, 0, options.p_width, options.p_height);
@@ -272,6 +740,9 @@ public:
 
         // Initialize IMGUI
         IMGUI_CHECKVERSION();
+        ImGui::SetAllocatorFunctions(
+            [](std::size_t size, void *) { mk::memory::scope ui(mk::memory::tag::UI); return ::operator new(size); },
+            [](void *p, void *) { ::operator delete(p); });
         ImGui::CreateContext();
 
         ImGui_ImplGlfw_InitForOpenGL(m_window.get(), true);
@@ -283,6 +754,7 @@ public:
         ImGui_ImplGlfw_Shutdown();
         ImGui::DestroyContext();
 
+        mk::memory::report_leaks();
         glfwTerminate();
     }
 
@@ -299,9 +771,15 @@ public:
         glfwSetWindowTitle(m_window.get(), m_window_title.data());
     }
 
+    bool supports_version(int major, int minor) const noexcept {
+        return m_version_major > major || (m_version_major == major && m_version_minor >= minor);
+    }
+
 private:
     std::unique_ptr<GLFWwindow, decltype(&glfwDestroyWindow)> m_window;
     std::string m_window_title;
+    GLint m_version_major = 0;
+    GLint m_version_minor = 0;
 };
 
 namespace gl_constants {
@@ -319,138 +797,895 @@ namespace gl_constants {
 template <typename T>
 concept GLType = requires(T) {
     { gl_constants::gl_enum<T> } -> std::convertible_to<GLenum>;
-    { gl_constants::gl_enum<T> != 0x0 };
+    requires gl_constants::gl_enum<T> != 0x0;
 };
 
 namespace mk {
-    class location {
-    public:
-        location() : pos(0) { }
-        location(glm::vec3 p_pos) : pos(p_pos) { }
+    /* IEEE 754 binary16 storage. Only meant for vertex data, no arithmetic is provided. */
+    struct half {
+        std::uint16_t bits;
+    };
+}
 
-        glm::mat4 get_matrix() const noexcept {
-            return glm::translate(glm::identity<glm::mat4>(), pos);
+namespace gl_constants {
+    template <> constexpr GLenum gl_enum<mk::half> =    GL_HALF_FLOAT;
+}
+
+namespace mk {
+    namespace quantize {
+        half to_half(float value) {
+            std::uint32_t f;
+            std::memcpy(&f, &value, sizeof f);
+            std::uint32_t sign = (f >> 16) & 0x8000u;
+            std::int32_t exponent = static_cast<std::int32_t>((f >> 23) & 0xFFu) - 127 + 15;
+            std::uint32_t mantissa = f & 0x7FFFFFu;
+
+            if (((f >> 23) & 0xFFu) == 0xFFu) {     // inf / nan
+                return { static_cast<std::uint16_t>(sign | 0x7C00u | (mantissa ? 0x200u : 0u)) };
+            }
+            if (exponent >= 0x1F) {                 // overflow
+                return { static_cast<std::uint16_t>(sign | 0x7C00u) };
+            }
+            if (exponent <= 0) {                    // subnormal or zero
+                if (exponent < -10) return { static_cast<std::uint16_t>(sign) };
+                mantissa |= 0x800000u;
+                std::uint32_t shift = static_cast<std::uint32_t>(14 - exponent);
+                std::uint32_t bits = mantissa >> shift;
+                std::uint32_t remainder = mantissa & ((1u << shift) - 1);
+                std::uint32_t halfway = 1u << (shift - 1);
+                bits += (remainder > halfway || (remainder == halfway && (bits & 1u))) ? 1u : 0u;
+                return { static_cast<std::uint16_t>(sign | bits) };
+            }
+            // round to nearest even, a carry out of the mantissa correctly bumps the exponent
+            std::uint32_t bits = (static_cast<std::uint32_t>(exponent) << 10) | (mantissa >> 13);
+            bits += ((mantissa & 0x1FFFu) > 0x1000u || ((mantissa & 0x1FFFu) == 0x1000u && (bits & 1u))) ? 1u : 0u;
+            return { static_cast<std::uint16_t>(sign | bits) };
         }
 
-        glm::vec3 pos;
-    };
+        std::int16_t snorm16(float value) {
+            return static_cast<std::int16_t>(std::lround(std::clamp(value, -1.0f, 1.0f) * 32767.0f));
+        }
 
-    namespace geo {
-        static constexpr size_t error_id = 0ULL;
+        std::int8_t snorm8(float value) {
+            return static_cast<std::int8_t>(std::lround(std::clamp(value, -1.0f, 1.0f) * 127.0f));
+        }
 
-        size_t next_id() {
-            static auto __next_id = 1ULL;
-            return __next_id++;
+        std::uint16_t unorm16(float value) {
+            return static_cast<std::uint16_t>(std::lround(std::clamp(value, 0.0f, 1.0f) * 65535.0f));
         }
+    }
 
-        /* Initialized statically in implementation of mk::geo::geometry where geometry::set_vertices() is unsafe */
-        class __warn_geometry_reinit { 
-        public: __warn_geometry_reinit() { std::cout << "Warning: Changing vertices for this object is not recommended.\n"; } 
-        };
+    /*
+     * One vertex attribute, doubling as its own storage so that vertex structs can be written
+     * as a plain list of attributes. Normalized integer types are read as [-1, 1] / [0, 1] floats.
+     */
+    template <GLType T, GLint Count, GLboolean Normalized = GL_FALSE>
+    struct vertex_attribute {
+        static_assert(Count >= 1 && Count <= 4);
+
+        using component_type = T;
+        static constexpr GLint count = Count;
+        static constexpr GLenum type = gl_constants::gl_enum<T>;
+        static constexpr GLboolean normalized = Normalized;
+        static constexpr std::size_t size = sizeof(T) * Count;
+
+        T value[Count];
+    };
 
-        class geometry {
-        public:
-            virtual size_t get_id() const noexcept = 0;
-            virtual GLuint get_vao() const noexcept = 0;
-            virtual GLuint get_vbo() const noexcept = 0;
-            virtual const mk::location &get_location() const noexcept = 0;
-            virtual const std::vector<float> &get_vertices() const noexcept = 0;
+    /*
+     * Attribute setup for a tightly packed, interleaved vertex. Stride and offsets are computed
+     * at compile time; attribute i is bound to shader location first_location + i.
+     */
+    template <typename... Attributes>
+    struct vertex_layout {
+        static constexpr GLsizei stride = static_cast<GLsizei>((Attributes::size + ...));
+
+        static void apply(GLuint first_location = 0) {
+            GLuint location = first_location;
+            std::size_t offset = 0;
+            ((enable<Attributes>(location++, offset), offset += Attributes::size), ...);
+        }
 
-            virtual mk::location &location() noexcept = 0;
-            
-            virtual void set_vertices(std::vector<float> vertices) = 0;
+    private:
+        template <typename Attribute>
+        static void enable(GLuint location, std::size_t offset) {
+            glVertexAttribPointer(location, Attribute::count, Attribute::type, Attribute::normalized, stride, reinterpret_cast<void *>(offset));
+            glEnableVertexAttribArray(location);
+        }
+    };
 
-            virtual void draw() const = 0;
+    /* A vertex struct must declare its layout in member order with no padding in between. */
+    template <typename V>
+    concept VertexFormat = requires {
+        typename V::layout;
+        requires sizeof(V) == static_cast<std::size_t>(V::layout::stride);
+    };
+
+    namespace vertex {
+        // 12 bytes
+        struct position {
+            vertex_attribute<float, 3> pos;
+
+            using layout = vertex_layout<decltype(pos)>;
         };
 
-        constexpr size_t TRIANGLE_VERTEX_COUNT = 3;
+        // 8 bytes, exact for small coordinates such as the unit cube
+        struct half_position {
+            vertex_attribute<half, 4> pos;
 
-        class triangle : public geometry {
-        private:
-            void build() {
-                glGenVertexArrays(1, &m_vao);
-                glBindVertexArray(m_vao);
-                glGenBuffers(1, &m_vbo);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-                glBufferData(GL_ARRAY_BUFFER, sizeof(float) * m_vertices.size(), m_vertices.data(), GL_STATIC_DRAW);
-                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), static_cast<void *>(0));
-                glEnableVertexAttribArray(0);
+            using layout = vertex_layout<decltype(pos)>;
+        };
 
-                m_id = next_id();
-            }
+        // 8 bytes, integral grid coordinates up to +-32767
+        struct grid_position {
+            vertex_attribute<std::int16_t, 4> pos;
 
-            // for copy constructor
-            triangle(std::vector<float> vertices, bool stupid) : m_vertices(std::move(vertices)) {
-                build();
-            }
-        public:
-            triangle(std::array<float, TRIANGLE_VERTEX_COUNT * 3> vertices) : m_location() {
-                for (auto &&v : vertices) m_vertices.push_back(v);
-                build();
-            }
+            using layout = vertex_layout<decltype(pos)>;
+        };
 
-            ~triangle() {
-                glDeleteVertexArrays(1, &m_vao);
-                glDeleteBuffers(1, &m_vbo);
-            }
+        // 16 bytes instead of 32 for float position/normal/uv. Positions are normalized to the
+        // mesh extent, which has to be folded back in through the model matrix.
+        struct compact {
+            vertex_attribute<std::int16_t, 4, GL_TRUE> pos;
+            vertex_attribute<std::int8_t, 4, GL_TRUE> normal;
+            vertex_attribute<half, 2> uv;
 
-            triangle(const triangle &other) : triangle(other.m_vertices, true) { }
+            using layout = vertex_layout<decltype(pos), decltype(normal), decltype(uv)>;
+        };
 
-            triangle &operator=(const triangle &other) {
-                return *this = triangle(other);
-            }
+        // 16 bytes, world-space position plus a material_buffer slot for static batches. The slot
+        // is read as a float, which is exact for every slot.
+        struct batched {
+            vertex_attribute<float, 3> pos;
+            vertex_attribute<std::uint16_t, 2> material;    // slot, unused
 
-            triangle(triangle &&other) {
-                std::swap(m_vao, other.m_vao);
-                std::swap(m_vbo, other.m_vbo);
-                std::swap(m_location, other.m_location);
-                std::swap(m_vertices, other.m_vertices);
-                std::cout << "move\n";
-            }
+            using layout = vertex_layout<decltype(pos), decltype(material)>;
+        };
 
-            triangle &operator=(triangle &&other) {
-                std::swap(m_vao, other.m_vao);
-                std::swap(m_vbo, other.m_vbo);
-                std::swap(m_location, other.m_location);
-                std::swap(m_vertices, other.m_vertices);
-                std::cout << "move\n";
-                return *this;
-            }
+        // 16 bytes, a point sprite: world-space center and RGBA8 color with the fade in alpha
+        struct particle {
+            vertex_attribute<float, 3> pos;
+            vertex_attribute<std::uint8_t, 4, GL_TRUE> color;
 
-            size_t get_id() const noexcept override {
-                return m_id;
-            }
+            using layout = vertex_layout<decltype(pos), decltype(color)>;
+        };
 
-            GLuint get_vao() const noexcept override {
-                return m_vao;
-            }
+        // 16 bytes, world-space position and RGBA8 color for debug lines
+        struct colored {
+            vertex_attribute<float, 3> pos;
+            vertex_attribute<std::uint8_t, 4, GL_TRUE> color;
 
-            GLuint get_vbo() const noexcept override {
-                return m_vbo;
-            }
+            using layout = vertex_layout<decltype(pos), decltype(color)>;
+        };
 
-            const mk::location &get_location() const noexcept override {
-                return m_location;
+        static_assert(VertexFormat<position>);
+        static_assert(VertexFormat<half_position>);
+        static_assert(VertexFormat<grid_position>);
+        static_assert(VertexFormat<compact>);
+        static_assert(VertexFormat<batched>);
+        static_assert(VertexFormat<particle>);
+        static_assert(VertexFormat<colored>);
+
+        std::vector<half_position> to_half_positions(const float *xyz, std::size_t vertex_count) {
+            std::vector<half_position> result(vertex_count);
+            for (std::size_t i = 0; i < vertex_count; ++i) {
+                result[i].pos = { {
+                    quantize::to_half(xyz[i * 3]),
+                    quantize::to_half(xyz[i * 3 + 1]),
+                    quantize::to_half(xyz[i * 3 + 2]),
+                    quantize::to_half(1.0f)
+                } };
             }
+            return result;
+        }
+    }
+}
 
-            const std::vector<float> &get_vertices() const noexcept override {
-                return m_vertices;
+namespace mk {
+    namespace quantize {
+        float from_half(half value) {
+            std::uint32_t sign = static_cast<std::uint32_t>(value.bits & 0x8000u) << 16;
+            std::uint32_t exponent = (value.bits >> 10) & 0x1Fu;
+            std::uint32_t mantissa = value.bits & 0x3FFu;
+            float result;
+            if (exponent == 0) {
+                result = std::ldexp(static_cast<float>(mantissa), -24);
+                return sign ? -result : result;
             }
+            std::uint32_t f = sign | ((exponent == 0x1F ? 0xFFu : exponent - 15 + 127) << 23) | (mantissa << 13);
+            std::memcpy(&result, &f, sizeof result);
+            return result;
+        }
+    }
 
-            mk::location &location() noexcept override {
-                return m_location;
-            }
+    namespace vertex {
+        glm::vec3 decode_position(const position &v) {
+            return { v.pos.value[0], v.pos.value[1], v.pos.value[2] };
+        }
 
-            void set_vertices(std::vector<float> vertices) override {
-                m_vertices = std::move(vertices);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-                glBufferData(GL_ARRAY_BUFFER, sizeof m_vertices, m_vertices.data(), GL_STATIC_DRAW);
-            }
+        glm::vec3 decode_position(const half_position &v) {
+            return { quantize::from_half(v.pos.value[0]), quantize::from_half(v.pos.value[1]), quantize::from_half(v.pos.value[2]) };
+        }
 
-            void draw() const override {
-                glBindVertexArray(m_vao);
-                glDrawArrays(GL_TRIANGLES, 0, TRIANGLE_VERTEX_COUNT);
-            }
+        glm::vec3 decode_position(const grid_position &v) {
+            return { v.pos.value[0], v.pos.value[1], v.pos.value[2] };
+        }
+
+        glm::vec3 decode_position(const compact &v) {
+            return glm::vec3{ v.pos.value[0], v.pos.value[1], v.pos.value[2] } / 32767.0f;
+        }
+
+        glm::vec3 decode_position(const batched &v) {
+            return { v.pos.value[0], v.pos.value[1], v.pos.value[2] };
+        }
+    }
+
+    namespace geo {
+        template <VertexFormat V>
+        struct indexed_mesh {
+            std::vector<V> vertices;
+            std::vector<GLuint> indices;
+        };
+
+        struct mesh_stats {
+            std::size_t source_vertices = 0;
+            std::size_t unique_vertices = 0;
+            float acmr_before = 0.0f;
+            float acmr_after = 0.0f;
+        };
+    }
+
+    /*
+     * Load-time triangle list optimization:
+     *   weld           - merge bitwise identical vertices into an index buffer
+     *   vertex_cache   - Tipsify (Sander et al. 2007) ordering for post-transform cache hits
+     *   overdraw       - sorts Tipsify's clusters so outward facing ones are drawn first
+     *   vertex_fetch   - renumbers vertices in first use order
+     */
+    namespace mesh_optimizer {
+        constexpr std::size_t default_cache_size = 16;
+
+        /* Average cache miss ratio: transformed vertices per triangle for a FIFO cache. 0.5 is optimal, 3 is worst. */
+        float acmr(const std::vector<GLuint> &indices, std::size_t cache_size = default_cache_size) {
+            if (indices.size() < 3) return 0.0f;
+            std::deque<GLuint> cache;
+            std::size_t misses = 0;
+            for (GLuint index : indices) {
+                if (std::find(cache.begin(), cache.end(), index) != cache.end()) continue;
+                ++misses;
+                cache.push_back(index);
+                if (cache.size() > cache_size) cache.pop_front();
+            }
+            return static_cast<float>(misses) / (indices.size() / 3);
+        }
+
+        template <VertexFormat V>
+        geo::indexed_mesh<V> weld(const std::vector<V> &vertices) {
+            // floats rule out has_unique_object_representations; a packed layout is what keeps padding out of the bytes compared
+            static_assert(std::is_trivially_copyable_v<V> && sizeof(V) == static_cast<std::size_t>(V::layout::stride), 
+                "weld hashes and compares vertices bytewise, they must have no padding");
+
+            struct vertex_hash {
+                std::size_t operator()(const V &v) const noexcept {
+                    return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char *>(&v), sizeof v));
+                }
+            };
+            struct vertex_equal {
+                bool operator()(const V &a, const V &b) const noexcept {
+                    return std::memcmp(&a, &b, sizeof a) == 0;
+                }
+            };
+
+            geo::indexed_mesh<V> mesh;
+            std::unordered_map<V, GLuint, vertex_hash, vertex_equal> unique;
+            mesh.indices.reserve(vertices.size());
+            for (auto &&v : vertices) {
+                auto [it, inserted] = unique.try_emplace(v, static_cast<GLuint>(mesh.vertices.size()));
+                if (inserted) mesh.vertices.push_back(v);
+                mesh.indices.push_back(it->second);
+            }
+            return mesh;
+        }
+
+        /* Returns the reordered index list; cluster_starts receives the first triangle of every cache discontinuity. */
+        std::vector<GLuint> vertex_cache(
+                const std::vector<GLuint> &indices, std::size_t vertex_count,
+                std::vector<std::size_t> &cluster_starts, std::size_t cache_size = default_cache_size) {
+            std::size_t triangle_count = indices.size() / 3;
+
+            // vertex -> triangles adjacency in CSR form
+            std::vector<std::uint32_t> live(vertex_count, 0);
+            for (GLuint index : indices) ++live[index];
+            std::vector<std::uint32_t> offsets(vertex_count + 1, 0);
+            for (std::size_t v = 0; v < vertex_count; ++v) offsets[v + 1] = offsets[v] + live[v];
+            std::vector<std::uint32_t> adjacency(indices.size());
+            {
+                std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+                for (std::size_t i = 0; i < indices.size(); ++i) adjacency[fill[indices[i]]++] = static_cast<std::uint32_t>(i / 3);
+            }
+
+            std::vector<std::size_t> cache_time(vertex_count, 0);
+            std::vector<bool> emitted(triangle_count, false);
+            std::vector<GLuint> dead_end;
+            std::vector<GLuint> candidates;
+            std::vector<GLuint> result;
+            result.reserve(indices.size());
+            cluster_starts.clear();
+
+            std::size_t time = cache_size + 1;
+            std::size_t cursor = 0;
+            long fanning = triangle_count ? static_cast<long>(indices[0]) : -1;
+            bool discontinuity = true;
+
+            auto skip_dead_end = [&]() -> long {
+                while (!dead_end.empty()) {
+                    GLuint v = dead_end.back();
+                    dead_end.pop_back();
+                    if (live[v] > 0) return v;
+                }
+                for (; cursor < vertex_count; ++cursor) {
+                    if (live[cursor] > 0) return static_cast<long>(cursor);
+                }
+                return -1;
+            };
+
+            while (fanning >= 0) {
+                candidates.clear();
+                for (std::uint32_t a = offsets[fanning]; a < offsets[fanning + 1]; ++a) {
+                    std::uint32_t t = adjacency[a];
+                    if (emitted[t]) continue;
+                    if (discontinuity) {
+                        cluster_starts.push_back(result.size() / 3);
+                        discontinuity = false;
+                    }
+                    for (int k = 0; k < 3; ++k) {
+                        GLuint v = indices[t * 3 + k];
+                        result.push_back(v);
+                        dead_end.push_back(v);
+                        candidates.push_back(v);
+                        --live[v];
+                        if (time - cache_time[v] > cache_size) cache_time[v] = time++;
+                    }
+                    emitted[t] = true;
+                }
+
+                // prefer the candidate that is still in the cache and will be in it after its remaining fans
+                long best = -1;
+                long best_priority = -1;
+                for (GLuint v : candidates) {
+                    if (live[v] == 0) continue;
+                    long priority = 0;
+                    if (time - cache_time[v] + 2 * live[v] <= cache_size) priority = static_cast<long>(time - cache_time[v]);
+                    if (priority > best_priority) {
+                        best_priority = priority;
+                        best = v;
+                    }
+                }
+                if (best == -1) {
+                    best = skip_dead_end();
+                    discontinuity = true;
+                }
+                fanning = best;
+            }
+            return result;
+        }
+
+        /* Reorders whole clusters so triangles facing away from the mesh center, which tend to occlude the rest, come first. */
+        template <VertexFormat V>
+        std::vector<GLuint> overdraw(
+                const std::vector<GLuint> &indices, const std::vector<V> &vertices, const std::vector<std::size_t> &cluster_starts) {
+            std::size_t triangle_count = indices.size() / 3;
+            if (cluster_starts.size() < 2) return indices;
+
+            glm::vec3 mesh_center{ 0.0f };
+            for (auto &&v : vertices) mesh_center += vertex::decode_position(v);
+            mesh_center /= static_cast<float>(std::max<std::size_t>(vertices.size(), 1));
+
+            struct cluster {
+                std::size_t begin;
+                std::size_t end;
+                float sort_key;
+            };
+            std::vector<cluster> clusters;
+            for (std::size_t c = 0; c < cluster_starts.size(); ++c) {
+                std::size_t begin = cluster_starts[c];
+                std::size_t end = c + 1 < cluster_starts.size() ? cluster_starts[c + 1] : triangle_count;
+
+                glm::vec3 centroid{ 0.0f };
+                glm::vec3 normal{ 0.0f };
+                float area = 0.0f;
+                for (std::size_t t = begin; t < end; ++t) {
+                    auto p0 = vertex::decode_position(vertices[indices[t * 3]]);
+                    auto p1 = vertex::decode_position(vertices[indices[t * 3 + 1]]);
+                    auto p2 = vertex::decode_position(vertices[indices[t * 3 + 2]]);
+                    auto n = glm::cross(p1 - p0, p2 - p0);    // length is twice the area
+                    float a = glm::length(n);
+                    centroid += (p0 + p1 + p2) * (a / 3.0f);
+                    normal += n;
+                    area += a;
+                }
+                float key = 0.0f;
+                if (area > 0.0f && glm::length(normal) > 0.0f) {
+                    key = glm::dot(centroid / area - mesh_center, glm::normalize(normal));
+                }
+                clusters.push_back({ begin, end, key });
+            }
+
+            std::stable_sort(clusters.begin(), clusters.end(), [](const cluster &a, const cluster &b) {
+                return a.sort_key > b.sort_key;
+            });
+
+            std::vector<GLuint> result;
+            result.reserve(indices.size());
+            for (auto &&c : clusters) {
+                result.insert(result.end(), indices.begin() + c.begin * 3, indices.begin() + c.end * 3);
+            }
+            return result;
+        }
+
+        /* Renumbers vertices in the order the index buffer first touches them and drops unreferenced ones. */
+        template <VertexFormat V>
+        void vertex_fetch(geo::indexed_mesh<V> &mesh) {
+            constexpr GLuint unused = ~GLuint{ 0 };
+            std::vector<GLuint> remap(mesh.vertices.size(), unused);
+            std::vector<V> vertices;
+            vertices.reserve(mesh.vertices.size());
+            for (auto &&index : mesh.indices) {
+                if (remap[index] == unused) {
+                    remap[index] = static_cast<GLuint>(vertices.size());
+                    vertices.push_back(mesh.vertices[index]);
+                }
+                index = remap[index];
+            }
+            mesh.vertices = std::move(vertices);
+        }
+
+        /* Throws unless the indices form a triangle list over mesh.vertices; the passes above index without checks. */
+        template <VertexFormat V>
+        geo::mesh_stats optimize(geo::indexed_mesh<V> &mesh, std::size_t source_vertices) {
+            if (mesh.indices.size() % 3 != 0) {
+                throw std::runtime_error("Mesh has " + std::to_string(mesh.indices.size()) + " indices, not a whole number of triangles.");
+            }
+            for (GLuint index : mesh.indices) {
+                if (index >= mesh.vertices.size()) {
+                    throw std::runtime_error("Mesh index " + std::to_string(index) + " is out of range of " + std::to_string(mesh.vertices.size()) + " vertices.");
+                }
+            }
+            geo::mesh_stats stats;
+            stats.source_vertices = source_vertices;
+            stats.acmr_before = acmr(mesh.indices);
+            if (mesh.indices.empty()) {
+                // nothing to reorder, and the passes below assume at least one triangle
+                stats.unique_vertices = mesh.vertices.size();
+                stats.acmr_after = stats.acmr_before;
+                return stats;
+            }
+
+            std::vector<std::size_t> clusters;
+            mesh.indices = vertex_cache(mesh.indices, mesh.vertices.size(), clusters);
+            mesh.indices = overdraw(mesh.indices, mesh.vertices, clusters);
+            vertex_fetch(mesh);
+
+            stats.unique_vertices = mesh.vertices.size();
+            stats.acmr_after = acmr(mesh.indices);
+            return stats;
+        }
+    }
+
+    namespace geo {
+        /*
+         * Optimized meshes by name. Every mesh is welded and reordered once when first loaded,
+         * later loads share the same data while anyone still holds it. The cache itself only keeps
+         * weak references, so a mesh nobody uses any more (say a sphere tessellation the sliders
+         * moved past) is freed and built again if it is ever asked for. `stats`, when given,
+         * receives what the optimizer did.
+         */
+        template <VertexFormat V>
+        class mesh_cache {
+        public:
+            using builder_fn = std::function<indexed_mesh<V>()>;
+
+            static std::shared_ptr<const indexed_mesh<V>> load(const std::string &name, const builder_fn &build, mesh_stats *stats = nullptr) {
+                memory::scope tag(memory::tag::MESHES);
+                std::lock_guard lock(s_mutex);
+                if (auto match = s_meshes.find(name); match != s_meshes.end()) {
+                    if (auto mesh = match->second.mesh.lock()) {
+                        if (stats) *stats = match->second.stats;
+                        return mesh;
+                    }
+                }
+                std::erase_if(s_meshes, [](auto &&e) { return e.second.mesh.expired(); });
+
+                auto mesh = std::make_shared<indexed_mesh<V>>(build());
+                std::size_t source_vertices = mesh->vertices.size();
+                if (mesh->indices.empty()) {
+                    *mesh = mesh_optimizer::weld(mesh->vertices);
+                }
+                auto optimized = mesh_optimizer::optimize(*mesh, source_vertices);
+                if (stats) *stats = optimized;
+
+                s_meshes.insert_or_assign(name, entry{ mesh, optimized });
+                return mesh;
+            }
+
+        private:
+            struct entry {
+                std::weak_ptr<const indexed_mesh<V>> mesh;
+                mesh_stats stats;
+            };
+
+            static inline std::mutex s_mutex;
+            static inline std::unordered_map<std::string, entry> s_meshes;
+        };
+
+        /* Uploads into the given buffers; the VAO has to be bound so it captures the element buffer. */
+        template <VertexFormat V>
+        void upload_mesh(GLuint vbo, GLuint ebo, const indexed_mesh<V> &mesh) {
+            glBindBuffer(GL_ARRAY_BUFFER, vbo);
+            memory::buffer_data(memory::tag::MESHES, GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(V), mesh.vertices.data(), GL_STATIC_DRAW);
+            V::layout::apply();
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+            memory::buffer_data(memory::tag::MESHES, GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size() * sizeof(GLuint), mesh.indices.data(), GL_STATIC_DRAW);
+        }
+    }
+}
+
+namespace mk {
+    class location {
+    public:
+        location() : pos(0) { }
+        location(glm::vec3 p_pos) : pos(p_pos) { }
+
+        glm::mat4 get_matrix() const noexcept {
+            return glm::translate(glm::identity<glm::mat4>(), pos);
+        }
+
+        glm::vec3 pos;
+    };
+
+    struct trs {
+        glm::vec3 translation{ 0.0f };
+        glm::quat rotation = glm::identity<glm::quat>();
+        glm::vec3 scale{ 1.0f };
+
+        glm::mat4 get_matrix() const noexcept {
+            glm::mat4 m = glm::mat4_cast(rotation);
+            m[0] *= scale.x;
+            m[1] *= scale.y;
+            m[2] *= scale.z;
+            m[3] = glm::vec4{ translation, 1.0f };
+            return m;
+        }
+    };
+
+    /*
+     * Parent/child transforms. Nodes are addressed by stable handles but stored as arrays sorted
+     * by depth, so every parent precedes its children and each depth level is one contiguous range.
+     * update() walks the levels in order and splits each across the thread pool; a node is only
+     * recomputed if its own local transform or its parent's world transform changed this update.
+     */
+    class transform_hierarchy {
+    public:
+        using handle = std::uint32_t;
+        static constexpr handle no_parent = std::numeric_limits<handle>::max();
+        static constexpr std::size_t grain = 2048;
+
+        handle create(handle parent = no_parent, const trs &local = {}) {
+            if (parent != no_parent && !alive(parent)) throw std::runtime_error("Parent transform does not exist.");
+            handle h;
+            if (!m_free.empty()) {
+                h = m_free.back();
+                m_free.pop_back();
+            }
+            else {
+                h = static_cast<handle>(m_slot_of.size());
+                m_slot_of.push_back(npos);
+            }
+
+            // appended out of order; the next update sorts it into its level
+            m_slot_of[h] = static_cast<std::uint32_t>(m_handles.size());
+            m_handles.push_back(h);
+            m_parents.push_back(parent == no_parent ? npos : m_slot_of[parent]);
+            m_locals.push_back(local);
+            m_worlds.push_back(glm::mat4{ 1.0f });
+            m_dirty.push_back(1);
+            m_order_dirty = true;
+            return h;
+        }
+
+        /* Destroys the node and its whole subtree. */
+        void destroy(handle h) {
+            if (!alive(h)) return;
+            m_dead.push_back(h);
+            m_order_dirty = true;
+        }
+
+        bool alive(handle h) const noexcept {
+            return h < m_slot_of.size() && m_slot_of[h] != npos;
+        }
+
+        const trs &get_local(handle h) const { return m_locals[m_slot_of[h]]; }
+
+        void set_local(handle h, const trs &local) {
+            auto slot = m_slot_of[h];
+            m_locals[slot] = local;
+            m_dirty[slot] = 1;
+        }
+
+        /* World transform as of the last update(). */
+        const glm::mat4 &get_world(handle h) const { return m_worlds[m_slot_of[h]]; }
+
+        void update(thread_pool &pool) {
+            if (m_order_dirty) sort_by_depth();
+
+            m_updated.store(0, std::memory_order_relaxed);
+            for (std::size_t level = 0; level + 1 < m_levels.size(); ++level) {
+                std::size_t begin = m_levels[level], end = m_levels[level + 1];
+                pool.parallel_for(end - begin, grain, [&](std::size_t first, std::size_t last) {
+                    std::size_t updated = 0;
+                    for (std::size_t slot = begin + first; slot < begin + last; ++slot) {
+                        auto parent = m_parents[slot];
+                        // m_dirty of a parent is still set here, it is only cleared after the last level
+                        if (!m_dirty[slot] && (parent == npos || !m_dirty[parent])) continue;
+                        m_dirty[slot] = 1;
+                        m_worlds[slot] = parent == npos ? m_locals[slot].get_matrix() : m_worlds[parent] * m_locals[slot].get_matrix();
+                        ++updated;
+                    }
+                    m_updated.fetch_add(updated, std::memory_order_relaxed);
+                });
+            }
+            std::fill(m_dirty.begin(), m_dirty.end(), std::uint8_t{ 0 });
+        }
+
+        std::size_t size() const noexcept { return m_handles.size(); }
+        std::size_t get_level_count() const noexcept { return m_levels.empty() ? 0 : m_levels.size() - 1; }
+        std::size_t get_updated_count() const noexcept { return m_updated.load(std::memory_order_relaxed); }
+
+    private:
+        static constexpr std::uint32_t npos = std::numeric_limits<std::uint32_t>::max();
+
+        /* Drops destroyed subtrees and reorders everything by depth, keeping the order within a level. */
+        void sort_by_depth() {
+            std::size_t count = m_handles.size();
+            std::vector<std::uint8_t> dead(count, 0);
+            for (auto h : m_dead) dead[m_slot_of[h]] = 1;
+            m_dead.clear();
+
+            // a node's depth needs its parent's first, and parents may sit after their children until sorted
+            std::vector<std::uint32_t> depth(count, npos);
+            std::vector<std::uint32_t> chain;
+            for (std::uint32_t slot = 0; slot < count; ++slot) {
+                auto top = slot;
+                chain.clear();
+                while (depth[top] == npos && m_parents[top] != npos) {
+                    chain.push_back(top);
+                    top = m_parents[top];
+                }
+                if (depth[top] == npos) depth[top] = 0;
+                for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+                    depth[*it] = depth[m_parents[*it]] + 1;
+                    dead[*it] = dead[*it] || dead[m_parents[*it]];
+                }
+            }
+
+            std::vector<std::size_t> level_sizes;
+            for (std::uint32_t slot = 0; slot < count; ++slot) {
+                if (dead[slot]) continue;
+                if (depth[slot] >= level_sizes.size()) level_sizes.resize(depth[slot] + 1, 0);
+                ++level_sizes[depth[slot]];
+            }
+            m_levels.assign(level_sizes.size() + 1, 0);
+            for (std::size_t level = 0; level < level_sizes.size(); ++level) m_levels[level + 1] = m_levels[level] + level_sizes[level];
+
+            std::vector<std::uint32_t> new_slot(count, npos);
+            auto cursor = m_levels;
+            for (std::uint32_t slot = 0; slot < count; ++slot) {
+                if (!dead[slot]) new_slot[slot] = static_cast<std::uint32_t>(cursor[depth[slot]]++);
+            }
+
+            std::size_t alive_count = m_levels.back();
+            std::vector<handle> handles(alive_count);
+            std::vector<std::uint32_t> parents(alive_count);
+            std::vector<trs> locals(alive_count);
+            std::vector<glm::mat4> worlds(alive_count);
+            std::vector<std::uint8_t> dirty(alive_count);
+            for (std::uint32_t slot = 0; slot < count; ++slot) {
+                auto h = m_handles[slot];
+                if (dead[slot]) {
+                    m_slot_of[h] = npos;
+                    m_free.push_back(h);
+                    continue;
+                }
+                auto to = new_slot[slot];
+                handles[to] = h;
+                parents[to] = m_parents[slot] == npos ? npos : new_slot[m_parents[slot]];
+                locals[to] = m_locals[slot];
+                worlds[to] = m_worlds[slot];
+                dirty[to] = m_dirty[slot];
+                m_slot_of[h] = to;
+            }
+            m_handles = std::move(handles);
+            m_parents = std::move(parents);
+            m_locals = std::move(locals);
+            m_worlds = std::move(worlds);
+            m_dirty = std::move(dirty);
+            m_order_dirty = false;
+        }
+
+        std::vector<std::uint32_t> m_slot_of;   // handle -> slot
+        std::vector<handle> m_free;
+        std::vector<handle> m_dead;
+
+        // structure of arrays in depth order, indexed by slot
+        std::vector<handle> m_handles;
+        std::vector<std::uint32_t> m_parents;
+        std::vector<trs> m_locals;
+        std::vector<glm::mat4> m_worlds;
+        std::vector<std::uint8_t> m_dirty;
+        std::vector<std::size_t> m_levels;      // level i spans [m_levels[i], m_levels[i + 1])
+
+        bool m_order_dirty = false;
+        std::atomic<std::size_t> m_updated{ 0 };
+    };
+
+    namespace geo {
+        static constexpr size_t error_id = 0ULL;
+
+        size_t next_id() {
+            static auto __next_id = 1ULL;
+            return __next_id++;
+        }
+
+        /* Initialized statically in implementation of mk::geo::geometry where geometry::set_vertices() is unsafe */
+        class __warn_geometry_reinit { 
+        public: __warn_geometry_reinit() { std::cout << "Warning: Changing vertices for this object is not recommended.\n"; } 
+        };
+
+        /* Bounding sphere around the origin of a packed xyz vertex list, in model space. */
+        float bounding_radius(const std::vector<float> &vertices) {
+            float radius_sq = 0.0f;
+            for (std::size_t i = 0; i + 2 < vertices.size(); i += 3) {
+                radius_sq = std::max(radius_sq, 
+                    vertices[i] * vertices[i] + vertices[i + 1] * vertices[i + 1] + vertices[i + 2] * vertices[i + 2]);
+            }
+            return std::sqrt(radius_sq);
+        }
+
+        /* Model-space bounds of a packed xyz vertex list. */
+        std::pair<glm::vec3, glm::vec3> bounding_box(const std::vector<float> &vertices) {
+            glm::vec3 min{ std::numeric_limits<float>::max() };
+            glm::vec3 max{ std::numeric_limits<float>::lowest() };
+            for (std::size_t i = 0; i + 2 < vertices.size(); i += 3) {
+                glm::vec3 v{ vertices[i], vertices[i + 1], vertices[i + 2] };
+                min = glm::min(min, v);
+                max = glm::max(max, v);
+            }
+            return { min, max };
+        }
+
+        /* Model-space box and origin-centered sphere, computed whenever a geometry's vertices change. */
+        struct bounds {
+            glm::vec3 min{ 0.0f };
+            glm::vec3 max{ 0.0f };
+            float radius = 0.0f;
+
+            static bounds of(const std::vector<float> &vertices) {
+                auto [min, max] = bounding_box(vertices);
+                return { min, max, bounding_radius(vertices) };
+            }
+        };
+
+        class geometry {
+        public:
+            virtual size_t get_id() const noexcept = 0;
+            virtual GLuint get_vao() const noexcept = 0;
+            virtual GLuint get_vbo() const noexcept = 0;
+            virtual const mk::location &get_location() const noexcept = 0;
+            virtual const std::vector<float> &get_vertices() const noexcept = 0;
+            virtual const bounds &get_bounds() const noexcept = 0;
+
+            virtual mk::location &location() noexcept = 0;
+            
+            virtual void set_vertices(std::vector<float> vertices) = 0;
+
+            virtual void draw() const = 0;
+        };
+
+        constexpr size_t TRIANGLE_VERTEX_COUNT = 3;
+
+        class triangle : public geometry {
+        private:
+            void build() {
+                memory::gen_vertex_arrays(1, &m_vao);
+                glBindVertexArray(m_vao);
+                memory::gen_buffers(1, &m_vbo);
+                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+                memory::buffer_data(memory::tag::MESHES, GL_ARRAY_BUFFER, sizeof(float) * m_vertices.size(), m_vertices.data(), GL_STATIC_DRAW);
+                vertex::position::layout::apply();
+
+                m_bounds = bounds::of(m_vertices);
+                m_id = next_id();
+            }
+
+            // for copy constructor
+            triangle(std::vector<float> vertices, bool stupid) : m_vertices(std::move(vertices)) {
+                build();
+            }
+        public:
+            triangle(std::array<float, TRIANGLE_VERTEX_COUNT * 3> vertices) : m_location() {
+                for (auto &&v : vertices) m_vertices.push_back(v);
+                build();
+            }
+
+            ~triangle() {
+                memory::delete_vertex_arrays(1, &m_vao);
+                memory::delete_buffers(1, &m_vbo);
+            }
+
+            triangle(const triangle &other) : triangle(other.m_vertices, true) { }
+
+            triangle &operator=(const triangle &other) {
+                return *this = triangle(other);
+            }
+
+            triangle(triangle &&other) {
+                std::swap(m_vao, other.m_vao);
+                std::swap(m_vbo, other.m_vbo);
+                std::swap(m_location, other.m_location);
+                std::swap(m_vertices, other.m_vertices);
+                std::swap(m_bounds, other.m_bounds);
+                std::cout << "move\n";
+            }
+
+            triangle &operator=(triangle &&other) {
+                std::swap(m_vao, other.m_vao);
+                std::swap(m_vbo, other.m_vbo);
+                std::swap(m_location, other.m_location);
+                std::swap(m_vertices, other.m_vertices);
+                std::swap(m_bounds, other.m_bounds);
+                std::cout << "move\n";
+                return *this;
+            }
+
+            size_t get_id() const noexcept override {
+                return m_id;
+            }
+
+            GLuint get_vao() const noexcept override {
+                return m_vao;
+            }
+
+            GLuint get_vbo() const noexcept override {
+                return m_vbo;
+            }
+
+            const mk::location &get_location() const noexcept override {
+                return m_location;
+            }
+
+            const std::vector<float> &get_vertices() const noexcept override {
+                return m_vertices;
+            }
+
+            const bounds &get_bounds() const noexcept override {
+                return m_bounds;
+            }
+
+            mk::location &location() noexcept override {
+                return m_location;
+            }
+
+            void set_vertices(std::vector<float> vertices) override {
+                m_vertices = std::move(vertices);
+                m_bounds = bounds::of(m_vertices);
+                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+                memory::buffer_data(memory::tag::MESHES, GL_ARRAY_BUFFER, sizeof(float) * m_vertices.size(), m_vertices.data(), GL_STATIC_DRAW);
+            }
+
+            void draw() const override {
+                glBindVertexArray(m_vao);
+                glDrawArrays(GL_TRIANGLES, 0, TRIANGLE_VERTEX_COUNT);
+            }
 
         private:
             GLuint m_id;
@@ -458,6 +1693,7 @@ namespace mk {
             GLuint m_vbo;
             mk::location m_location;
             std::vector<float> m_vertices;
+            bounds m_bounds;
         };
 
         constexpr float __cube_vertices[36 * 3] = {
@@ -504,38 +1740,45 @@ namespace mk {
             -0.5f,  0.5f, -0.5f
         };
 
+        /* The 36 cube corners above welded down to 8 indexed vertices. */
+        std::shared_ptr<const indexed_mesh<vertex::half_position>> load_cube_mesh() {
+            return mesh_cache<vertex::half_position>::load("cube", [] {
+                return indexed_mesh<vertex::half_position>{ vertex::to_half_positions(__cube_vertices, 36), {} };
+            });
+        }
+
         class cube : public geometry {
         public:
-            cube() : m_location(glm::vec3(0.0f)) {
-                glGenVertexArrays(1, &m_vao);
+            cube() : m_location(glm::vec3(0.0f)), m_mesh(load_cube_mesh()) {
+                memory::gen_vertex_arrays(1, &m_vao);
                 glBindVertexArray(m_vao);
-                glGenBuffers(1, &m_vbo);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-                glBufferData(GL_ARRAY_BUFFER, sizeof __cube_vertices, __cube_vertices, GL_STATIC_DRAW);
-                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), static_cast<void *>(0));
-                glEnableVertexAttribArray(0);
+                memory::gen_buffers(1, &m_vbo);
+                memory::gen_buffers(1, &m_ebo);
+                upload_mesh(m_vbo, m_ebo, *m_mesh);
 
                 m_vertices.assign(__cube_vertices, __cube_vertices + 36 * 3);
+                m_bounds = bounds::of(m_vertices);
                 m_id = next_id();
             }
 
             ~cube() {
-                glDeleteVertexArrays(1, &m_vao);
-                glDeleteBuffers(1, &m_vbo);
+                memory::delete_vertex_arrays(1, &m_vao);
+                memory::delete_buffers(1, &m_vbo);
+                memory::delete_buffers(1, &m_ebo);
             }
 
             cube(const cube &other) {
                 this->m_vertices = other.m_vertices;
+                this->m_bounds = other.m_bounds;
                 this->m_location = other.m_location;
+                this->m_mesh = other.m_mesh;
                 this->m_id = next_id();
 
-                glGenVertexArrays(1, &m_vao);
+                memory::gen_vertex_arrays(1, &m_vao);
                 glBindVertexArray(m_vao);
-                glGenBuffers(1, &m_vbo);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-                glBufferData(GL_ARRAY_BUFFER, sizeof __cube_vertices, this->m_vertices.data(), GL_STATIC_DRAW);
-                glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), static_cast<void *>(0));
-                glEnableVertexAttribArray(0);
+                memory::gen_buffers(1, &m_vbo);
+                memory::gen_buffers(1, &m_ebo);
+                upload_mesh(m_vbo, m_ebo, *m_mesh);
             }
 
             cube &operator=(const cube &other) {
@@ -544,10 +1787,13 @@ namespace mk {
 
             cube(cube &&other) noexcept {
                 std::swap(this->m_vertices, other.m_vertices);
+                std::swap(this->m_bounds, other.m_bounds);
                 std::swap(this->m_location, other.m_location);
                 std::swap(this->m_id, other.m_id);
                 std::swap(this->m_vao, other.m_vao);
                 std::swap(this->m_vbo, other.m_vbo);
+                std::swap(this->m_ebo, other.m_ebo);
+                std::swap(this->m_mesh, other.m_mesh);
             }
 
             cube &operator=(cube &&other) noexcept {
@@ -574,6 +1820,10 @@ namespace mk {
                 return m_vertices;
             }
 
+            const bounds &get_bounds() const noexcept override {
+                return m_bounds;
+            }
+
             mk::location &location() noexcept override {
                 return m_location;
             }
@@ -581,21 +1831,31 @@ namespace mk {
             void set_vertices(std::vector<float> vertices) override {
                 static __warn_geometry_reinit _w{};
                 m_vertices = std::move(vertices);
-                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-                glBufferData(GL_ARRAY_BUFFER, 108 * sizeof(float), m_vertices.data(), GL_STATIC_DRAW);
+                m_bounds = bounds::of(m_vertices);
+
+                // custom vertices are optimized but not shared through the mesh cache
+                auto mesh = mesh_optimizer::weld(vertex::to_half_positions(m_vertices.data(), m_vertices.size() / 3));
+                mesh_optimizer::optimize(mesh, m_vertices.size() / 3);
+                m_mesh = std::make_shared<const indexed_mesh<vertex::half_position>>(std::move(mesh));
+
+                glBindVertexArray(m_vao);
+                upload_mesh(m_vbo, m_ebo, *m_mesh);
             }
 
             void draw() const override {
                 glBindVertexArray(m_vao);
-                glDrawArrays(GL_TRIANGLES, 0, 36);
+                glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_mesh->indices.size()), GL_UNSIGNED_INT, nullptr);
             }
 
         private:
             std::size_t m_id;
             GLuint m_vao;
             GLuint m_vbo;
+            GLuint m_ebo;
             mk::location m_location;
             std::vector<float> m_vertices;
+            bounds m_bounds;
+            std::shared_ptr<const indexed_mesh<vertex::half_position>> m_mesh;
         };
 
         std::shared_ptr<geometry> create_triangle(std::array<float, 9> vertices) {
@@ -605,18 +1865,104 @@ namespace mk {
         std::shared_ptr<geometry> create_cube() {
             return std::shared_ptr<geometry>(new cube());
         }
-    }
 
-    class light {
-    public:
-        light() : m_id{ geo::next_id() }, m_location{ } {
-            glGenVertexArrays(1, &m_vao);
-            glBindVertexArray(m_vao);
-            glGenBuffers(1, &m_vbo);
-            glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
-            glBufferData(GL_ARRAY_BUFFER, sizeof geo::__cube_vertices, geo::__cube_vertices, GL_STATIC_DRAW);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), static_cast<void *>(0));
-            glEnableVertexAttribArray(0);
+        /* Unit UV sphere with normals and texture coordinates. Scale by the radius in the model matrix. */
+        std::vector<vertex::compact> generate_sphere_vertices(int sector_count, int stack_count) {
+            static constexpr float PI = 3.14159265359f;
+
+            std::vector<vertex::compact> vertices;
+            vertices.reserve(static_cast<std::size_t>(stack_count + 1) * (sector_count + 1));
+
+            float sector_step = 2 * PI / sector_count;
+            float stack_step = PI / stack_count;
+
+            for (int i = 0; i <= stack_count; ++i) {
+                float stack_angle = PI / 2 - i * stack_step;
+                float xy = cosf(stack_angle);
+                float z = sinf(stack_angle);
+
+                for (int j = 0; j <= sector_count; ++j) {
+                    float sector_angle = j * sector_step;
+                    float x = xy * cosf(sector_angle);
+                    float y = xy * sinf(sector_angle);
+
+                    // on a unit sphere the normal is the position
+                    vertex::compact v;
+                    v.pos = { { quantize::snorm16(x), quantize::snorm16(y), quantize::snorm16(z), 32767 } };
+                    v.normal = { { quantize::snorm8(x), quantize::snorm8(y), quantize::snorm8(z), 0 } };
+                    v.uv = { {
+                        quantize::to_half(static_cast<float>(j) / sector_count),
+                        quantize::to_half(static_cast<float>(i) / stack_count)
+                    } };
+                    vertices.push_back(v);
+                }
+            }
+            return vertices;
+        }
+
+        std::shared_ptr<const indexed_mesh<vertex::compact>> load_sphere_mesh(int sector_count, int stack_count, mesh_stats *stats = nullptr) {
+            return mesh_cache<vertex::compact>::load(std::format("sphere_{}x{}", sector_count, stack_count), [=] {
+                indexed_mesh<vertex::compact> mesh{ generate_sphere_vertices(sector_count, stack_count), {} };
+
+                GLuint k1, k2;
+                for (int i = 0; i < stack_count; ++i) {
+                    k1 = i * (sector_count + 1);
+                    k2 = k1 + sector_count + 1;
+
+                    for (int j = 0; j < sector_count; ++j, ++k1, ++k2) {
+                        if (i != 0) {
+                            mesh.indices.insert(mesh.indices.end(), { k1, k2, k1 + 1 });
+                        }
+                        if (i != stack_count - 1) {
+                            mesh.indices.insert(mesh.indices.end(), { k1 + 1, k2, k2 + 1 });
+                        }
+                    }
+                }
+                return mesh;
+            }, stats);
+        }
+
+        /* (slices + 1)^2 integral points in the xz plane, row by row along x. */
+        std::vector<vertex::grid_position> generate_grid_vertices(int slices) {
+            std::vector<vertex::grid_position> vertices;
+            vertices.reserve(static_cast<std::size_t>(slices + 1) * (slices + 1));
+            for (int j = 0; j <= slices; ++j) {
+                for (int i = 0; i <= slices; ++i) {
+                    vertices.push_back({ { { static_cast<std::int16_t>(i), std::int16_t{ 0 }, static_cast<std::int16_t>(j), 1 } } });
+                }
+            }
+            return vertices;
+        }
+
+        /*
+         * Two triangles per cell, grouped by quadrant (-x-z, +x-z, -x+z, +x+z) so that each quarter
+         * of the grid is a contiguous quarter of the index list. slices has to be even.
+         */
+        std::vector<GLuint> generate_grid_triangles(int slices) {
+            std::vector<GLuint> indices;
+            indices.reserve(static_cast<std::size_t>(slices) * slices * 6);
+            auto at = [slices](int i, int j) { return static_cast<GLuint>(j * (slices + 1) + i); };
+            int half = slices / 2;
+            for (int quadrant = 0; quadrant < 4; ++quadrant) {
+                int i0 = (quadrant & 1) * half, j0 = (quadrant >> 1) * half;
+                for (int j = j0; j < j0 + half; ++j) {
+                    for (int i = i0; i < i0 + half; ++i) {
+                        indices.insert(indices.end(), { at(i, j), at(i, j + 1), at(i + 1, j), at(i + 1, j), at(i, j + 1), at(i + 1, j + 1) });
+                    }
+                }
+            }
+            return indices;
+        }
+    }
+
+    class light {
+    public:
+        light() : m_id{ geo::next_id() }, m_location{ }, m_mesh{ geo::load_cube_mesh() } {
+            memory::gen_vertex_arrays(1, &m_vao);
+            glBindVertexArray(m_vao);
+            memory::gen_buffers(1, &m_vbo);
+            memory::gen_buffers(1, &m_ebo);
+            geo::upload_mesh(m_vbo, m_ebo, *m_mesh);
         }
 
         // TODO copy and move constructors
@@ -629,14 +1975,16 @@ namespace mk {
 
         void draw() {
             glBindVertexArray(m_vao);
-            glDrawArrays(GL_TRIANGLES, 0, 36);
+            glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_mesh->indices.size()), GL_UNSIGNED_INT, nullptr);
         }
 
     private:
         std::size_t m_id;
         GLuint m_vao;
         GLuint m_vbo;
+        GLuint m_ebo;
         mk::location m_location;
+        std::shared_ptr<const geo::indexed_mesh<vertex::half_position>> m_mesh;
     };
 }
 
@@ -749,10 +2097,4545 @@ public:
         return nullptr;
     }
 
-    std::unordered_map<std::size_t, std::shared_ptr<mk::geo::geometry>> geometries;
-private:
-    std::array<float, 4> m_sky_color;
-};
+    std::unordered_map<std::size_t, std::shared_ptr<mk::geo::geometry>> geometries;
+private:
+    std::array<float, 4> m_sky_color;
+};
+
+namespace mk {
+    /* Planes are stored as (normal, distance) with normals pointing into the frustum. */
+    class frustum {
+    public:
+        frustum() = default;
+        explicit frustum(const glm::mat4 &view_projection) {
+            auto row = [&](int r) {
+                return glm::vec4{ view_projection[0][r], view_projection[1][r], view_projection[2][r], view_projection[3][r] };
+            };
+            m_planes[0] = row(3) + row(0);
+            m_planes[1] = row(3) - row(0);
+            m_planes[2] = row(3) + row(1);
+            m_planes[3] = row(3) - row(1);
+            m_planes[4] = row(3) + row(2);
+            m_planes[5] = row(3) - row(2);
+            for (auto &&plane : m_planes) {
+                plane /= glm::length(glm::vec3{ plane.x, plane.y, plane.z });
+            }
+        }
+
+        bool intersects_sphere(glm::vec3 center, float radius) const noexcept {
+            for (auto &&plane : m_planes) {
+                if (glm::dot(glm::vec3{ plane.x, plane.y, plane.z }, center) + plane.w < -radius) return false;
+            }
+            return true;
+        }
+
+        bool intersects_aabb(glm::vec3 min, glm::vec3 max) const noexcept {
+            for (auto &&plane : m_planes) {
+                glm::vec3 positive{
+                    plane.x >= 0 ? max.x : min.x,
+                    plane.y >= 0 ? max.y : min.y,
+                    plane.z >= 0 ? max.z : min.z
+                };
+                if (glm::dot(glm::vec3{ plane.x, plane.y, plane.z }, positive) + plane.w < 0) return false;
+            }
+            return true;
+        }
+
+        const std::array<glm::vec4, 6> &get_planes() const noexcept { return m_planes; }
+
+    private:
+        std::array<glm::vec4, 6> m_planes{};
+    };
+
+    struct occlusion_stats {
+        std::size_t occluders = 0;
+        std::size_t triangles = 0;
+        std::size_t tested = 0;
+        std::size_t culled = 0;
+        float raster_ms = 0.0f;
+    };
+
+    /*
+     * Low resolution software depth buffer for occlusion culling. Occluder triangles are rasterized
+     * into horizontal bands on the thread pool, four pixels at a time with SSE where available,
+     * keeping the nearest depth. A max-depth (farthest) pyramid is built on top and bounding boxes
+     * are visible unless their nearest depth is behind everything in the pyramid texels they cover.
+     * Depth is window-space z in [0, 1]. Everything stays on the CPU.
+     */
+    class occlusion_buffer {
+    public:
+        static constexpr int default_width = 256;
+        static constexpr int default_height = 128;
+        static constexpr int band_height = 8;
+        static constexpr float near_w = 1e-3f;
+
+        occlusion_buffer(int width = default_width, int height = default_height) {
+            resize(width, height);
+        }
+
+        void resize(int width, int height) {
+            m_width = (width + 3) & ~3;     // rows are processed four pixels at a time
+            m_height = height;
+            m_levels.clear();
+            for (int w = m_width, h = m_height; ; w = std::max(w / 2, 1), h = std::max(h / 2, 1)) {
+                m_levels.push_back({ w, h, std::vector<float>(static_cast<std::size_t>(w) * h, 1.0f) });
+                if (w == 1 && h == 1) break;
+            }
+        }
+
+        void clear() {
+            std::fill(m_levels[0].depth.begin(), m_levels[0].depth.end(), 1.0f);
+            m_triangles.clear();
+        }
+
+        /* Queues the triangles of a packed xyz list; rasterize() draws everything queued. */
+        void add_occluder(const glm::mat4 &model_view_projection, const std::vector<float> &vertices) {
+            for (std::size_t i = 0; i + 8 < vertices.size(); i += 9) {
+                screen_triangle t;
+                bool clipped = false;
+                for (int k = 0; k < 3; ++k) {
+                    auto clip = model_view_projection * glm::vec4{ vertices[i + k * 3], vertices[i + k * 3 + 1], vertices[i + k * 3 + 2], 1.0f };
+                    // no near plane clipping: dropping an occluder triangle only makes culling less aggressive
+                    if (clip.w < near_w) { clipped = true; break; }
+                    t.v[k] = to_screen(clip);
+                }
+                if (clipped) continue;
+                m_triangles.push_back(t);
+            }
+        }
+
+        void rasterize(thread_pool &pool) {
+            std::size_t bands = static_cast<std::size_t>((m_height + band_height - 1) / band_height);
+            pool.parallel_for(bands, 1, [this](std::size_t begin, std::size_t end) {
+                for (std::size_t band = begin; band < end; ++band) {
+                    int y0 = static_cast<int>(band) * band_height;
+                    int y1 = std::min(y0 + band_height, m_height);
+                    for (auto &&t : m_triangles) rasterize_triangle(t, y0, y1);
+                }
+            });
+            build_pyramid();
+        }
+
+        bool is_visible(const glm::mat4 &view_projection, glm::vec3 min, glm::vec3 max) const {
+            glm::vec2 rect_min{ std::numeric_limits<float>::max() };
+            glm::vec2 rect_max{ std::numeric_limits<float>::lowest() };
+            float nearest = 1.0f;
+            for (int corner = 0; corner < 8; ++corner) {
+                glm::vec4 p{ corner & 1 ? max.x : min.x, corner & 2 ? max.y : min.y, corner & 4 ? max.z : min.z, 1.0f };
+                auto clip = view_projection * p;
+                if (clip.w < near_w) return true;
+                auto s = to_screen(clip);
+                rect_min = glm::min(rect_min, glm::vec2{ s.x, s.y });
+                rect_max = glm::max(rect_max, glm::vec2{ s.x, s.y });
+                nearest = std::min(nearest, s.z);
+            }
+
+            rect_min = glm::max(rect_min, glm::vec2{ 0.0f });
+            rect_max = glm::min(rect_max, glm::vec2{ static_cast<float>(m_width - 1), static_cast<float>(m_height - 1) });
+            if (rect_min.x > rect_max.x || rect_min.y > rect_max.y) return true;    // off screen, the frustum test decides
+
+            // the level where the rectangle spans at most two texels per axis
+            float extent = std::max(rect_max.x - rect_min.x, rect_max.y - rect_min.y);
+            int level = std::clamp(static_cast<int>(std::ceil(std::log2(std::max(extent, 1.0f)))), 0, static_cast<int>(m_levels.size()) - 1);
+            auto &&l = m_levels[level];
+            int x0 = std::min(static_cast<int>(rect_min.x) >> level, l.width - 1);
+            int x1 = std::min(static_cast<int>(rect_max.x) >> level, l.width - 1);
+            int y0 = std::min(static_cast<int>(rect_min.y) >> level, l.height - 1);
+            int y1 = std::min(static_cast<int>(rect_max.y) >> level, l.height - 1);
+
+            float farthest = 0.0f;
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) {
+                    farthest = std::max(farthest, l.depth[static_cast<std::size_t>(y) * l.width + x]);
+                }
+            }
+            return nearest <= farthest;
+        }
+
+        int get_width() const noexcept { return m_width; }
+        int get_height() const noexcept { return m_height; }
+        int get_level_count() const noexcept { return static_cast<int>(m_levels.size()); }
+        std::size_t get_triangle_count() const noexcept { return m_triangles.size(); }
+
+        const std::vector<float> &get_depth(int level, int &width, int &height) const {
+            width = m_levels[level].width;
+            height = m_levels[level].height;
+            return m_levels[level].depth;
+        }
+
+    private:
+        struct level {
+            int width;
+            int height;
+            std::vector<float> depth;
+        };
+
+        struct screen_triangle {
+            std::array<glm::vec3, 3> v;     // pixels, y down is not flipped; z in [0, 1]
+        };
+
+        glm::vec3 to_screen(const glm::vec4 &clip) const noexcept {
+            glm::vec3 ndc{ clip.x / clip.w, clip.y / clip.w, clip.z / clip.w };
+            return {
+                (ndc.x * 0.5f + 0.5f) * m_width,
+                (ndc.y * 0.5f + 0.5f) * m_height,
+                ndc.z * 0.5f + 0.5f
+            };
+        }
+
+        void rasterize_triangle(const screen_triangle &t, int band_y0, int band_y1) {
+            auto &&[a, b, c] = t.v;
+            float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+            if (std::abs(area) < 1e-6f) return;
+
+            int min_y = std::max(static_cast<int>(std::floor(std::min({ a.y, b.y, c.y }))), band_y0);
+            int max_y = std::min(static_cast<int>(std::ceil(std::max({ a.y, b.y, c.y }))), band_y1 - 1);
+            int min_x = std::max(static_cast<int>(std::floor(std::min({ a.x, b.x, c.x }))), 0) & ~3;
+            int max_x = std::min(static_cast<int>(std::ceil(std::max({ a.x, b.x, c.x }))), m_width - 1);
+            if (min_y > max_y || min_x > max_x) return;
+
+            // edge functions e(x, y) = ex * x + ey * y + e0, made positive inside regardless of winding
+            float sign = area > 0 ? 1.0f : -1.0f;
+            auto edge = [sign](glm::vec3 p, glm::vec3 q) {
+                return glm::vec3{ sign * (p.y - q.y), sign * (q.x - p.x), sign * (p.x * q.y - q.x * p.y) };
+            };
+            std::array<glm::vec3, 3> edges{ edge(b, c), edge(c, a), edge(a, b) };
+
+            // depth plane z(x, y) = zx * x + zy * y + z0 from barycentrics
+            float inv_area = 1.0f / (sign * area);
+            float zx = (edges[0].x * a.z + edges[1].x * b.z + edges[2].x * c.z) * inv_area;
+            float zy = (edges[0].y * a.z + edges[1].y * b.z + edges[2].y * c.z) * inv_area;
+            float z0 = (edges[0].z * a.z + edges[1].z * b.z + edges[2].z * c.z) * inv_area;
+
+            auto &depth = m_levels[0].depth;
+            for (int y = min_y; y <= max_y; ++y) {
+                float py = y + 0.5f;
+                float *row = depth.data() + static_cast<std::size_t>(y) * m_width;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+                __m128 offsets = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+                __m128 zero = _mm_setzero_ps();
+                for (int x = min_x; x <= max_x; x += 4) {
+                    __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets);
+                    __m128 inside = _mm_set1_ps(0.0f);
+                    inside = _mm_cmpeq_ps(inside, inside);
+                    for (auto &&e : edges) {
+                        __m128 value = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e.x), px), _mm_set1_ps(e.y * py + e.z));
+                        inside = _mm_and_ps(inside, _mm_cmpge_ps(value, zero));
+                    }
+                    if (_mm_movemask_ps(inside) == 0) continue;
+                    __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zx), px), _mm_set1_ps(zy * py + z0));
+                    __m128 old = _mm_loadu_ps(row + x);
+                    __m128 nearer = _mm_min_ps(old, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+                }
+#else
+                for (int x = min_x; x <= max_x; ++x) {
+                    float px = x + 0.5f;
+                    bool inside = true;
+                    for (auto &&e : edges) inside = inside && e.x * px + e.y * py + e.z >= 0.0f;
+                    if (!inside) continue;
+                    row[x] = std::min(row[x], zx * px + zy * py + z0);
+                }
+#endif
+            }
+        }
+
+        void build_pyramid() {
+            for (std::size_t i = 1; i < m_levels.size(); ++i) {
+                auto &&src = m_levels[i - 1];
+                auto &&dst = m_levels[i];
+                for (int y = 0; y < dst.height; ++y) {
+                    for (int x = 0; x < dst.width; ++x) {
+                        int sx = std::min(x * 2, src.width - 1), sx1 = std::min(x * 2 + 1, src.width - 1);
+                        int sy = std::min(y * 2, src.height - 1), sy1 = std::min(y * 2 + 1, src.height - 1);
+                        dst.depth[static_cast<std::size_t>(y) * dst.width + x] = std::max({
+                            src.depth[static_cast<std::size_t>(sy) * src.width + sx],
+                            src.depth[static_cast<std::size_t>(sy) * src.width + sx1],
+                            src.depth[static_cast<std::size_t>(sy1) * src.width + sx],
+                            src.depth[static_cast<std::size_t>(sy1) * src.width + sx1]
+                        });
+                    }
+                }
+            }
+        }
+
+        int m_width = 0;
+        int m_height = 0;
+        std::vector<level> m_levels;
+        std::vector<screen_triangle> m_triangles;
+    };
+
+    struct occlusion_settings {
+        bool enabled = true;
+        std::size_t max_occluders = 16;
+    };
+
+    using frame_clock = std::chrono::steady_clock;
+
+    enum class frame_stage {
+        INPUT,
+        SIMULATE,
+        SUBMIT,
+        PRESENT,
+        COUNT
+    };
+
+    /*
+     * Main-thread state the simulate stage reads. advance() copies it into the packet, so the UI can
+     * change it while earlier frames are still being simulated.
+     */
+    struct frame_settings {
+        std::shared_ptr<const std::unordered_set<std::size_t>> batched;     // geometries a static_batcher draws
+        bool cpu_culling = true;
+        occlusion_settings occlusion;
+    };
+
+    struct draw_command {
+        const geo::geometry *shape;
+        glm::mat4 transform;
+        std::uint32_t material = 0;
+    };
+
+    /*
+     * Everything one frame needs between its simulate and submit stages. Each slot of the
+     * pipeline owns one, so a worker can fill frame N+1 while frame N is replayed on the
+     * GL thread. Vectors are cleared rather than freed between uses.
+     */
+    struct frame_packet {
+        std::uint64_t frame_index = 0;
+        glm::mat4 view{ 1.0f };
+        glm::mat4 projection{ 1.0f };
+        glm::mat4 view_projection{ 1.0f };
+        frame_settings settings;
+        std::vector<draw_command> draws;
+        std::size_t culled = 0;
+        occlusion_buffer occlusion;
+        occlusion_stats occlusion_counters;
+        std::array<frame_clock::time_point, static_cast<std::size_t>(frame_stage::COUNT)> stage_begin{};
+        frame_clock::time_point latched{};      // camera sampled again right before submission, unset without late latching
+
+        frame_clock::time_point &begin_of(frame_stage stage) noexcept {
+            return stage_begin[static_cast<std::size_t>(stage)];
+        }
+    };
+
+    struct frame_telemetry {
+        static constexpr std::size_t history = 120;
+
+        std::array<float, history> latency_ms{};    // newest input sample on screen -> present
+        std::array<float, history> built_ms{};      // input sample the frame was built from -> present
+        std::array<float, history> simulate_ms{};   // simulate start -> picked up for submission
+        std::array<float, history> submit_ms{};     // GL thread time from submit to present
+        std::size_t cursor = 0;
+
+        float average(const std::array<float, history> &samples) const noexcept {
+            float sum = 0.0f;
+            for (float sample : samples) sum += sample;
+            return sum / history;
+        }
+    };
+
+    /*
+     * Pipelines simulation/culling against GL submission.
+     *   depth 1: simulate and submit the same frame back to back (no overlap).
+     *   depth 2: simulate N+1 on a worker while N is submitted and swapped.
+     *   depth 3: as above with one more frame of slack, trading latency for throughput.
+     * The simulate function is set once; each packet slot keeps its own completion state, so
+     * starting and collecting a frame does not allocate.
+     */
+    class frame_pipeline {
+    public:
+        static constexpr int min_depth = 1;
+        static constexpr int max_depth = 3;
+        static_assert(max_depth < memory::frame_arenas::ring, "a frame's arena must outlive the frame in the pipeline");
+        using simulate_fn = std::function<void(frame_packet &)>;
+
+        frame_pipeline(thread_pool &pool, int depth, simulate_fn simulate) : m_pool(pool), m_simulate(std::move(simulate)) {
+            set_depth(depth);
+        }
+
+        ~frame_pipeline() {
+            drain();
+        }
+
+        int get_depth() const noexcept { return m_depth; }
+
+        /* Waits for in-flight frames; they are dropped, so the pipeline refills afterwards. */
+        void set_depth(int depth) {
+            drain();
+            m_depth = std::clamp(depth, min_depth, max_depth);
+            m_submitted = m_next_frame;
+        }
+
+        /*
+         * Snapshots the camera and `settings` into the next free packet, starts simulating it on a
+         * worker and returns the oldest finished packet for submission, or nullptr while the
+         * pipeline fills. The new frame's memory::frame_arenas slot is recycled first. An exception
+         * thrown by the simulate function comes out of the advance() that collects its packet.
+         */
+        frame_packet *advance(const gl_camera &camera, frame_clock::time_point input_time, const frame_settings &settings) {
+            memory::frame_arenas::begin_frame(m_next_frame);
+            std::size_t next = m_next_frame % m_depth;
+            auto &packet = m_packets[next];
+            packet.frame_index = m_next_frame;
+            packet.view = camera.get_view();
+            packet.projection = camera.get_perspective();
+            packet.view_projection = packet.projection * packet.view;
+            packet.settings = settings;
+            packet.begin_of(frame_stage::INPUT) = input_time;
+            packet.latched = {};
+
+            {
+                std::lock_guard lock(m_slots[next].mutex);
+                m_slots[next].busy = true;
+            }
+            m_pool.post([this, next] { simulate(next); });
+            ++m_next_frame;
+
+            if (m_next_frame - m_submitted < static_cast<std::uint64_t>(m_depth)) return nullptr;
+
+            std::size_t slot = m_submitted % m_depth;
+            if (auto error = wait(slot)) {
+                ++m_submitted;
+                std::rethrow_exception(error);
+            }
+            ++m_submitted;
+            m_packets[slot].begin_of(frame_stage::SUBMIT) = frame_clock::now();
+            return &m_packets[slot];
+        }
+
+        /* Call right after glfwSwapBuffers for the packet returned by advance(). */
+        void present(frame_packet &packet) {
+            using ms = std::chrono::duration<float, std::milli>;
+            auto now = frame_clock::now();
+            packet.begin_of(frame_stage::PRESENT) = now;
+
+            auto &t = m_telemetry;
+            t.built_ms[t.cursor] = ms(now - packet.begin_of(frame_stage::INPUT)).count();
+            t.latency_ms[t.cursor] = packet.latched == frame_clock::time_point{} ? t.built_ms[t.cursor] : ms(now - packet.latched).count();
+            t.simulate_ms[t.cursor] = ms(packet.begin_of(frame_stage::SUBMIT) - packet.begin_of(frame_stage::SIMULATE)).count();
+            t.submit_ms[t.cursor] = ms(now - packet.begin_of(frame_stage::SUBMIT)).count();
+            t.cursor = (t.cursor + 1) % frame_telemetry::history;
+        }
+
+        const frame_telemetry &telemetry() const noexcept { return m_telemetry; }
+
+    private:
+        struct slot_state {
+            std::mutex mutex;
+            std::condition_variable cv;
+            bool busy = false;
+            std::exception_ptr error;
+        };
+
+        void simulate(std::size_t slot) {
+            auto &packet = m_packets[slot];
+            std::exception_ptr error;
+            try {
+                packet.begin_of(frame_stage::SIMULATE) = frame_clock::now();
+                packet.draws.clear();
+                packet.culled = 0;
+                packet.occlusion_counters = {};
+                m_simulate(packet);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            // notify under the lock, the pipeline may be destroyed as soon as the waiter sees busy == false
+            std::lock_guard lock(m_slots[slot].mutex);
+            m_slots[slot].error = error;
+            m_slots[slot].busy = false;
+            m_slots[slot].cv.notify_all();
+        }
+
+        /* Blocks until the slot's simulate task is done and returns what it threw, if anything. */
+        std::exception_ptr wait(std::size_t slot) {
+            std::unique_lock lock(m_slots[slot].mutex);
+            m_slots[slot].cv.wait(lock, [&] { return !m_slots[slot].busy; });
+            return std::exchange(m_slots[slot].error, nullptr);
+        }
+
+        /* In-flight frames are dropped, and so is anything they threw. */
+        void drain() {
+            for (std::size_t slot = 0; slot < m_slots.size(); ++slot) wait(slot);
+        }
+
+        thread_pool &m_pool;
+        simulate_fn m_simulate;
+        int m_depth = 1;
+        std::uint64_t m_next_frame = 0;
+        std::uint64_t m_submitted = 0;
+        std::array<frame_packet, max_depth> m_packets;
+        std::array<slot_state, max_depth> m_slots;
+        frame_telemetry m_telemetry;
+    };
+
+    /*
+     * Paces the loop to a target frame interval by sleeping rather than spinning. wait() belongs
+     * right before the last input sample of a frame: it sleeps until the latest point from which
+     * the remaining work, measured between wait() and presented() and smoothed, still makes the
+     * next present time, so the slack of a fast frame turns into lower latency instead of an
+     * earlier, staler image. Sleeps overshoot by a varying amount; the smoothed overshoot is
+     * taken off the next sleep. A missed present restarts the cadence from the late one.
+     */
+    class frame_pacer {
+    public:
+        struct stats {
+            float slept_ms = 0.0f;
+            float work_ms = 0.0f;       // smoothed wait() -> presented()
+            float oversleep_ms = 0.0f;  // smoothed
+            std::uint64_t missed = 0;
+        };
+
+        explicit frame_pacer(float rate = 60.0f) { set_rate(rate); }
+
+        void set_rate(float rate) {
+            m_interval = std::chrono::duration_cast<frame_clock::duration>(std::chrono::duration<float>(1.0f / std::max(rate, 1.0f)));
+        }
+
+        float get_rate() const noexcept { return 1.0f / std::chrono::duration<float>(m_interval).count(); }
+
+        void wait() {
+            using ms = std::chrono::duration<float, std::milli>;
+            auto now = frame_clock::now();
+            m_stats.slept_ms = 0.0f;
+            if (m_next_present != frame_clock::time_point{}) {
+                auto reserve = std::chrono::duration_cast<frame_clock::duration>(ms(m_stats.work_ms + m_stats.oversleep_ms + safety_ms));
+                auto deadline = m_next_present - reserve;
+                if (deadline > now) {
+                    std::this_thread::sleep_until(deadline);
+                    auto woke = frame_clock::now();
+                    m_stats.oversleep_ms += (ms(woke - deadline).count() - m_stats.oversleep_ms) * smoothing;
+                    m_stats.slept_ms = ms(woke - now).count();
+                    now = woke;
+                }
+            }
+            m_woke = now;
+        }
+
+        /* Call right after the swap. */
+        void presented() {
+            using ms = std::chrono::duration<float, std::milli>;
+            auto now = frame_clock::now();
+            if (m_woke != frame_clock::time_point{}) m_stats.work_ms += (ms(now - m_woke).count() - m_stats.work_ms) * smoothing;
+            if (m_next_present == frame_clock::time_point{} || now > m_next_present + m_interval / 2) {
+                m_stats.missed += m_next_present != frame_clock::time_point{};
+                m_next_present = now + m_interval;
+            }
+            else {
+                m_next_present += m_interval;
+            }
+        }
+
+        /* Forget the cadence, e.g. after pacing was switched off for a while. */
+        void reset() noexcept {
+            m_next_present = {};
+            m_woke = {};
+        }
+
+        const stats &get_stats() const noexcept { return m_stats; }
+
+    private:
+        static constexpr float smoothing = 0.1f;
+        static constexpr float safety_ms = 0.5f;
+
+        frame_clock::duration m_interval{};
+        frame_clock::time_point m_next_present{};
+        frame_clock::time_point m_woke{};
+        stats m_stats;
+    };
+
+    /*
+     * Simulate stage for the scene: builds the transform for every geometry and drops the ones
+     * outside the frustum, then the ones hidden behind the largest on-screen geometries.
+     * `materials` maps geometry ids to material_buffer slots; unmapped geometries use slot 0.
+     * Geometries in `batched` are drawn by a static_batcher and skipped. Scratch lists come from
+     * the frame's arena.
+     */
+    void build_draw_list(const std::unordered_map<std::size_t, std::shared_ptr<geo::geometry>> &geometries, 
+                         const std::unordered_map<std::size_t, std::uint32_t> &materials,
+                         const std::unordered_set<std::size_t> &batched,
+                         frame_packet &packet, const occlusion_settings &occlusion) {
+        struct candidate {
+            const geo::geometry *shape;
+            float screen_size;
+            std::uint32_t material;
+        };
+        std::pmr::vector<candidate> visible(&memory::frame_arenas::local(packet.frame_index));
+
+        frustum view_frustum(packet.view_projection);
+        packet.draws.reserve(geometries.size());
+        visible.reserve(geometries.size());
+        for (auto &&[id, shape] : geometries) {
+            if (batched.contains(id)) continue;
+            float radius = shape->get_bounds().radius;
+            if (!view_frustum.intersects_sphere(shape->get_location().pos, radius)) {
+                ++packet.culled;
+                continue;
+            }
+            auto view_pos = packet.view * glm::vec4{ shape->get_location().pos, 1.0f };
+            auto material = materials.find(id);
+            visible.push_back({ shape.get(), radius / std::max(-view_pos.z, 1e-3f), material != materials.end() ? material->second : 0u });
+        }
+
+        if (occlusion.enabled && !visible.empty()) {
+            auto start = frame_clock::now();
+            std::size_t occluder_count = std::min(occlusion.max_occluders, visible.size());
+            std::partial_sort(visible.begin(), visible.begin() + occluder_count, visible.end(), [](const candidate &a, const candidate &b) {
+                return a.screen_size > b.screen_size;
+            });
+
+            packet.occlusion.clear();
+            for (std::size_t i = 0; i < occluder_count; ++i) {
+                packet.occlusion.add_occluder(packet.view_projection * visible[i].shape->get_location().get_matrix(), visible[i].shape->get_vertices());
+            }
+            packet.occlusion.rasterize(default_thread_pool());
+
+            auto &counters = packet.occlusion_counters;
+            counters.occluders = occluder_count;
+            counters.triangles = packet.occlusion.get_triangle_count();
+            counters.tested = visible.size();
+            std::erase_if(visible, [&](const candidate &c) {
+                auto &&box = c.shape->get_bounds();
+                auto pos = c.shape->get_location().pos;
+                return !packet.occlusion.is_visible(packet.view_projection, box.min + pos, box.max + pos);
+            });
+            counters.culled = counters.tested - visible.size();
+            packet.culled += counters.culled;
+            counters.raster_ms = std::chrono::duration<float, std::milli>(frame_clock::now() - start).count();
+        }
+
+        for (auto &&c : visible) {
+            packet.draws.push_back({ c.shape, packet.view_projection * c.shape->get_location().get_matrix(), c.material });
+        }
+    }
+
+    /* Shows one level of a frame's occlusion buffer in ImGui, depth linearized for readability. */
+    class occlusion_debug_view {
+    public:
+        occlusion_debug_view() {
+            memory::gen_textures(1, &m_texture);
+            glBindTexture(GL_TEXTURE_2D, m_texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+
+        ~occlusion_debug_view() {
+            memory::delete_textures(1, &m_texture);
+        }
+
+        occlusion_debug_view(const occlusion_debug_view &) = delete;
+        occlusion_debug_view &operator=(const occlusion_debug_view &) = delete;
+
+        void draw(const occlusion_buffer &buffer, int level, float near, float far) {
+            int width, height;
+            const auto &depth = buffer.get_depth(level, width, height);
+            m_pixels.resize(depth.size() * 4);
+            for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) {
+                    // flip rows, the buffer has y up
+                    float ndc = depth[static_cast<std::size_t>(height - 1 - y) * width + x] * 2.0f - 1.0f;
+                    float linear = (2.0f * near * far) / (far + near - ndc * (far - near));
+                    auto gray = static_cast<std::uint8_t>(255.0f * (1.0f - std::clamp(linear / far, 0.0f, 1.0f)));
+                    auto *p = &m_pixels[(static_cast<std::size_t>(y) * width + x) * 4];
+                    p[0] = p[1] = p[2] = gray;
+                    p[3] = 255;
+                }
+            }
+            glBindTexture(GL_TEXTURE_2D, m_texture);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, m_pixels.data());
+            ImGui::Image(reinterpret_cast<ImTextureID>(static_cast<std::intptr_t>(m_texture)), 
+                ImVec2{ static_cast<float>(buffer.get_width()) * 2, static_cast<float>(buffer.get_height()) * 2 });
+        }
+
+    private:
+        GLuint m_texture;
+        std::vector<std::uint8_t> m_pixels;
+    };
+
+    struct draw_elements_indirect_command {
+        GLuint count;
+        GLuint instance_count;
+        GLuint first_index;
+        GLint base_vertex;
+        GLuint base_instance;
+    };
+
+    struct mesh_range {
+        GLuint first_index;
+        GLuint index_count;
+        GLint base_vertex;
+    };
+
+    /*
+     * One VAO/VBO/EBO pair that static meshes are sub-allocated from, so meshes of different
+     * shapes can share a single draw call. Meshes are appended on the CPU and the whole arena
+     * is uploaded again on commit(), which is fine for load-time data.
+     */
+    template <VertexFormat V>
+    class mesh_arena {
+    public:
+        mesh_arena() {
+            memory::gen_vertex_arrays(1, &m_vao);
+            memory::gen_buffers(1, &m_vbo);
+            memory::gen_buffers(1, &m_ebo);
+        }
+
+        ~mesh_arena() {
+            memory::delete_vertex_arrays(1, &m_vao);
+            memory::delete_buffers(1, &m_vbo);
+            memory::delete_buffers(1, &m_ebo);
+        }
+
+        mesh_arena(const mesh_arena &) = delete;
+        mesh_arena &operator=(const mesh_arena &) = delete;
+
+        mesh_range allocate(const geo::indexed_mesh<V> &mesh) {
+            mesh_range range{
+                static_cast<GLuint>(m_indices.size()),
+                static_cast<GLuint>(mesh.indices.size()),
+                static_cast<GLint>(m_vertices.size())
+            };
+            m_vertices.insert(m_vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+            m_indices.insert(m_indices.end(), mesh.indices.begin(), mesh.indices.end());
+            m_dirty = true;
+            return range;
+        }
+
+        /* Leaves the arena VAO bound. */
+        void commit() {
+            glBindVertexArray(m_vao);
+            if (!m_dirty) return;
+            geo::upload_mesh(m_vbo, m_ebo, geo::indexed_mesh<V>{ m_vertices, m_indices });
+            m_dirty = false;
+        }
+
+        GLuint get_vao() const noexcept { return m_vao; }
+        GLuint get_vbo() const noexcept { return m_vbo; }
+        GLuint get_ebo() const noexcept { return m_ebo; }
+
+    private:
+        GLuint m_vao;
+        GLuint m_vbo;
+        GLuint m_ebo;
+        std::vector<V> m_vertices;
+        std::vector<GLuint> m_indices;
+        bool m_dirty = false;
+    };
+
+    /* Welds scene geometries into one mesh_arena. Geometries with identical vertices share a range. */
+    class geometry_arena {
+    public:
+        mesh_range find_or_add(const geo::geometry &shape) {
+            if (auto match = m_ranges.find(shape.get_id()); match != m_ranges.end()) {
+                return match->second;
+            }
+
+            const auto &xyz = shape.get_vertices();
+            std::string key(reinterpret_cast<const char *>(xyz.data()), xyz.size() * sizeof(float));
+            auto shared = m_shared_ranges.find(key);
+            if (shared == m_shared_ranges.end()) {
+                std::vector<vertex::position> vertices(xyz.size() / 3);
+                std::memcpy(vertices.data(), xyz.data(), vertices.size() * sizeof(vertex::position));
+                auto mesh = mesh_optimizer::weld(vertices);
+                mesh_optimizer::optimize(mesh, vertices.size());
+                shared = m_shared_ranges.emplace(std::move(key), m_arena.allocate(mesh)).first;
+            }
+            m_ranges.emplace(shape.get_id(), shared->second);
+            return shared->second;
+        }
+
+        mesh_arena<vertex::position> &get_arena() noexcept { return m_arena; }
+
+    private:
+        mesh_arena<vertex::position> m_arena;
+        std::unordered_map<std::size_t, mesh_range> m_ranges;
+        std::unordered_map<std::string, mesh_range> m_shared_ranges;
+    };
+
+    /*
+     * Per-object material constants in one std140 uniform buffer, indexed by a material slot
+     * that travels with each draw or GPU instance instead of a glUniform call per object.
+     * set() only updates the CPU copy and widens a dirty range; upload() sends that range with
+     * a single glBufferSubData. 1024 entries of 16 bytes fill the 16 KiB every GL 3.3 driver
+     * guarantees for GL_MAX_UNIFORM_BLOCK_SIZE. Shaders declare glsl_block (keep the array size
+     * in sync with capacity) and get their block bound to `binding` by attach().
+     */
+    class material_buffer {
+    public:
+        static constexpr std::size_t capacity = 1024;
+        static constexpr GLuint binding = 1;
+
+        material_buffer() {
+            m_data.reserve(capacity);
+            memory::gen_buffers(1, &m_ubo);
+            glBindBuffer(GL_UNIFORM_BUFFER, m_ubo);
+            memory::buffer_data(memory::tag::SCENE, GL_UNIFORM_BUFFER, capacity * sizeof(entry), nullptr, GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+
+        ~material_buffer() {
+            memory::delete_buffers(1, &m_ubo);
+        }
+
+        material_buffer(const material_buffer &) = delete;
+        material_buffer &operator=(const material_buffer &) = delete;
+
+        std::uint32_t allocate(glm::vec3 albedo) {
+            if (m_data.size() == capacity) {
+                throw std::runtime_error("Material buffer is full.");
+            }
+            m_data.push_back({ glm::vec4{ albedo, 1.0f } });
+            auto slot = static_cast<std::uint32_t>(m_data.size() - 1);
+            mark(slot);
+            return slot;
+        }
+
+        void set(std::uint32_t slot, glm::vec3 albedo) {
+            m_data[slot].albedo = glm::vec4{ albedo, 1.0f };
+            mark(slot);
+        }
+
+        /* Returns the number of entries sent, 0 when nothing changed. */
+        std::size_t upload() {
+            if (m_dirty_begin >= m_dirty_end) return 0;
+            std::size_t count = m_dirty_end - m_dirty_begin;
+            glBindBuffer(GL_UNIFORM_BUFFER, m_ubo);
+            glBufferSubData(GL_UNIFORM_BUFFER, m_dirty_begin * sizeof(entry), count * sizeof(entry), &m_data[m_dirty_begin]);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+            m_dirty_begin = capacity;
+            m_dirty_end = 0;
+            return count;
+        }
+
+        void bind() const {
+            glBindBufferBase(GL_UNIFORM_BUFFER, binding, m_ubo);
+        }
+
+        static void attach(GLuint program) {
+            GLuint index = glGetUniformBlockIndex(program, "materials");
+            if (index != GL_INVALID_INDEX) {
+                glUniformBlockBinding(program, index, binding);
+            }
+        }
+
+        std::size_t size() const noexcept { return m_data.size(); }
+
+        static constexpr const char *glsl_block =
+            "layout (std140) uniform materials {"
+            "    vec4 material_albedo[1024];"
+            "};";
+
+    private:
+        // std140 and std430 agree on this layout, so the same struct works for an SSBO later on
+        struct entry {
+            glm::vec4 albedo;
+        };
+        static_assert(sizeof(entry) == 16);
+
+        void mark(std::size_t slot) {
+            m_dirty_begin = std::min(m_dirty_begin, slot);
+            m_dirty_end = std::max(m_dirty_end, slot + 1);
+        }
+
+        GLuint m_ubo;
+        std::vector<entry> m_data;
+        std::size_t m_dirty_begin = capacity;
+        std::size_t m_dirty_end = 0;
+    };
+
+    /*
+     * Late-latched camera. Draw lists, culling and every transform are built from the camera
+     * sampled at the start of the frame, up to the pipeline depth in frames ago. Right before
+     * the passes execute, latch() takes the newest camera and writes a correction, the new
+     * view-projection times the inverse of the one the frame was built with, into a 64-byte
+     * uniform buffer. Vertex shaders declare glsl_block and apply latch_correction to their
+     * clip-space position, so the image shows the newest camera without rebuilding a transform.
+     * Culling still used the older camera; on fast turns geometry at the screen edge can show
+     * up a frame late.
+     */
+    class late_latch {
+    public:
+        static constexpr GLuint binding = 2;
+
+        late_latch() {
+            memory::gen_buffers(1, &m_ubo);
+            glBindBuffer(GL_UNIFORM_BUFFER, m_ubo);
+            memory::buffer_data(memory::tag::SCENE, GL_UNIFORM_BUFFER, sizeof(glm::mat4), glm::value_ptr(m_correction), GL_DYNAMIC_DRAW);
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+
+        ~late_latch() {
+            memory::delete_buffers(1, &m_ubo);
+        }
+
+        late_latch(const late_latch &) = delete;
+        late_latch &operator=(const late_latch &) = delete;
+
+        /* `built_*` are the matrices the frame's transforms contain, the others the camera to show instead. */
+        void latch(const glm::mat4 &built_view, const glm::mat4 &built_projection, const glm::mat4 &view, const glm::mat4 &projection) {
+            // inverted separately, the rigid view inverse stays exact and the projection keeps its precision
+            upload(projection * view * glm::inverse(built_view) * glm::inverse(built_projection));
+        }
+
+        /* Shows frames exactly as they were built. */
+        void reset() {
+            upload(glm::mat4{ 1.0f });
+        }
+
+        void bind() const {
+            glBindBufferBase(GL_UNIFORM_BUFFER, binding, m_ubo);
+        }
+
+        static void attach(GLuint program) {
+            GLuint index = glGetUniformBlockIndex(program, "late_latch");
+            if (index != GL_INVALID_INDEX) {
+                glUniformBlockBinding(program, index, binding);
+            }
+        }
+
+        const glm::mat4 &get_correction() const noexcept { return m_correction; }
+
+        static constexpr const char *glsl_block =
+            "layout (std140) uniform late_latch {"
+            "    mat4 latch_correction;"
+            "};";
+
+    private:
+        void upload(const glm::mat4 &correction) {
+            if (correction == m_correction) return;
+            m_correction = correction;
+            glBindBuffer(GL_UNIFORM_BUFFER, m_ubo);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), glm::value_ptr(m_correction));
+            glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        }
+
+        GLuint m_ubo;
+        glm::mat4 m_correction{ 1.0f };
+    };
+
+    struct point_light {
+        glm::vec3 position;
+        float radius;
+        glm::vec3 color;
+        float intensity;
+    };
+
+    /* Scatters lights above the grid; the same seed gives the same scene. */
+    std::vector<point_light> scatter_point_lights(std::size_t count, float extent, std::uint32_t seed = 1337) {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> horizontal(-extent, extent);
+        std::uniform_real_distribution<float> height(0.5f, 4.0f);
+        std::uniform_real_distribution<float> radius(2.0f, 6.0f);
+        std::uniform_real_distribution<float> channel(0.2f, 1.0f);
+
+        std::vector<point_light> lights(count);
+        for (auto &&light : lights) {
+            light.position = { horizontal(rng), height(rng), horizontal(rng) };
+            light.radius = radius(rng);
+            light.color = { channel(rng), channel(rng), channel(rng) };
+            light.intensity = 1.0f;
+        }
+        return lights;
+    }
+
+    /*
+     * Clustered forward lighting. The view frustum is split into screen tiles and exponential depth
+     * slices; every frame the lights are transformed to view space and tested against the cluster
+     * bounds on the thread pool, one depth slice per task and four lights per SSE test. The result
+     * is uploaded to three buffer textures (GL 3.3 has no SSBOs):
+     *   lights  - RGBA32F, view-space position/radius then color/intensity, two texels per light
+     *   grid    - RG32UI, offset and count into the index list per cluster
+     *   indices - R32UI, light indices grouped by cluster
+     * Shaders include glsl_shading and call clustered_lighting(albedo), which only loops over the
+     * lights of the fragment's cluster.
+     */
+    class light_clusters {
+    public:
+        static constexpr int tiles_x = 16;
+        static constexpr int tiles_y = 9;
+        static constexpr int slices = 24;
+        static constexpr int cluster_count = tiles_x * tiles_y * slices;
+        static constexpr GLint first_texture_unit = 8;
+
+        struct uniforms {
+            GLint lights;
+            GLint grid;
+            GLint indices;
+            GLint inverse_projection;
+            GLint viewport;
+            GLint tile_size;
+            GLint dimensions;
+            GLint depth;
+        };
+
+        struct stats {
+            std::size_t lights = 0;
+            std::size_t indices = 0;
+            std::size_t max_per_cluster = 0;
+            std::size_t occupied = 0;
+            float assign_ms = 0.0f;
+        };
+
+        static uniforms locate(GLuint program) {
+            return {
+                glGetUniformLocation(program, "cluster_lights"),
+                glGetUniformLocation(program, "cluster_grid"),
+                glGetUniformLocation(program, "cluster_indices"),
+                glGetUniformLocation(program, "cluster_inverse_projection"),
+                glGetUniformLocation(program, "cluster_viewport"),
+                glGetUniformLocation(program, "cluster_tile_size"),
+                glGetUniformLocation(program, "cluster_dimensions"),
+                glGetUniformLocation(program, "cluster_depth")
+            };
+        }
+
+        light_clusters() {
+            memory::gen_buffers(static_cast<GLsizei>(m_buffers.size()), m_buffers.data());
+            memory::gen_textures(static_cast<GLsizei>(m_textures.size()), m_textures.data());
+            m_grid.resize(cluster_count);
+        }
+
+        ~light_clusters() {
+            memory::delete_textures(static_cast<GLsizei>(m_textures.size()), m_textures.data());
+            memory::delete_buffers(static_cast<GLsizei>(m_buffers.size()), m_buffers.data());
+        }
+
+        light_clusters(const light_clusters &) = delete;
+        light_clusters &operator=(const light_clusters &) = delete;
+
+        void assign(std::span<const point_light> lights, const glm::mat4 &view, const glm::mat4 &projection, 
+                    float near, float far, int viewport_width, int viewport_height, thread_pool &pool) {
+            if (viewport_width <= 0 || viewport_height <= 0) return;     // minimized
+
+            auto start = std::chrono::steady_clock::now();
+            if (projection != m_projection || near != m_near || far != m_far 
+                || viewport_width != m_viewport.x || viewport_height != m_viewport.y) {
+                build_bounds(projection, near, far, viewport_width, viewport_height);
+            }
+
+            m_view_lights.resize(lights.size() * 2);
+            m_view_spheres.resize(lights.size());
+            for (std::size_t i = 0; i < lights.size(); ++i) {
+                auto &&light = lights[i];
+                auto p = glm::vec3(view * glm::vec4{ light.position, 1.0f });
+                m_view_lights[i * 2] = { p, light.radius };
+                m_view_lights[i * 2 + 1] = { light.color, light.intensity };
+                m_view_spheres[i] = { p.x, p.y, p.z, light.radius };
+            }
+
+            pool.parallel_for(slices, 1, [this](std::size_t begin, std::size_t end) {
+                for (std::size_t slice = begin; slice < end; ++slice) assign_slice(static_cast<int>(slice));
+            });
+
+            // concatenate the per-slice lists, the grid offsets become global
+            m_indices.clear();
+            m_stats = {};
+            m_stats.lights = lights.size();
+            for (int slice = 0; slice < slices; ++slice) {
+                auto offset = static_cast<GLuint>(m_indices.size());
+                auto &&local = m_slices[slice].indices;
+                m_indices.insert(m_indices.end(), local.begin(), local.end());
+                for (int tile = 0; tile < tiles_x * tiles_y; ++tile) {
+                    auto &&cell = m_grid[static_cast<std::size_t>(slice) * tiles_x * tiles_y + tile];
+                    cell.x += offset;
+                    m_stats.max_per_cluster = std::max<std::size_t>(m_stats.max_per_cluster, cell.y);
+                    m_stats.occupied += cell.y != 0;
+                }
+            }
+            m_stats.indices = m_indices.size();
+            m_stats.assign_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        void upload() {
+            // orphan every frame, the previous contents may still be in use by the GPU
+            upload_buffer(0, GL_RGBA32F, m_view_lights.size() * sizeof(glm::vec4), m_view_lights.data());
+            upload_buffer(1, GL_RG32UI, m_grid.size() * sizeof(glm::uvec2), m_grid.data());
+            upload_buffer(2, GL_R32UI, std::max<std::size_t>(m_indices.size(), 1) * sizeof(GLuint), m_indices.empty() ? nullptr : m_indices.data());
+        }
+
+        /* Binds the buffer textures and cluster parameters for a program that includes glsl_shading. */
+        void bind(const uniforms &locations) const {
+            for (std::size_t i = 0; i < m_textures.size(); ++i) {
+                glActiveTexture(GL_TEXTURE0 + first_texture_unit + static_cast<GLenum>(i));
+                glBindTexture(GL_TEXTURE_BUFFER, m_textures[i]);
+            }
+            glActiveTexture(GL_TEXTURE0);
+
+            glUniform1i(locations.lights, first_texture_unit);
+            glUniform1i(locations.grid, first_texture_unit + 1);
+            glUniform1i(locations.indices, first_texture_unit + 2);
+            glUniformMatrix4fv(locations.inverse_projection, 1, GL_FALSE, glm::value_ptr(m_inverse_projection));
+            glUniform2f(locations.viewport, static_cast<float>(m_viewport.x), static_cast<float>(m_viewport.y));
+            glUniform2f(locations.tile_size, m_tile_size.x, m_tile_size.y);
+            glUniform3ui(locations.dimensions, tiles_x, tiles_y, slices);
+            glUniform2f(locations.depth, m_depth_scale, m_depth_bias);
+        }
+
+        const stats &get_stats() const noexcept { return m_stats; }
+
+        static constexpr const char *glsl_shading =
+            "uniform samplerBuffer cluster_lights;"
+            "uniform usamplerBuffer cluster_grid;"
+            "uniform usamplerBuffer cluster_indices;"
+            "uniform mat4 cluster_inverse_projection;"
+            "uniform vec2 cluster_viewport;"
+            "uniform vec2 cluster_tile_size;"
+            "uniform uvec3 cluster_dimensions;"
+            "uniform vec2 cluster_depth;"
+            ""
+            "vec3 clustered_lighting(vec3 albedo) {"
+            "    vec4 ndc = vec4(gl_FragCoord.xy / cluster_viewport * 2.0 - 1.0, gl_FragCoord.z * 2.0 - 1.0, 1.0);"
+            "    vec4 view = cluster_inverse_projection * ndc;"
+            "    vec3 p = view.xyz / view.w;"
+            "    vec3 n = normalize(cross(dFdx(p), dFdy(p)));"
+            ""
+            "    uvec2 tile = min(uvec2(gl_FragCoord.xy / cluster_tile_size), cluster_dimensions.xy - 1u);"
+            "    uint slice = min(uint(max(log(-p.z) * cluster_depth.x + cluster_depth.y, 0.0)), cluster_dimensions.z - 1u);"
+            "    uvec2 range = texelFetch(cluster_grid, int((slice * cluster_dimensions.y + tile.y) * cluster_dimensions.x + tile.x)).rg;"
+            ""
+            "    vec3 result = vec3(0.0);"
+            "    for (uint i = 0u; i < range.y; ++i) {"
+            "        int light = int(texelFetch(cluster_indices, int(range.x + i)).r);"
+            "        vec4 position = texelFetch(cluster_lights, light * 2);"
+            "        vec4 color = texelFetch(cluster_lights, light * 2 + 1);"
+            "        vec3 l = position.xyz - p;"
+            "        float d = length(l);"
+            "        float attenuation = clamp(1.0 - d / position.w, 0.0, 1.0);"
+            "        result += albedo * color.rgb * color.a * max(dot(n, l / max(d, 1e-4)), 0.0) * attenuation * attenuation;"
+            "    }"
+            "    return result;"
+            "}";
+
+    private:
+        struct sphere {
+            float x, y, z, radius;
+        };
+
+        struct slice_scratch {
+            std::vector<GLuint> candidates;
+            std::vector<float> x, y, z, r2;     // candidate spheres, structure of arrays for SSE
+            std::vector<GLuint> indices;
+        };
+
+        struct bounds {
+            glm::vec3 min;
+            glm::vec3 max;
+        };
+
+        /* View-space boxes around every cluster; only changes with the projection or viewport. */
+        void build_bounds(const glm::mat4 &projection, float near, float far, int width, int height) {
+            m_projection = projection;
+            m_inverse_projection = glm::inverse(projection);
+            m_near = near;
+            m_far = far;
+            m_viewport = { width, height };
+            m_tile_size = { std::ceil(static_cast<float>(width) / tiles_x), std::ceil(static_cast<float>(height) / tiles_y) };
+            m_depth_scale = slices / std::log(far / near);
+            m_depth_bias = -std::log(near) * m_depth_scale;
+
+            // view-space direction through a window position, scaled so that z = -1
+            auto ray = [&](float px, float py) {
+                glm::vec4 ndc{ px / width * 2.0f - 1.0f, py / height * 2.0f - 1.0f, -1.0f, 1.0f };
+                auto v = m_inverse_projection * ndc;
+                glm::vec3 dir{ v.x / v.w, v.y / v.w, v.z / v.w };
+                return dir / -dir.z;
+            };
+
+            m_bounds.resize(cluster_count);
+            m_slice_depth.resize(slices);
+            for (int slice = 0; slice < slices; ++slice) {
+                float z0 = near * std::pow(far / near, static_cast<float>(slice) / slices);
+                float z1 = near * std::pow(far / near, static_cast<float>(slice + 1) / slices);
+                m_slice_depth[slice] = { z0, z1 };
+                for (int y = 0; y < tiles_y; ++y) {
+                    for (int x = 0; x < tiles_x; ++x) {
+                        float px0 = x * m_tile_size.x, px1 = std::min((x + 1) * m_tile_size.x, static_cast<float>(width));
+                        float py0 = y * m_tile_size.y, py1 = std::min((y + 1) * m_tile_size.y, static_cast<float>(height));
+                        bounds b{ glm::vec3{ std::numeric_limits<float>::max() }, glm::vec3{ std::numeric_limits<float>::lowest() } };
+                        for (auto &&corner : { ray(px0, py0), ray(px1, py0), ray(px0, py1), ray(px1, py1) }) {
+                            b.min = glm::min(b.min, glm::min(corner * z0, corner * z1));
+                            b.max = glm::max(b.max, glm::max(corner * z0, corner * z1));
+                        }
+                        m_bounds[(static_cast<std::size_t>(slice) * tiles_y + y) * tiles_x + x] = b;
+                    }
+                }
+            }
+        }
+
+        void assign_slice(int slice) {
+            auto &&scratch = m_slices[slice];
+            auto &&local = scratch.indices;
+            local.clear();
+
+            // lights reaching into the slice's depth range, padded to a multiple of four for SSE
+            auto &&candidates = scratch.candidates;
+            candidates.clear();
+            auto [z0, z1] = m_slice_depth[slice];
+            for (std::size_t i = 0; i < m_view_spheres.size(); ++i) {
+                float depth = -m_view_spheres[i].z;
+                if (depth + m_view_spheres[i].radius >= z0 && depth - m_view_spheres[i].radius <= z1) {
+                    candidates.push_back(static_cast<GLuint>(i));
+                }
+            }
+            auto &&[x, y, z, r2] = std::tie(scratch.x, scratch.y, scratch.z, scratch.r2);
+            std::size_t padded = (candidates.size() + 3) & ~std::size_t{ 3 };
+            x.assign(padded, 0.0f); y.assign(padded, 0.0f); z.assign(padded, 0.0f); r2.assign(padded, -1.0f);
+            for (std::size_t i = 0; i < candidates.size(); ++i) {
+                auto &&s = m_view_spheres[candidates[i]];
+                x[i] = s.x; y[i] = s.y; z[i] = s.z; r2[i] = s.radius * s.radius;
+            }
+
+            for (int tile = 0; tile < tiles_x * tiles_y; ++tile) {
+                std::size_t cluster = static_cast<std::size_t>(slice) * tiles_x * tiles_y + tile;
+                auto &&b = m_bounds[cluster];
+                auto offset = static_cast<GLuint>(local.size());
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+                __m128 zero = _mm_setzero_ps();
+                __m128 min_x = _mm_set1_ps(b.min.x), min_y = _mm_set1_ps(b.min.y), min_z = _mm_set1_ps(b.min.z);
+                __m128 max_x = _mm_set1_ps(b.max.x), max_y = _mm_set1_ps(b.max.y), max_z = _mm_set1_ps(b.max.z);
+                for (std::size_t i = 0; i < padded; i += 4) {
+                    // squared distance from the sphere center to the box, per axis max(min - c, 0, c - max)
+                    __m128 cx = _mm_loadu_ps(&x[i]), cy = _mm_loadu_ps(&y[i]), cz = _mm_loadu_ps(&z[i]);
+                    __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(min_x, cx), _mm_sub_ps(cx, max_x)), zero);
+                    __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(min_y, cy), _mm_sub_ps(cy, max_y)), zero);
+                    __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(min_z, cz), _mm_sub_ps(cz, max_z)), zero);
+                    __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                    int mask = _mm_movemask_ps(_mm_cmple_ps(d2, _mm_loadu_ps(&r2[i])));
+                    for (; mask != 0; mask &= mask - 1) {
+                        local.push_back(candidates[i + std::countr_zero(static_cast<unsigned>(mask))]);
+                    }
+                }
+#else
+                for (std::size_t i = 0; i < candidates.size(); ++i) {
+                    float dx = std::max({ b.min.x - x[i], x[i] - b.max.x, 0.0f });
+                    float dy = std::max({ b.min.y - y[i], y[i] - b.max.y, 0.0f });
+                    float dz = std::max({ b.min.z - z[i], z[i] - b.max.z, 0.0f });
+                    if (dx * dx + dy * dy + dz * dz <= r2[i]) local.push_back(candidates[i]);
+                }
+#endif
+                // offsets are slice-local until assign() concatenates the slices
+                m_grid[cluster] = { offset, static_cast<GLuint>(local.size()) - offset };
+            }
+        }
+
+        void upload_buffer(std::size_t i, GLenum format, std::size_t size, const void *data) {
+            glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[i]);
+            memory::buffer_data(memory::tag::SCENE, GL_TEXTURE_BUFFER, std::max<std::size_t>(size, 16), nullptr, GL_STREAM_DRAW);
+            if (data != nullptr && size != 0) glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+            glBindTexture(GL_TEXTURE_BUFFER, m_textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, format, m_buffers[i]);
+            glBindTexture(GL_TEXTURE_BUFFER, 0);
+            glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        }
+
+        std::array<GLuint, 3> m_buffers{};
+        std::array<GLuint, 3> m_textures{};
+
+        glm::mat4 m_projection{ 0.0f };
+        glm::mat4 m_inverse_projection{ 1.0f };
+        float m_near = 0.0f;
+        float m_far = 0.0f;
+        glm::ivec2 m_viewport{ 0 };
+        glm::vec2 m_tile_size{ 1.0f };
+        float m_depth_scale = 0.0f;
+        float m_depth_bias = 0.0f;
+        std::vector<bounds> m_bounds;
+        std::vector<std::pair<float, float>> m_slice_depth;
+
+        std::vector<sphere> m_view_spheres;
+        std::vector<glm::vec4> m_view_lights;
+        std::array<slice_scratch, slices> m_slices;
+        std::vector<glm::uvec2> m_grid;
+        std::vector<GLuint> m_indices;
+        stats m_stats;
+    };
+
+    /*
+     * Optional GL 4.3 path: every scene geometry lives in one mesh_arena and the whole draw list
+     * goes out as a single glMultiDrawElementsIndirect. Draws sharing a mesh become instances of
+     * one command; each instance reads its transform and material slot from SSBOs through a
+     * per-instance draw id attribute (base_instance offsets it, which works without
+     * ARB_shader_draw_parameters).
+     * Callers fall back to the per-geometry GL 3.3 path when is_supported() is false.
+     */
+    class indirect_renderer {
+    public:
+        static constexpr GLuint draw_id_location = 3;
+
+        static bool is_supported(const gl_context &context) {
+#ifdef GL_VERSION_4_3
+            return context.supports_version(4, 3) && GLAD_GL_VERSION_4_3;
+#else
+            return false;
+#endif
+        }
+
+        explicit indirect_renderer(geometry_arena &geometries)
+            : m_geometries(geometries), m_program(shader::create_shader(glsl_vertex.c_str(), glsl_fragment.c_str())) {
+            m_light_color_loc = glGetUniformLocation(m_program.get_program(), "light_color");
+            m_cluster_locs = light_clusters::locate(m_program.get_program());
+            material_buffer::attach(m_program.get_program());
+            late_latch::attach(m_program.get_program());
+            memory::gen_buffers(1, &m_draw_id_buffer);
+            memory::gen_buffers(1, &m_transform_buffer);
+            memory::gen_buffers(1, &m_material_buffer);
+            memory::gen_buffers(1, &m_command_buffer);
+        }
+
+        ~indirect_renderer() {
+            memory::delete_buffers(1, &m_draw_id_buffer);
+            memory::delete_buffers(1, &m_transform_buffer);
+            memory::delete_buffers(1, &m_material_buffer);
+            memory::delete_buffers(1, &m_command_buffer);
+            glDeleteProgram(m_program.get_program());
+        }
+
+        indirect_renderer(const indirect_renderer &) = delete;
+        indirect_renderer &operator=(const indirect_renderer &) = delete;
+
+        /*
+         * Geometries are welded into the arena the first time they are submitted; identical shapes share a range.
+         * Material colors come from the bound material_buffer, point lights from `clusters`.
+         */
+        void submit(const std::vector<draw_command> &draws, glm::vec3 light_color, const light_clusters &clusters) {
+#ifdef GL_VERSION_4_3
+            m_sorted.clear();
+            for (auto &&command : draws) {
+                m_sorted.push_back({ &command, m_geometries.find_or_add(*command.shape) });
+            }
+            std::sort(m_sorted.begin(), m_sorted.end(), [](const sorted_draw &a, const sorted_draw &b) {
+                return a.range.first_index < b.range.first_index;
+            });
+
+            m_commands.clear();
+            m_transforms.clear();
+            m_materials.clear();
+            for (auto &&[command, range] : m_sorted) {
+                if (m_commands.empty() || m_commands.back().first_index != range.first_index) {
+                    m_commands.push_back({ range.index_count, 0, range.first_index, range.base_vertex, static_cast<GLuint>(m_transforms.size()) });
+                }
+                ++m_commands.back().instance_count;
+                m_transforms.push_back(command->transform);
+                m_materials.push_back(command->material);
+            }
+            if (m_commands.empty()) return;
+
+            m_geometries.get_arena().commit();
+            ensure_draw_ids(m_transforms.size());
+
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_transform_buffer);
+            memory::buffer_data(memory::tag::INSTANCES, GL_SHADER_STORAGE_BUFFER, m_transforms.size() * sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, m_transforms.size() * sizeof(glm::mat4), m_transforms.data());
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_transform_buffer);
+
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_material_buffer);
+            memory::buffer_data(memory::tag::INSTANCES, GL_SHADER_STORAGE_BUFFER, m_materials.size() * sizeof(GLuint), nullptr, GL_STREAM_DRAW);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, m_materials.size() * sizeof(GLuint), m_materials.data());
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_material_buffer);
+
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_command_buffer);
+            memory::buffer_data(memory::tag::INSTANCES, GL_DRAW_INDIRECT_BUFFER, m_commands.size() * sizeof(draw_elements_indirect_command), nullptr, GL_STREAM_DRAW);
+            glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, m_commands.size() * sizeof(draw_elements_indirect_command), m_commands.data());
+
+            glUseProgram(m_program.get_program());
+            glUniform3fv(m_light_color_loc, 1, glm::value_ptr(light_color));
+            clusters.bind(m_cluster_locs);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, static_cast<GLsizei>(m_commands.size()), 0);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+#endif
+        }
+
+        std::size_t get_command_count() const noexcept { return m_commands.size(); }
+
+    private:
+        struct sorted_draw {
+            const draw_command *command;
+            mesh_range range;
+        };
+
+        /* Per-instance attribute holding 0..n-1, so instance i of a command reads draw id base_instance + i. */
+        void ensure_draw_ids(std::size_t count) {
+            if (count <= m_draw_id_capacity) return;
+            m_draw_id_capacity = std::max<std::size_t>(count, m_draw_id_capacity * 2);
+            std::vector<GLuint> ids(m_draw_id_capacity);
+            for (std::size_t i = 0; i < ids.size(); ++i) ids[i] = static_cast<GLuint>(i);
+
+            glBindVertexArray(m_geometries.get_arena().get_vao());
+            glBindBuffer(GL_ARRAY_BUFFER, m_draw_id_buffer);
+            memory::buffer_data(memory::tag::INSTANCES, GL_ARRAY_BUFFER, ids.size() * sizeof(GLuint), ids.data(), GL_STATIC_DRAW);
+            glVertexAttribIPointer(draw_id_location, 1, GL_UNSIGNED_INT, sizeof(GLuint), nullptr);
+            glVertexAttribDivisor(draw_id_location, 1);
+            glEnableVertexAttribArray(draw_id_location);
+        }
+
+        inline static const std::string glsl_vertex = std::string(
+            "#version 430 core\n"
+            "layout (location = 0) in vec3 aPos;"
+            "layout (location = 3) in uint draw_id;"
+            ""
+            "layout (std430, binding = 0) readonly buffer draw_data {"
+            "    mat4 transforms[];"
+            "};"
+            "layout (std430, binding = 1) readonly buffer draw_materials {"
+            "    uint material_of[];"
+            "};"
+            "") + late_latch::glsl_block +
+            ""
+            "flat out uint material;"
+            ""
+            "void main() {"
+            "    material = material_of[draw_id];"
+            "    gl_Position = latch_correction * (transforms[draw_id] * vec4(aPos, 1.0));"
+            "}";
+
+        inline static const std::string glsl_fragment = std::string(
+            "#version 430 core\n"
+            "out vec4 FragColor;"
+            ""
+            "flat in uint material;"
+            "uniform vec3 light_color;"
+            "") + material_buffer::glsl_block + light_clusters::glsl_shading +
+            ""
+            "void main() {"
+            "    vec3 albedo = material_albedo[material].rgb;"
+            "    FragColor = vec4(light_color * albedo + clustered_lighting(albedo), 1.0);"
+            "}";
+
+        geometry_arena &m_geometries;
+        shader m_program;
+        GLint m_light_color_loc;
+        light_clusters::uniforms m_cluster_locs;
+
+        GLuint m_draw_id_buffer;
+        GLuint m_transform_buffer;
+        GLuint m_material_buffer;
+        GLuint m_command_buffer;
+        std::size_t m_draw_id_capacity = 0;
+
+        std::vector<sorted_draw> m_sorted;
+        std::vector<draw_elements_indirect_command> m_commands;
+        std::vector<glm::mat4> m_transforms;
+        std::vector<GLuint> m_materials;
+    };
+
+    /*
+     * GL 4.3 compute culling. Instance transforms and world-space bounding spheres stay resident
+     * in SSBOs and are only re-uploaded for instances whose transform changed. Each frame a
+     * compute shader frustum-tests every instance, appends the survivors to their command's
+     * slice of the visible list and bumps instance_count directly in the indirect buffer, which
+     * is then drawn with glMultiDrawElementsIndirect. The CPU only writes the six frustum planes
+     * and one template per command.
+     * cull_reference() is the CPU equivalent, validate() compares both.
+     */
+    class gpu_culler {
+    public:
+        static constexpr GLuint local_size = 64;
+        static constexpr GLuint instance_location = 3;
+
+        explicit gpu_culler(geometry_arena &geometries)
+            : m_geometries(geometries), 
+            m_cull_program(create_compute_shader(glsl_cull)),
+            m_draw_program(shader::create_shader(glsl_vertex.c_str(), glsl_fragment.c_str())) {
+            m_planes_loc = glGetUniformLocation(m_cull_program, "planes");
+            m_instance_count_loc = glGetUniformLocation(m_cull_program, "instance_count");
+            m_view_projection_loc = glGetUniformLocation(m_draw_program.get_program(), "view_projection");
+            m_light_color_loc = glGetUniformLocation(m_draw_program.get_program(), "light_color");
+            m_cluster_locs = light_clusters::locate(m_draw_program.get_program());
+            material_buffer::attach(m_draw_program.get_program());
+            late_latch::attach(m_draw_program.get_program());
+
+            memory::gen_vertex_arrays(1, &m_vao);
+            memory::gen_buffers(static_cast<GLsizei>(m_buffers.size()), m_buffers.data());
+        }
+
+        ~gpu_culler() {
+            memory::delete_vertex_arrays(1, &m_vao);
+            memory::delete_buffers(static_cast<GLsizei>(m_buffers.size()), m_buffers.data());
+            glDeleteProgram(m_cull_program);
+            glDeleteProgram(m_draw_program.get_program());
+        }
+
+        gpu_culler(const gpu_culler &) = delete;
+        gpu_culler &operator=(const gpu_culler &) = delete;
+
+        /* Reuses a slot given back by remove_instance() before growing. */
+        std::size_t add_instance(const geo::geometry &shape) {
+            instance added{
+                m_geometries.find_or_add(shape),
+                shape.get_location().get_matrix(),
+                shape.get_bounds().radius
+            };
+            m_layout_dirty = true;
+            if (!m_free.empty()) {
+                auto id = m_free.back();
+                m_free.pop_back();
+                m_instances[id] = added;
+                return id;
+            }
+            m_instances.push_back(added);
+            return m_instances.size() - 1;
+        }
+
+        /* The instance stops drawing right away; its slot goes to the next add_instance(). */
+        void remove_instance(std::size_t instance) {
+            set_enabled(instance, false);
+            m_free.push_back(instance);
+        }
+
+        void set_transform(std::size_t instance, const glm::mat4 &model) {
+            m_instances[instance].model = model;
+            mark(instance);
+        }
+
+        /* `material` is a material_buffer slot. */
+        void set_material(std::size_t instance, std::uint32_t material) {
+            m_instances[instance].material = material;
+            mark(instance);
+        }
+
+        /* Disabled instances keep their slot but never pass the frustum test. */
+        void set_enabled(std::size_t instance, bool enabled) {
+            if (m_instances[instance].enabled == enabled) return;
+            m_instances[instance].enabled = enabled;
+            mark(instance);
+        }
+
+        /* Live instances, removed ones not included. */
+        std::size_t get_instance_count() const noexcept { return m_instances.size() - m_free.size(); }
+
+        void draw(const glm::mat4 &view_projection, glm::vec3 light_color, const light_clusters &clusters) {
+#ifdef GL_VERSION_4_3
+            if (m_instances.empty()) return;
+            dispatch(frustum(view_projection));
+
+            m_geometries.get_arena().commit();
+            glBindVertexArray(m_vao);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_buffers[COMMANDS]);
+            glUseProgram(m_draw_program.get_program());
+            glUniformMatrix4fv(m_view_projection_loc, 1, GL_FALSE, glm::value_ptr(view_projection));
+            glUniform3fv(m_light_color_loc, 1, glm::value_ptr(light_color));
+            clusters.bind(m_cluster_locs);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, m_buffers[MATERIALS]);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, static_cast<GLsizei>(m_commands.size()), 0);
+            glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+#endif
+        }
+
+        /* Visible instance ids per command, sorted. */
+        std::vector<std::vector<GLuint>> cull_reference(const frustum &view_frustum) {
+            prepare();
+            std::vector<std::vector<GLuint>> visible(m_commands.size());
+            for (std::size_t slot = 0; slot < m_slot_bounds.size(); ++slot) {
+                auto &&bounds = m_slot_bounds[slot];
+                if (view_frustum.intersects_sphere(glm::vec3{ bounds.x, bounds.y, bounds.z }, bounds.w)) {
+                    visible[m_slot_command[slot]].push_back(static_cast<GLuint>(slot));
+                }
+            }
+            return visible;
+        }
+
+        struct validation {
+            std::size_t commands = 0;
+            std::size_t mismatched = 0;     // commands whose visible list differs from the reference
+            std::size_t visible = 0;
+            std::size_t expected = 0;
+        };
+
+        /* Runs the compute pass, reads the results back (stalls) and compares them to cull_reference(). */
+        validation validate(const glm::mat4 &view_projection) {
+            validation result;
+#ifdef GL_VERSION_4_3
+            if (m_instances.empty()) return result;
+            frustum view_frustum(view_projection);
+            auto expected = cull_reference(view_frustum);
+            dispatch(view_frustum);
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+            std::vector<draw_elements_indirect_command> commands(m_commands.size());
+            std::vector<GLuint> visible(m_instances.size());
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[COMMANDS]);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, commands.size() * sizeof(draw_elements_indirect_command), commands.data());
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[VISIBLE]);
+            glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, visible.size() * sizeof(GLuint), visible.data());
+
+            for (std::size_t c = 0; c < commands.size(); ++c) {
+                auto first = visible.begin() + commands[c].base_instance;
+                std::vector<GLuint> actual(first, first + commands[c].instance_count);
+                std::sort(actual.begin(), actual.end());
+                result.visible += actual.size();
+                result.expected += expected[c].size();
+                if (actual != expected[c]) ++result.mismatched;
+            }
+            result.commands = commands.size();
+#endif
+            return result;
+        }
+
+    private:
+        enum buffer_index { TRANSFORMS, BOUNDS, INSTANCE_COMMAND, VISIBLE, COMMANDS, MATERIALS, BUFFER_COUNT };
+
+        struct instance {
+            mesh_range range;
+            glm::mat4 model;
+            float local_radius;
+            GLuint material = 0;
+            bool enabled = true;
+        };
+
+        void mark(std::size_t instance) {
+            if (m_layout_dirty) return;
+            std::size_t slot = m_slot_of[instance];
+            m_dirty_begin = std::min(m_dirty_begin, slot);
+            m_dirty_end = std::max(m_dirty_end, slot + 1);
+        }
+
+        static glm::vec4 world_bounds(const instance &i) {
+            // a radius of -max fails every plane test, on the GPU and in cull_reference() alike
+            if (!i.enabled) return glm::vec4{ glm::vec3(i.model[3]), -std::numeric_limits<float>::max() };
+            float scale = std::max({ glm::length(glm::vec3(i.model[0])), glm::length(glm::vec3(i.model[1])), glm::length(glm::vec3(i.model[2])) });
+            return glm::vec4{ glm::vec3(i.model[3]), i.local_radius * scale };
+        }
+
+        /* Sorts instances into per-command slot ranges and uploads everything once. */
+        void rebuild() {
+            std::vector<std::size_t> order(m_instances.size());
+            for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+                return m_instances[a].range.first_index < m_instances[b].range.first_index;
+            });
+
+            m_commands.clear();
+            m_slot_of.assign(m_instances.size(), 0);
+            m_slot_command.clear();
+            m_slot_bounds.clear();
+            m_slot_transforms.clear();
+            m_slot_materials.clear();
+            for (std::size_t slot = 0; slot < order.size(); ++slot) {
+                auto &&i = m_instances[order[slot]];
+                if (m_commands.empty() || m_commands.back().first_index != i.range.first_index) {
+                    m_commands.push_back({ i.range.index_count, 0, i.range.first_index, i.range.base_vertex, static_cast<GLuint>(slot) });
+                }
+                m_slot_of[order[slot]] = slot;
+                m_slot_command.push_back(static_cast<GLuint>(m_commands.size() - 1));
+                m_slot_bounds.push_back(world_bounds(i));
+                m_slot_transforms.push_back(i.model);
+                m_slot_materials.push_back(i.material);
+            }
+
+            auto upload = [](GLuint buffer, std::size_t size, const void *data) {
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+                memory::buffer_data(memory::tag::INSTANCES, GL_SHADER_STORAGE_BUFFER, size, data, GL_DYNAMIC_DRAW);
+            };
+            upload(m_buffers[TRANSFORMS], m_slot_transforms.size() * sizeof(glm::mat4), m_slot_transforms.data());
+            upload(m_buffers[BOUNDS], m_slot_bounds.size() * sizeof(glm::vec4), m_slot_bounds.data());
+            upload(m_buffers[INSTANCE_COMMAND], m_slot_command.size() * sizeof(GLuint), m_slot_command.data());
+            upload(m_buffers[VISIBLE], m_instances.size() * sizeof(GLuint), nullptr);
+            upload(m_buffers[COMMANDS], m_commands.size() * sizeof(draw_elements_indirect_command), m_commands.data());
+            upload(m_buffers[MATERIALS], m_slot_materials.size() * sizeof(GLuint), m_slot_materials.data());
+
+            // the visible list doubles as the per-instance attribute, offset by each command's base_instance
+            auto &arena = m_geometries.get_arena();
+            arena.commit();
+            glBindVertexArray(m_vao);
+            glBindBuffer(GL_ARRAY_BUFFER, arena.get_vbo());
+            vertex::position::layout::apply();
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.get_ebo());
+            glBindBuffer(GL_ARRAY_BUFFER, m_buffers[VISIBLE]);
+            glVertexAttribIPointer(instance_location, 1, GL_UNSIGNED_INT, sizeof(GLuint), nullptr);
+            glVertexAttribDivisor(instance_location, 1);
+            glEnableVertexAttribArray(instance_location);
+            glBindVertexArray(0);
+
+            m_layout_dirty = false;
+            m_dirty_begin = m_instances.size();
+            m_dirty_end = 0;
+        }
+
+        void prepare() {
+            if (m_layout_dirty) {
+                rebuild();
+                return;
+            }
+            if (m_dirty_begin >= m_dirty_end) return;
+
+            for (std::size_t id = 0; id < m_instances.size(); ++id) {
+                std::size_t slot = m_slot_of[id];
+                if (slot < m_dirty_begin || slot >= m_dirty_end) continue;
+                m_slot_transforms[slot] = m_instances[id].model;
+                m_slot_bounds[slot] = world_bounds(m_instances[id]);
+                m_slot_materials[slot] = m_instances[id].material;
+            }
+            std::size_t count = m_dirty_end - m_dirty_begin;
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[TRANSFORMS]);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, m_dirty_begin * sizeof(glm::mat4), count * sizeof(glm::mat4), &m_slot_transforms[m_dirty_begin]);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[BOUNDS]);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, m_dirty_begin * sizeof(glm::vec4), count * sizeof(glm::vec4), &m_slot_bounds[m_dirty_begin]);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[MATERIALS]);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, m_dirty_begin * sizeof(GLuint), count * sizeof(GLuint), &m_slot_materials[m_dirty_begin]);
+            m_dirty_begin = m_instances.size();
+            m_dirty_end = 0;
+        }
+
+        void dispatch(const frustum &view_frustum) {
+#ifdef GL_VERSION_4_3
+            prepare();
+
+            // reset instance counts by re-uploading the command templates
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, m_buffers[COMMANDS]);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, m_commands.size() * sizeof(draw_elements_indirect_command), m_commands.data());
+
+            glUseProgram(m_cull_program);
+            glUniform4fv(m_planes_loc, 6, glm::value_ptr(view_frustum.get_planes()[0]));
+            glUniform1ui(m_instance_count_loc, static_cast<GLuint>(m_instances.size()));
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, m_buffers[TRANSFORMS]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, m_buffers[BOUNDS]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, m_buffers[INSTANCE_COMMAND]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, m_buffers[VISIBLE]);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, m_buffers[COMMANDS]);
+            glDispatchCompute(static_cast<GLuint>((m_instances.size() + local_size - 1) / local_size), 1, 1);
+            glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+#endif
+        }
+
+        static GLuint create_compute_shader(const char *source) {
+#ifdef GL_VERSION_4_3
+            GLint success;
+            constexpr auto info_log_size = 512;
+            char info_log[info_log_size];
+
+            GLuint compute_shader = glCreateShader(GL_COMPUTE_SHADER);
+            glShaderSource(compute_shader, 1, &source, nullptr);
+            glCompileShader(compute_shader);
+            glGetShaderiv(compute_shader, GL_COMPILE_STATUS, &success);
+            if (success == GL_FALSE) {
+                glGetShaderInfoLog(compute_shader, info_log_size, nullptr, info_log);
+                std::cout << "Compute shader could not be compiled:\n" << info_log << '\n';
+            }
+
+            GLuint program = glCreateProgram();
+            glAttachShader(program, compute_shader);
+            glLinkProgram(program);
+            glGetProgramiv(program, GL_LINK_STATUS, &success);
+            if (success == GL_FALSE) {
+                glGetProgramInfoLog(program, info_log_size, nullptr, info_log);
+                std::cout << "Compute program linkage failure:\n" << info_log << '\n';
+            }
+            glDeleteShader(compute_shader);
+            return program;
+#else
+            return 0;
+#endif
+        }
+
+        static constexpr const char *glsl_cull =
+            "#version 430 core\n"
+            "layout (local_size_x = 64) in;"
+            ""
+            "struct draw_command {"
+            "    uint count;"
+            "    uint instance_count;"
+            "    uint first_index;"
+            "    int base_vertex;"
+            "    uint base_instance;"
+            "};"
+            ""
+            "layout (std430, binding = 1) readonly buffer instance_bounds { vec4 bounds[]; };"
+            "layout (std430, binding = 2) readonly buffer instance_commands { uint command_of[]; };"
+            "layout (std430, binding = 3) writeonly buffer visible_instances { uint visible[]; };"
+            "layout (std430, binding = 4) buffer draw_commands { draw_command commands[]; };"
+            ""
+            "uniform vec4 planes[6];"
+            "uniform uint instance_count;"
+            ""
+            "void main() {"
+            "    uint i = gl_GlobalInvocationID.x;"
+            "    if (i >= instance_count) return;"
+            "    vec4 b = bounds[i];"
+            "    for (int p = 0; p < 6; ++p) {"
+            "        if (dot(planes[p].xyz, b.xyz) + planes[p].w < -b.w) return;"
+            "    }"
+            "    uint c = command_of[i];"
+            "    uint slot = atomicAdd(commands[c].instance_count, 1u);"
+            "    visible[commands[c].base_instance + slot] = i;"
+            "}";
+
+        inline static const std::string glsl_vertex = std::string(
+            "#version 430 core\n"
+            "layout (location = 0) in vec3 aPos;"
+            "layout (location = 3) in uint instance;"
+            ""
+            "layout (std430, binding = 0) readonly buffer instance_transforms {"
+            "    mat4 transforms[];"
+            "};"
+            "layout (std430, binding = 5) readonly buffer instance_materials {"
+            "    uint material_of[];"
+            "};"
+            "") + late_latch::glsl_block +
+            ""
+            "uniform mat4 view_projection;"
+            "flat out uint material;"
+            ""
+            "void main() {"
+            "    material = material_of[instance];"
+            "    gl_Position = latch_correction * (view_projection * transforms[instance] * vec4(aPos, 1.0));"
+            "}";
+
+        inline static const std::string glsl_fragment = std::string(
+            "#version 430 core\n"
+            "out vec4 FragColor;"
+            ""
+            "flat in uint material;"
+            "uniform vec3 light_color;"
+            "") + material_buffer::glsl_block + light_clusters::glsl_shading +
+            ""
+            "void main() {"
+            "    vec3 albedo = material_albedo[material].rgb;"
+            "    FragColor = vec4(light_color * albedo + clustered_lighting(albedo), 1.0);"
+            "}";
+
+        geometry_arena &m_geometries;
+        GLuint m_cull_program;
+        shader m_draw_program;
+        GLint m_planes_loc;
+        GLint m_instance_count_loc;
+        GLint m_view_projection_loc;
+        GLint m_light_color_loc;
+        light_clusters::uniforms m_cluster_locs;
+        GLuint m_vao;
+        std::array<GLuint, BUFFER_COUNT> m_buffers{};
+
+        std::vector<instance> m_instances;
+        std::vector<std::size_t> m_free;
+        std::vector<std::size_t> m_slot_of;
+        std::vector<GLuint> m_slot_command;
+        std::vector<glm::vec4> m_slot_bounds;
+        std::vector<glm::mat4> m_slot_transforms;
+        std::vector<GLuint> m_slot_materials;
+        std::vector<draw_elements_indirect_command> m_commands;
+        bool m_layout_dirty = true;
+        std::size_t m_dirty_begin = 0;
+        std::size_t m_dirty_end = 0;
+    };
+
+    /* ECS mirror of a scene geometry; the entity's mk::location is the source of truth for its GPU instance. */
+    struct scene_node {
+        static constexpr std::size_t no_instance = std::numeric_limits<std::size_t>::max();
+
+        geo::geometry *shape;
+        std::size_t gpu_instance = no_instance;     // assigned by gpu_instance_owners
+    };
+
+    /* Surface of a scene entity; `slot` is its entry in the material_buffer. */
+    struct material {
+        glm::vec3 albedo;
+        std::uint32_t slot;
+    };
+
+    /* Entities with a lifetime are destroyed by age_entities() once it runs out. */
+    struct lifetime {
+        float remaining;
+    };
+
+    /* Tag for entities that never move once spawned, so static_batcher may bake them. */
+    struct static_geometry {};
+
+    /*
+     * Spawns `count` entities spread over `partitions` tasks and ages every entity with a lifetime.
+     * Both only record into the command queue; nothing changes until the caller plays it back.
+     */
+    void spawn_entities(ecs::command_queue &commands, std::size_t partitions, std::size_t count, float seconds, float extent) {
+        commands.resize(partitions);
+        default_thread_pool().parallel_for(partitions, 1, [&](std::size_t begin, std::size_t end) {
+            for (std::size_t p = begin; p < end; ++p) {
+                memory::scope tag(memory::tag::SCENE);
+                auto &&buffer = commands[p];
+                std::size_t first = count * p / partitions, last = count * (p + 1) / partitions;
+                for (std::size_t i = first; i < last; ++i) {
+                    auto entity = buffer.create();
+                    float angle = static_cast<float>(i) * 2.39996f;     // golden angle spiral
+                    float r = extent * std::sqrt(static_cast<float>(i + 1) / static_cast<float>(count));
+                    buffer.emplace<location>(entity, glm::vec3{ r * std::cos(angle), 0.0f, r * std::sin(angle) });
+                    buffer.emplace<lifetime>(entity, seconds);
+                }
+            }
+        });
+    }
+
+    void age_entities(ecs::world &world, ecs::command_queue &commands, float delta_time) {
+        world.query<lifetime>().each_parallel(default_thread_pool(), commands, [delta_time](ecs::command_buffer &buffer, ecs::entity e, lifetime &l) {
+            l.remaining -= delta_time;
+            if (l.remaining <= 0.0f) buffer.destroy(e);
+        });
+    }
+
+    /* Everything a simulation step reads from outside the world, so it can be logged and replayed. */
+    struct simulation_input {
+        float time;
+        float delta_time;
+        std::uint32_t spawn_count;
+        float spawn_lifetime;
+        bool bob;
+        std::vector<location> props{};  // prefab instances stamped before the step
+    };
+
+    /*
+     * One step of the scene: spawning, aging and bobbing the dynamic geometries. The outcome only
+     * depends on the world and `input`; command queues play back in partition order, so the thread
+     * schedule does not leak into the result.
+     */
+    void step_simulation(ecs::world &world, ecs::command_queue &spawn_commands, ecs::command_queue &age_commands, const ecs::prefab &prop, 
+        const simulation_input &input) {
+        if (!input.props.empty()) world.instantiate(prop, input.props.size(), std::span<const location>(input.props));
+        spawn_entities(spawn_commands, default_thread_pool().size() + 1, input.spawn_count, input.spawn_lifetime, 30.0f);
+        age_entities(world, age_commands, input.delta_time);
+        spawn_commands.playback(world);
+        age_commands.playback(world);
+        if (input.bob) {
+            world.query<location, const scene_node>().each([&](ecs::entity e, location &l, const scene_node &node) {
+                if (world.has<static_geometry>(e)) return;
+                l.pos.y = node.shape->get_location().pos.y + 0.5f * std::sin(input.time * 2.0f + static_cast<float>(e.index));
+            });
+        }
+    }
+
+    /*
+     * Rewind and replay for the scene world: a ring of snapshots, each paired with the input of the
+     * step taken right after it. Restoring entry i and stepping the logged inputs from i on brings
+     * the world back to the present, which replay() verifies.
+     */
+    class scene_recorder {
+    public:
+        explicit scene_recorder(std::size_t capacity) : m_history(capacity) { }
+
+        /* Call right before stepping the world with `input`. */
+        void record(const ecs::world &world, const simulation_input &input) {
+            if (m_inputs.size() == m_history.capacity()) m_inputs.pop_front();
+            m_history.record(world);
+            m_inputs.push_back(input);
+        }
+
+        /* Restores entry `index` and forgets the entries from there on; the session branches off. */
+        void rewind(ecs::world &world, std::size_t index) {
+            world.restore(m_history[index]);
+            m_history.truncate(index);
+            m_inputs.resize(index);
+        }
+
+        /* Re-simulates from entry `index` to the present; true when the result matches the live state. */
+        bool replay(ecs::world &world, std::size_t index, ecs::command_queue &spawn_commands, ecs::command_queue &age_commands, const ecs::prefab &prop) {
+            auto expected = hash_locations(world);
+            world.restore(m_history[index]);
+            for (std::size_t i = index; i < m_inputs.size(); ++i) step_simulation(world, spawn_commands, age_commands, prop, m_inputs[i]);
+            return hash_locations(world) == expected;
+        }
+
+        void clear() {
+            m_history.clear();
+            m_inputs.clear();
+        }
+
+        const ecs::history &get_history() const noexcept { return m_history; }
+
+        /* FNV-1a over every entity with a location, in storage order. */
+        static std::uint64_t hash_locations(ecs::world &world) {
+            std::uint64_t hash = 14695981039346656037ull;
+            auto mix = [&](std::uint32_t v) {
+                for (int i = 0; i < 4; ++i) hash = (hash ^ ((v >> (8 * i)) & 0xff)) * 1099511628211ull;
+            };
+            world.query<const location>().each([&](ecs::entity e, const location &l) {
+                mix(e.index);
+                mix(e.generation);
+                for (int axis = 0; axis < 3; ++axis) mix(std::bit_cast<std::uint32_t>(l.pos[axis]));
+            });
+            return hash;
+        }
+
+    private:
+        ecs::history m_history;
+        std::deque<simulation_input> m_inputs;
+    };
+
+    /*
+     * Pushes locations that changed after `since` into the GPU culler. Only chunks stamped since then
+     * are visited, so the cost follows the number of moved entities rather than the scene size.
+     */
+    std::size_t sync_gpu_instances(ecs::world &world, gpu_culler &culler, ecs::tick since) {
+        std::size_t synced = 0;
+        world.query<const location, const scene_node>().changed_since(since).each([&](ecs::entity, const location &l, const scene_node &node) {
+            if (node.gpu_instance == scene_node::no_instance) return;
+            culler.set_transform(node.gpu_instance, l.get_matrix());
+            ++synced;
+        });
+        return synced;
+    }
+
+    /*
+     * Which entity holds each GPU culler instance. reconcile() gives every entity with a scene_node
+     * an instance of its own and returns those of entities that lost theirs; a restore may bring
+     * back an entity whose instance went to someone else meanwhile, it gets a new one. It walks
+     * the whole world, so it belongs after stamps and restores rather than in every frame.
+     */
+    class gpu_instance_owners {
+    public:
+        /* Returns the number of instances handed out. */
+        std::size_t reconcile(ecs::world &world, gpu_culler &culler) {
+            for (std::size_t id = 0; id < m_owners.size(); ++id) {
+                auto owner = m_owners[id];
+                if (!owner) continue;
+                if (world.alive(owner) && world.has<scene_node>(owner) && world.read<scene_node>(owner).gpu_instance == id) continue;
+                culler.remove_instance(id);
+                m_owners[id] = {};
+            }
+
+            std::vector<ecs::entity> unassigned;
+            world.query<const scene_node>().each([&](ecs::entity e, const scene_node &node) {
+                if (node.gpu_instance >= m_owners.size() || m_owners[node.gpu_instance] != e) unassigned.push_back(e);
+            });
+            for (auto e : unassigned) {
+                auto &&node = world.get<scene_node>(e);
+                node.gpu_instance = culler.add_instance(*node.shape);
+                if (node.gpu_instance >= m_owners.size()) m_owners.resize(node.gpu_instance + 1);
+                m_owners[node.gpu_instance] = e;
+                if (world.has<location>(e)) culler.set_transform(node.gpu_instance, world.read<location>(e).get_matrix());
+                if (world.has<material>(e)) culler.set_material(node.gpu_instance, world.read<material>(e).slot);
+            }
+            return unassigned.size();
+        }
+
+    private:
+        std::vector<ecs::entity> m_owners;      // per culler instance, invalid while free
+    };
+
+    /*
+     * Packs materials written after `since` into the material buffer and sends them with one
+     * upload. Returns the number of buffer entries uploaded.
+     */
+    std::size_t sync_materials(ecs::world &world, material_buffer &materials, ecs::tick since) {
+        world.query<const material>().changed_since(since).each([&](ecs::entity, const material &m) {
+            materials.set(m.slot, m.albedo);
+        });
+        return materials.upload();
+    }
+
+    /*
+     * Load-time static batching. Every entity tagged static_geometry is pre-transformed into
+     * world space and appended to the batch of the grid cell holding its origin; each cell is
+     * welded, cache-optimized and uploaded once. Vertices carry their material slot, so a cell
+     * needs one draw however many materials it mixes. Drawing is a frustum test per cell
+     * bounds and one glDrawElements per visible cell, with nothing uploaded per frame.
+     */
+    class static_batcher {
+    public:
+        struct stats {
+            std::size_t sources = 0;
+            std::size_t batches = 0;
+            std::size_t vertices = 0;
+            std::size_t triangles = 0;
+            std::size_t bytes = 0;
+            std::size_t drawn = 0;          // last draw()
+            float build_ms = 0.0f;
+        };
+
+        static_batcher() = default;
+        ~static_batcher() { release(); }
+
+        static_batcher(const static_batcher &) = delete;
+        static_batcher &operator=(const static_batcher &) = delete;
+
+        /* Replaces all batches. Returns the ids of the geometries that were baked. */
+        std::unordered_set<std::size_t> build(ecs::world &world, float cell_size) {
+            auto start = frame_clock::now();
+            release();
+            m_stats = {};
+
+            struct cell_key_hash {
+                std::size_t operator()(const glm::ivec3 &c) const noexcept {
+                    return static_cast<std::size_t>(c.x) * 73856093u ^ static_cast<std::size_t>(c.y) * 19349663u ^ static_cast<std::size_t>(c.z) * 83492791u;
+                }
+            };
+            std::unordered_map<glm::ivec3, std::vector<vertex::batched>, cell_key_hash> cells;
+            std::unordered_set<std::size_t> baked;
+
+            world.query<const location, const scene_node, const material, const static_geometry>().each(
+                [&](ecs::entity, const location &l, const scene_node &node, const material &m, const static_geometry &) {
+                    auto model = l.get_matrix();
+                    auto &&xyz = node.shape->get_vertices();
+                    auto &&cell = cells[glm::ivec3(glm::floor(l.pos / cell_size))];
+                    for (std::size_t i = 0; i + 2 < xyz.size(); i += 3) {
+                        auto p = model * glm::vec4{ xyz[i], xyz[i + 1], xyz[i + 2], 1.0f };
+                        cell.push_back({ { { p.x, p.y, p.z } }, { { static_cast<std::uint16_t>(m.slot), 0 } } });
+                    }
+                    baked.insert(node.shape->get_id());
+                    ++m_stats.sources;
+                });
+
+            for (auto &&[key, vertices] : cells) {
+                auto mesh = mesh_optimizer::weld(vertices);
+                mesh_optimizer::optimize(mesh, vertices.size());
+
+                batch b;
+                b.min = glm::vec3{ std::numeric_limits<float>::max() };
+                b.max = glm::vec3{ std::numeric_limits<float>::lowest() };
+                for (auto &&v : mesh.vertices) {
+                    auto p = vertex::decode_position(v);
+                    b.min = glm::min(b.min, p);
+                    b.max = glm::max(b.max, p);
+                }
+                b.index_count = static_cast<GLsizei>(mesh.indices.size());
+                memory::gen_vertex_arrays(1, &b.vao);
+                glBindVertexArray(b.vao);
+                memory::gen_buffers(1, &b.vbo);
+                memory::gen_buffers(1, &b.ebo);
+                geo::upload_mesh(b.vbo, b.ebo, mesh);
+                m_batches.push_back(b);
+
+                m_stats.vertices += mesh.vertices.size();
+                m_stats.triangles += mesh.indices.size() / 3;
+                m_stats.bytes += mesh.vertices.size() * sizeof(vertex::batched) + mesh.indices.size() * sizeof(GLuint);
+            }
+            glBindVertexArray(0);
+
+            m_stats.batches = m_batches.size();
+            m_stats.build_ms = std::chrono::duration<float, std::milli>(frame_clock::now() - start).count();
+            return baked;
+        }
+
+        /* The caller binds the program; positions are already in world space. */
+        void draw(const frustum &view_frustum) {
+            m_stats.drawn = 0;
+            for (auto &&b : m_batches) {
+                if (!view_frustum.intersects_aabb(b.min, b.max)) continue;
+                glBindVertexArray(b.vao);
+                glDrawElements(GL_TRIANGLES, b.index_count, GL_UNSIGNED_INT, nullptr);
+                ++m_stats.drawn;
+            }
+        }
+
+        const stats &get_stats() const noexcept { return m_stats; }
+
+    private:
+        struct batch {
+            glm::vec3 min;
+            glm::vec3 max;
+            GLuint vao = 0;
+            GLuint vbo = 0;
+            GLuint ebo = 0;
+            GLsizei index_count = 0;
+        };
+
+        void release() {
+            for (auto &&b : m_batches) {
+                memory::delete_vertex_arrays(1, &b.vao);
+                memory::delete_buffers(1, &b.vbo);
+                memory::delete_buffers(1, &b.ebo);
+            }
+            m_batches.clear();
+        }
+
+        std::vector<batch> m_batches;
+        stats m_stats;
+    };
+
+    /*
+     * Pre-generated tessellation levels of a parametric sphere. Level 0 is the authored detail,
+     * each further level halves the sector and stack counts.
+     */
+    class lod_chain {
+    public:
+        static constexpr int max_levels = 6;
+        static constexpr int min_sectors = 4;
+        static constexpr int min_stacks = 3;
+
+        lod_chain(int sector_count, int stack_count) {
+            for (int i = 0; i < max_levels; ++i) {
+                int sectors = std::max(sector_count >> i, min_sectors);
+                int stacks = std::max(stack_count >> i, min_stacks);
+                if (i > 0 && sectors == m_levels.back().sectors && stacks == m_levels.back().stacks) break;
+
+                level l{ nullptr, sectors, stacks };
+                l.mesh = geo::load_sphere_mesh(sectors, stacks, &l.stats);
+                memory::gen_vertex_arrays(1, &l.vao);
+                glBindVertexArray(l.vao);
+                memory::gen_buffers(1, &l.vbo);
+                memory::gen_buffers(1, &l.ebo);
+                geo::upload_mesh(l.vbo, l.ebo, *l.mesh);
+                m_levels.push_back(std::move(l));
+            }
+            glBindVertexArray(0);
+        }
+
+        ~lod_chain() {
+            for (auto &&l : m_levels) {
+                memory::delete_vertex_arrays(1, &l.vao);
+                memory::delete_buffers(1, &l.vbo);
+                memory::delete_buffers(1, &l.ebo);
+            }
+        }
+
+        lod_chain(const lod_chain &) = delete;
+        lod_chain &operator=(const lod_chain &) = delete;
+
+        int get_level_count() const noexcept { return static_cast<int>(m_levels.size()); }
+
+        std::size_t get_triangle_count(int level) const noexcept {
+            return m_levels[level].mesh->indices.size() / 3;
+        }
+
+        /* What the mesh optimizer did to the level's mesh. */
+        const geo::mesh_stats &get_stats(int level) const noexcept { return m_levels[level].stats; }
+
+        void draw(int level) const {
+            glBindVertexArray(m_levels[level].vao);
+            glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(m_levels[level].mesh->indices.size()), GL_UNSIGNED_INT, nullptr);
+        }
+
+    private:
+        struct level {
+            std::shared_ptr<const geo::indexed_mesh<vertex::compact>> mesh;
+            int sectors;
+            int stacks;
+            geo::mesh_stats stats{};
+            GLuint vao = 0;
+            GLuint vbo = 0;
+            GLuint ebo = 0;
+        };
+
+        std::vector<level> m_levels;
+    };
+
+    struct lod_instance {
+        glm::vec3 center{ 0.0f };
+        float radius = 1.0f;
+        int level = 0;
+        int previous_level = 0;
+        float fade = 1.0f;          // 1 when not transitioning
+        float screen_radius = 0.0f; // in pixels, from the last selection
+    };
+
+    struct lod_settings {
+        float finest_radius = 256.0f;   // screen radius in pixels from which level 0 is used, halves per level
+        float hysteresis = 0.15f;       // relative band around each threshold that does not cause a switch
+        float fade_time = 0.3f;         // seconds
+        bool cross_fade = true;
+    };
+
+    /*
+     * LOD selection for a batch of instances. projection_scale converts view-space size at distance 1
+     * into pixels, i.e. projection[1][1] * viewport_height / 2.
+     */
+    void select_lods(std::span<lod_instance> instances, int level_count, const glm::mat4 &view, 
+                     float projection_scale, float delta_time, const lod_settings &settings) {
+        auto select = [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                auto &instance = instances[i];
+                auto view_center = view * glm::vec4{ instance.center, 1.0f };
+                float distance = std::max(-view_center.z, 1e-3f);
+                instance.screen_radius = instance.radius * projection_scale / distance;
+
+                // level k covers [finest / 2^k, finest / 2^(k-1)); thresholds move away from the current level
+                int level = 0;
+                float threshold = settings.finest_radius;
+                while (level + 1 < level_count) {
+                    float band = level < instance.level ? 1.0f + settings.hysteresis : 1.0f - settings.hysteresis;
+                    if (instance.screen_radius >= threshold * band) break;
+                    threshold *= 0.5f;
+                    ++level;
+                }
+
+                if (level != instance.level) {
+                    instance.previous_level = instance.level;
+                    instance.level = level;
+                    instance.fade = settings.cross_fade ? 0.0f : 1.0f;
+                }
+                else if (instance.fade < 1.0f) {
+                    instance.fade = std::min(1.0f, instance.fade + delta_time / settings.fade_time);
+                }
+            }
+        };
+        default_thread_pool().parallel_for(instances.size(), 4096, select);
+    }
+
+    struct terrain_settings {
+        bool enabled = true;
+        bool wireframe = false;
+        bool freeze_selection = false;
+        float lod_distance = 100.0f;    // range of level 0 in world units, doubles per level
+        float morph_start = 0.66f;      // fraction of a level's band after which its vertices start morphing
+    };
+
+    struct terrain_stats {
+        std::size_t patches = 0;
+        std::size_t triangles = 0;
+        std::size_t culled_nodes = 0;
+        float select_ms = 0.0f;
+    };
+
+    /*
+     * Continuous distance-dependent LOD (CDLOD) terrain over a square heightmap. A quadtree picks
+     * nodes by distance ranges that double per level and drops nodes outside the frustum using
+     * per-node min/max heights. Every selected node is drawn with the same patch grid mesh: the
+     * vertex shader scales it to the node, fetches heights from the heightmap texture and morphs
+     * odd vertices onto the next coarser grid towards the end of the node's range, so levels meet
+     * without cracks or popping. The triangle count follows the LOD ranges rather than the
+     * terrain size; memory is the heightmap plus the min/max tree.
+     */
+    class terrain {
+    public:
+        static constexpr int patch_resolution = 32;     // quads per patch side, even so quadrants split cleanly
+
+        struct patch {
+            glm::vec2 origin;   // world xz of the node's corner
+            float size;
+            int level;
+            int quadrant;       // 0-3 draws one quarter of the node, -1 all of it
+        };
+
+        terrain(float size, float height_scale, float base_height, int heightmap_resolution, int level_count, std::uint32_t seed = 7)
+            : m_size(size), m_height_scale(height_scale), m_base_height(base_height), m_origin(-size * 0.5f),
+            m_resolution(heightmap_resolution), m_level_count(level_count),
+            m_heights(generate_heightmap(heightmap_resolution, seed)),
+            m_program(shader::create_shader(glsl_vertex.c_str(), glsl_fragment)) {
+            if ((heightmap_resolution >> (level_count - 1)) < 1) {
+                throw std::runtime_error("Terrain heightmap is smaller than its leaf node count.");
+            }
+            build_bounds();
+
+            memory::gen_textures(1, &m_heightmap);
+            glBindTexture(GL_TEXTURE_2D, m_heightmap);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_R16, m_resolution, m_resolution, 0, GL_RED, GL_UNSIGNED_SHORT, m_heights.data());
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glBindTexture(GL_TEXTURE_2D, 0);
+
+            geo::indexed_mesh<vertex::grid_position> mesh{ geo::generate_grid_vertices(patch_resolution), geo::generate_grid_triangles(patch_resolution) };
+            m_index_count = static_cast<GLsizei>(mesh.indices.size());
+            memory::gen_vertex_arrays(1, &m_vao);
+            glBindVertexArray(m_vao);
+            memory::gen_buffers(1, &m_vbo);
+            memory::gen_buffers(1, &m_ebo);
+            geo::upload_mesh(m_vbo, m_ebo, mesh);
+            glBindVertexArray(0);
+
+            auto program = m_program.get_program();
+            m_view_projection_loc = glGetUniformLocation(program, "view_projection");
+            m_camera_loc = glGetUniformLocation(program, "camera");
+            m_node_loc = glGetUniformLocation(program, "node");
+            m_morph_loc = glGetUniformLocation(program, "morph");
+            m_terrain_loc = glGetUniformLocation(program, "terrain");
+            m_base_height_loc = glGetUniformLocation(program, "base_height");
+            m_light_color_loc = glGetUniformLocation(program, "light_color");
+            late_latch::attach(program);
+            glUseProgram(program);
+            glUniform1i(glGetUniformLocation(program, "heightmap"), 0);
+        }
+
+        ~terrain() {
+            memory::delete_vertex_arrays(1, &m_vao);
+            memory::delete_buffers(1, &m_vbo);
+            memory::delete_buffers(1, &m_ebo);
+            memory::delete_textures(1, &m_heightmap);
+            glDeleteProgram(m_program.get_program());
+        }
+
+        terrain(const terrain &) = delete;
+        terrain &operator=(const terrain &) = delete;
+
+        /* Rebuilds the patch list for a camera position; the ranges are clamped so a node's children always fit in its band. */
+        const std::vector<patch> &select(glm::vec3 camera, const glm::mat4 &view_projection, const terrain_settings &settings) {
+            auto start = frame_clock::now();
+            m_patches.clear();
+            m_stats.culled_nodes = 0;
+
+            float range = std::max(settings.lod_distance, get_leaf_size() * 2.0f);
+            m_ranges.resize(static_cast<std::size_t>(m_level_count));
+            m_morph.resize(m_ranges.size());
+            for (std::size_t level = 0; level < m_ranges.size(); ++level, range *= 2.0f) {
+                float previous = level == 0 ? 0.0f : m_ranges[level - 1];
+                m_ranges[level] = range;
+                m_morph[level] = { previous + (range - previous) * settings.morph_start, range };
+            }
+
+            frustum view_frustum(view_projection);
+            if (!select_node(camera, view_frustum, 0, 0, m_level_count - 1)) {
+                // camera beyond the coarsest range, the root still has to be drawn
+                if (view_frustum.intersects_aabb(node_min(0, 0, m_level_count - 1), node_max(0, 0, m_level_count - 1))) {
+                    m_patches.push_back({ node_origin(0, 0, m_level_count - 1), m_size, m_level_count - 1, -1 });
+                }
+            }
+
+            m_stats.patches = m_patches.size();
+            m_stats.triangles = 0;
+            for (auto &&p : m_patches) m_stats.triangles += static_cast<std::size_t>(p.quadrant < 0 ? m_index_count : m_index_count / 4) / 3;
+            m_stats.select_ms = std::chrono::duration<float, std::milli>(frame_clock::now() - start).count();
+            return m_patches;
+        }
+
+        void draw(const glm::mat4 &view_projection, glm::vec3 camera, glm::vec3 light_color, const terrain_settings &settings) const {
+            if (m_patches.empty()) return;
+            glUseProgram(m_program.get_program());
+            glUniformMatrix4fv(m_view_projection_loc, 1, GL_FALSE, glm::value_ptr(view_projection));
+            glUniform3fv(m_camera_loc, 1, glm::value_ptr(camera));
+            glUniform4f(m_terrain_loc, m_origin, m_origin, m_size, m_height_scale);
+            glUniform1f(m_base_height_loc, m_base_height);
+            glUniform3fv(m_light_color_loc, 1, glm::value_ptr(light_color));
+            glActiveTexture(GL_TEXTURE0);
+            glBindTexture(GL_TEXTURE_2D, m_heightmap);
+            glBindVertexArray(m_vao);
+            if (settings.wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+
+            int current_level = -1;
+            for (auto &&p : m_patches) {
+                if (p.level != current_level) {
+                    current_level = p.level;
+                    glUniform2fv(m_morph_loc, 1, glm::value_ptr(m_morph[static_cast<std::size_t>(p.level)]));
+                }
+                glUniform4f(m_node_loc, p.origin.x, p.origin.y, p.size, static_cast<float>(patch_resolution));
+                GLsizei count = p.quadrant < 0 ? m_index_count : m_index_count / 4;
+                std::size_t first = p.quadrant < 0 ? 0 : static_cast<std::size_t>(p.quadrant) * count;
+                glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, reinterpret_cast<const void *>(first * sizeof(GLuint)));
+            }
+
+            if (settings.wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+            glBindVertexArray(0);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+
+        float get_size() const noexcept { return m_size; }
+        float get_leaf_size() const noexcept { return m_size / static_cast<float>(1 << (m_level_count - 1)); }
+        int get_level_count() const noexcept { return m_level_count; }
+        const terrain_stats &get_stats() const noexcept { return m_stats; }
+
+        /* Heightmap texels plus the min/max tree, host and GPU each hold one copy of the heightmap. */
+        std::size_t get_memory_bytes() const noexcept {
+            std::size_t bounds = 0;
+            for (auto &&level : m_bounds) bounds += level.size() * sizeof(glm::vec2);
+            return m_heights.size() * sizeof(std::uint16_t) * 2 + bounds;
+        }
+
+    private:
+        /* Returns false when the node is outside its own range, so the parent has to cover its area. */
+        bool select_node(glm::vec3 camera, const frustum &view_frustum, int x, int z, int level) {
+            auto min = node_min(x, z, level), max = node_max(x, z, level);
+            if (!sphere_overlaps(camera, m_ranges[static_cast<std::size_t>(level)], min, max)) return false;
+            if (!view_frustum.intersects_aabb(min, max)) {
+                ++m_stats.culled_nodes;
+                return true;
+            }
+
+            float size = m_size / static_cast<float>(1 << (m_level_count - 1 - level));
+            if (level == 0 || !sphere_overlaps(camera, m_ranges[static_cast<std::size_t>(level - 1)], min, max)) {
+                m_patches.push_back({ node_origin(x, z, level), size, level, -1 });
+                return true;
+            }
+
+            for (int quadrant = 0; quadrant < 4; ++quadrant) {
+                int cx = x * 2 + (quadrant & 1), cz = z * 2 + (quadrant >> 1);
+                if (select_node(camera, view_frustum, cx, cz, level - 1)) continue;
+                if (view_frustum.intersects_aabb(node_min(cx, cz, level - 1), node_max(cx, cz, level - 1))) {
+                    m_patches.push_back({ node_origin(x, z, level), size, level, quadrant });
+                }
+            }
+            return true;
+        }
+
+        static bool sphere_overlaps(glm::vec3 center, float radius, glm::vec3 min, glm::vec3 max) noexcept {
+            auto closest = glm::clamp(center, min, max);
+            auto d = center - closest;
+            return glm::dot(d, d) <= radius * radius;
+        }
+
+        glm::vec2 node_origin(int x, int z, int level) const noexcept {
+            float size = m_size / static_cast<float>(1 << (m_level_count - 1 - level));
+            return { m_origin + x * size, m_origin + z * size };
+        }
+
+        glm::vec3 node_min(int x, int z, int level) const noexcept {
+            auto origin = node_origin(x, z, level);
+            auto &&bounds = m_bounds[static_cast<std::size_t>(level)][static_cast<std::size_t>(z) * nodes_per_side(level) + x];
+            return { origin.x, m_base_height + bounds.x * m_height_scale, origin.y };
+        }
+
+        glm::vec3 node_max(int x, int z, int level) const noexcept {
+            auto origin = node_origin(x, z, level);
+            float size = m_size / static_cast<float>(1 << (m_level_count - 1 - level));
+            auto &&bounds = m_bounds[static_cast<std::size_t>(level)][static_cast<std::size_t>(z) * nodes_per_side(level) + x];
+            return { origin.x + size, m_base_height + bounds.y * m_height_scale, origin.y + size };
+        }
+
+        int nodes_per_side(int level) const noexcept { return 1 << (m_level_count - 1 - level); }
+
+        /* Normalized min/max height per node, leaves from the heightmap and every level above from its children. */
+        void build_bounds() {
+            m_bounds.resize(static_cast<std::size_t>(m_level_count));
+            int leaves = nodes_per_side(0);
+            int texels = m_resolution / leaves;
+            auto &&leaf_bounds = m_bounds[0];
+            leaf_bounds.resize(static_cast<std::size_t>(leaves) * leaves);
+            for (int z = 0; z < leaves; ++z) {
+                for (int x = 0; x < leaves; ++x) {
+                    // one texel of margin for the bilinear filter across node edges
+                    std::uint16_t lo = 0xFFFF, hi = 0;
+                    for (int tz = std::max(z * texels - 1, 0); tz <= std::min((z + 1) * texels, m_resolution - 1); ++tz) {
+                        for (int tx = std::max(x * texels - 1, 0); tx <= std::min((x + 1) * texels, m_resolution - 1); ++tx) {
+                            auto h = m_heights[static_cast<std::size_t>(tz) * m_resolution + tx];
+                            lo = std::min(lo, h);
+                            hi = std::max(hi, h);
+                        }
+                    }
+                    leaf_bounds[static_cast<std::size_t>(z) * leaves + x] = { lo / 65535.0f, hi / 65535.0f };
+                }
+            }
+            for (int level = 1; level < m_level_count; ++level) {
+                int count = nodes_per_side(level);
+                auto &&below = m_bounds[static_cast<std::size_t>(level - 1)];
+                auto &&bounds = m_bounds[static_cast<std::size_t>(level)];
+                bounds.resize(static_cast<std::size_t>(count) * count);
+                for (int z = 0; z < count; ++z) {
+                    for (int x = 0; x < count; ++x) {
+                        glm::vec2 b{ 1.0f, 0.0f };
+                        for (int quadrant = 0; quadrant < 4; ++quadrant) {
+                            auto &&child = below[static_cast<std::size_t>(z * 2 + (quadrant >> 1)) * (count * 2) + x * 2 + (quadrant & 1)];
+                            b = { std::min(b.x, child.x), std::max(b.y, child.y) };
+                        }
+                        bounds[static_cast<std::size_t>(z) * count + x] = b;
+                    }
+                }
+            }
+        }
+
+        /* Fractal value noise, normalized to the full 16-bit range. */
+        static std::vector<std::uint16_t> generate_heightmap(int resolution, std::uint32_t seed) {
+            auto hash = [seed](int x, int y) {
+                auto h = static_cast<std::uint32_t>(x) * 374761393u + static_cast<std::uint32_t>(y) * 668265263u + seed * 2246822519u;
+                h = (h ^ (h >> 13)) * 1274126177u;
+                return static_cast<float>((h ^ (h >> 16)) & 0xFFFFu) / 65535.0f;
+            };
+            auto noise = [&](float x, float y) {
+                int xi = static_cast<int>(std::floor(x)), yi = static_cast<int>(std::floor(y));
+                float fx = x - xi, fy = y - yi;
+                fx = fx * fx * (3.0f - 2.0f * fx);
+                fy = fy * fy * (3.0f - 2.0f * fy);
+                float top = hash(xi, yi) + (hash(xi + 1, yi) - hash(xi, yi)) * fx;
+                float bottom = hash(xi, yi + 1) + (hash(xi + 1, yi + 1) - hash(xi, yi + 1)) * fx;
+                return top + (bottom - top) * fy;
+            };
+
+            std::vector<float> heights(static_cast<std::size_t>(resolution) * resolution);
+            default_thread_pool().parallel_for(static_cast<std::size_t>(resolution), 16, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t y = begin; y < end; ++y) {
+                    for (int x = 0; x < resolution; ++x) {
+                        float frequency = 6.0f / static_cast<float>(resolution), amplitude = 0.5f, h = 0.0f;
+                        for (int octave = 0; octave < 8; ++octave, frequency *= 2.0f, amplitude *= 0.5f) {
+                            h += amplitude * noise(x * frequency, y * frequency);
+                        }
+                        heights[y * resolution + x] = h * h;    // flatter valleys, steeper peaks
+                    }
+                }
+            });
+
+            auto [lo, hi] = std::minmax_element(heights.begin(), heights.end());
+            float offset = *lo, scale = 65535.0f / std::max(*hi - *lo, 1e-6f);
+            std::vector<std::uint16_t> result(heights.size());
+            for (std::size_t i = 0; i < heights.size(); ++i) {
+                result[i] = static_cast<std::uint16_t>((heights[i] - offset) * scale + 0.5f);
+            }
+            return result;
+        }
+
+        inline static const std::string glsl_vertex = std::string(
+            "#version 330 core\n"
+            "layout (location = 0) in vec3 aPos;"
+            "") + late_latch::glsl_block +
+            ""
+            "uniform mat4 view_projection;"
+            "uniform vec3 camera;"
+            "uniform vec4 node;"        // xz corner, size, grid resolution
+            "uniform vec2 morph;"       // start and end distance of the node level's morph
+            "uniform vec4 terrain;"     // xz corner, size, height scale
+            "uniform float base_height;"
+            "uniform sampler2D heightmap;"
+            ""
+            "out vec3 normal;"
+            "out float height;"
+            ""
+            "float sample_height(vec2 xz) {"
+            "    return textureLod(heightmap, (xz - terrain.xy) / terrain.z, 0.0).r;"
+            "}"
+            ""
+            "void main() {"
+            "    vec2 grid = aPos.xz;"
+            "    vec2 xz = node.xy + grid / node.w * node.z;"
+            "    float d = distance(camera, vec3(xz.x, base_height + sample_height(xz) * terrain.w, xz.y));"
+            "    float k = clamp((d - morph.x) / (morph.y - morph.x), 0.0, 1.0);"
+            "    grid -= fract(grid * 0.5) * 2.0 * k;"
+            "    xz = node.xy + grid / node.w * node.z;"
+            ""
+            "    float texel = terrain.z / float(textureSize(heightmap, 0).x);"
+            "    float dx = sample_height(xz + vec2(texel, 0.0)) - sample_height(xz - vec2(texel, 0.0));"
+            "    float dz = sample_height(xz + vec2(0.0, texel)) - sample_height(xz - vec2(0.0, texel));"
+            "    normal = normalize(vec3(-dx * terrain.w, 2.0 * texel, -dz * terrain.w));"
+            "    height = sample_height(xz);"
+            "    gl_Position = latch_correction * (view_projection * vec4(xz.x, base_height + height * terrain.w, xz.y, 1.0));"
+            "}";
+
+        static constexpr const char *glsl_fragment =
+            "#version 330 core\n"
+            "in vec3 normal;"
+            "in float height;"
+            "out vec4 FragColor;"
+            ""
+            "uniform vec3 light_color;"
+            ""
+            "const vec3 sun = normalize(vec3(0.4, 0.8, 0.3));"
+            ""
+            "void main() {"
+            "    vec3 n = normalize(normal);"
+            "    float slope = 1.0 - n.y;"
+            "    vec3 albedo = mix(vec3(0.25, 0.4, 0.18), vec3(0.45, 0.4, 0.35), smoothstep(0.2, 0.5, slope));"
+            "    albedo = mix(albedo, vec3(0.9), smoothstep(0.75, 0.9, height) * (1.0 - slope));"
+            "    FragColor = vec4(albedo * (light_color + max(dot(n, sun), 0.0)), 1.0);"
+            "}";
+
+        float m_size;
+        float m_height_scale;
+        float m_base_height;
+        float m_origin;
+        int m_resolution;
+        int m_level_count;
+        std::vector<std::uint16_t> m_heights;
+        std::vector<std::vector<glm::vec2>> m_bounds;   // per level, row-major nodes
+
+        shader m_program;
+        GLint m_view_projection_loc;
+        GLint m_camera_loc;
+        GLint m_node_loc;
+        GLint m_morph_loc;
+        GLint m_terrain_loc;
+        GLint m_base_height_loc;
+        GLint m_light_color_loc;
+        GLuint m_heightmap = 0;
+        GLuint m_vao = 0;
+        GLuint m_vbo = 0;
+        GLuint m_ebo = 0;
+        GLsizei m_index_count = 0;
+
+        std::vector<float> m_ranges;
+        std::vector<glm::vec2> m_morph;
+        std::vector<patch> m_patches;
+        terrain_stats m_stats;
+    };
+
+    /* Emits particles from the entity's location, read and advanced by particle_system::emit(). */
+    struct particle_emitter {
+        float rate = 1000.0f;           // particles per second
+        float lifetime = 2.0f;          // seconds, every particle lives between half and all of it
+        float speed = 6.0f;
+        float spread = 0.4f;            // 0 shoots straight up, 1 covers the upper hemisphere
+        glm::vec3 color{ 1.0f, 0.55f, 0.2f };
+        float pending = 0.0f;           // fractional particles carried over to the next frame
+        std::uint32_t seed = 1;
+    };
+
+    struct particle_stats {
+        std::size_t alive = 0;
+        std::size_t emitters = 0;
+        std::size_t spawned = 0;
+        std::size_t died = 0;
+        std::size_t dropped = 0;        // emitted while the system was at capacity
+        float emit_ms = 0.0f;
+        float simulate_ms = 0.0f;
+        float upload_ms = 0.0f;
+    };
+
+    /*
+     * Particles in structure-of-arrays form, one array per attribute, so the update kernel moves
+     * four particles per SSE instruction and every task streams through its own contiguous block.
+     * The kernel collects the particles that ran out of life per block; they are then swap-
+     * compacted with the last live particle, which keeps the live range packed at the front at a
+     * cost proportional to the deaths rather than the population. The packed range is written
+     * into an orphaned vertex buffer on the thread pool and drawn as point sprites in one call.
+     * Particles are not entities, a million of them would swamp the world's bookkeeping; only
+     * their emitters are.
+     */
+    class particle_system {
+    public:
+        static constexpr std::size_t block_size = 16384;    // particles per task, a multiple of four
+        static constexpr float gravity = -9.81f;
+        static constexpr float drag = 0.35f;                // fraction of the velocity lost per second
+
+        explicit particle_system(std::size_t capacity) : m_capacity(capacity), m_program(shader::create_shader(glsl_vertex.c_str(), glsl_fragment)) {
+            memory::gen_vertex_arrays(1, &m_vao);
+            memory::gen_buffers(1, &m_vbo);
+            glBindVertexArray(m_vao);
+            glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+            vertex::particle::layout::apply();
+            glBindVertexArray(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+            m_view_projection_loc = glGetUniformLocation(m_program.get_program(), "view_projection");
+            m_point_scale_loc = glGetUniformLocation(m_program.get_program(), "point_scale");
+            late_latch::attach(m_program.get_program());
+        }
+
+        ~particle_system() {
+            memory::delete_vertex_arrays(1, &m_vao);
+            memory::delete_buffers(1, &m_vbo);
+            glDeleteProgram(m_program.get_program());
+        }
+
+        particle_system(const particle_system &) = delete;
+        particle_system &operator=(const particle_system &) = delete;
+
+        /* Spawns what every emitter owes for `delta_time`; emitters are visited in storage order, so the result is deterministic. */
+        void emit(ecs::world &world, float delta_time) {
+            auto start = frame_clock::now();
+            m_stats.emitters = 0;
+            m_stats.spawned = 0;
+            m_stats.dropped = 0;
+            world.query<const location, particle_emitter>().each([&](ecs::entity, const location &l, particle_emitter &emitter) {
+                ++m_stats.emitters;
+                emitter.pending += emitter.rate * delta_time;
+                auto count = static_cast<std::size_t>(emitter.pending);
+                emitter.pending -= static_cast<float>(count);
+
+                std::size_t room = m_capacity - m_count;
+                m_stats.dropped += count - std::min(count, room);
+                count = std::min(count, room);
+                reserve(m_count + count);
+
+                // xorshift32 per emitter, the state lives in the component so replays spawn the same particles
+                auto random = [&emitter] {
+                    emitter.seed ^= emitter.seed << 13;
+                    emitter.seed ^= emitter.seed >> 17;
+                    emitter.seed ^= emitter.seed << 5;
+                    return static_cast<float>(emitter.seed >> 8) / 16777216.0f;
+                };
+                auto color = pack_color(emitter.color);
+                for (std::size_t i = m_count; i < m_count + count; ++i) {
+                    float angle = random() * 6.2831853f;
+                    float cone = std::sqrt(random()) * emitter.spread;
+                    float speed = emitter.speed * (0.75f + 0.5f * random());
+                    float life = emitter.lifetime * (0.5f + 0.5f * random());
+                    m_px[i] = l.pos.x; m_py[i] = l.pos.y; m_pz[i] = l.pos.z;
+                    m_vx[i] = std::cos(angle) * cone * speed;
+                    m_vy[i] = std::sqrt(std::max(1.0f - cone * cone, 0.0f)) * speed;
+                    m_vz[i] = std::sin(angle) * cone * speed;
+                    m_life[i] = life;
+                    m_inverse_lifetime[i] = 1.0f / life;
+                    m_color[i] = color;
+                }
+                m_count += count;
+                m_stats.spawned += count;
+            });
+            m_stats.alive = m_count;
+            m_stats.emit_ms = std::chrono::duration<float, std::milli>(frame_clock::now() - start).count();
+        }
+
+        /* Integrates every particle on the pool, then swap-compacts the ones that died. */
+        void simulate(float delta_time, thread_pool &pool) {
+            auto start = frame_clock::now();
+            std::size_t blocks = (m_count + block_size - 1) / block_size;
+            if (m_dead.size() < blocks) m_dead.resize(blocks);
+            pool.parallel_for(blocks, 1, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t b = begin; b < end; ++b) {
+                    simulate_block(b * block_size, std::min((b + 1) * block_size, m_count), delta_time, m_dead[b]);
+                }
+            });
+
+            // descending, so every particle at or past the current index is alive by the time it gets moved
+            m_stats.died = 0;
+            for (std::size_t b = blocks; b-- > 0; ) {
+                auto &&dead = m_dead[b];
+                m_stats.died += dead.size();
+                for (auto it = dead.rbegin(); it != dead.rend(); ++it) {
+                    std::size_t last = --m_count;
+                    if (*it == last) continue;
+                    m_px[*it] = m_px[last]; m_py[*it] = m_py[last]; m_pz[*it] = m_pz[last];
+                    m_vx[*it] = m_vx[last]; m_vy[*it] = m_vy[last]; m_vz[*it] = m_vz[last];
+                    m_life[*it] = m_life[last];
+                    m_inverse_lifetime[*it] = m_inverse_lifetime[last];
+                    m_color[*it] = m_color[last];
+                }
+            }
+            m_stats.alive = m_count;
+            m_stats.simulate_ms = std::chrono::duration<float, std::milli>(frame_clock::now() - start).count();
+        }
+
+        /* Writes the live particles into a freshly orphaned vertex buffer, one block per task. */
+        void upload(thread_pool &pool) {
+            auto start = frame_clock::now();
+            m_uploaded = 0;
+            if (m_count != 0) {
+                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+                if (m_buffer_capacity < m_count) {
+                    m_buffer_capacity = std::min(std::bit_ceil(m_count), m_capacity);
+                    memory::buffer_data(memory::tag::PARTICLES, GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(m_buffer_capacity * sizeof(vertex::particle)), nullptr, GL_STREAM_DRAW);
+                }
+                auto bytes = static_cast<GLsizeiptr>(m_count * sizeof(vertex::particle));
+                auto *vertices = static_cast<vertex::particle *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+                if (vertices != nullptr) {
+                    pool.parallel_for((m_count + block_size - 1) / block_size, 1, [&](std::size_t begin, std::size_t end) {
+                        write_vertices(vertices, begin * block_size, std::min(end * block_size, m_count));
+                    });
+                    // the store can be lost on a display mode change, skip a frame rather than draw garbage
+                    if (glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE) m_uploaded = m_count;
+                }
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+            m_stats.upload_ms = std::chrono::duration<float, std::milli>(frame_clock::now() - start).count();
+        }
+
+        /* Additive point sprites after the opaque geometry; `point_scale` is the sprite size in pixels at a distance of one. */
+        void draw(const glm::mat4 &view_projection, float point_scale) const {
+            if (m_uploaded == 0) return;
+            glUseProgram(m_program.get_program());
+            glUniformMatrix4fv(m_view_projection_loc, 1, GL_FALSE, glm::value_ptr(view_projection));
+            glUniform1f(m_point_scale_loc, point_scale);
+            glEnable(GL_PROGRAM_POINT_SIZE);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+            glDepthMask(GL_FALSE);
+            glBindVertexArray(m_vao);
+            glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(m_uploaded));
+            glBindVertexArray(0);
+            glDepthMask(GL_TRUE);
+            glDisable(GL_BLEND);
+            glDisable(GL_PROGRAM_POINT_SIZE);
+        }
+
+        void clear() noexcept { m_count = 0; m_stats.alive = 0; }
+
+        std::size_t size() const noexcept { return m_count; }
+        std::size_t get_capacity() const noexcept { return m_capacity; }
+        const particle_stats &get_stats() const noexcept { return m_stats; }
+
+        /* Host arrays plus the vertex buffer. */
+        std::size_t get_memory_bytes() const noexcept {
+            return m_px.size() * (8 * sizeof(float) + sizeof(std::uint32_t)) + m_buffer_capacity * sizeof(vertex::particle);
+        }
+
+    private:
+        /* Grows every array to hold `count` particles plus padding, so the kernel can always read whole groups of four. */
+        void reserve(std::size_t count) {
+            std::size_t padded = (count + 3) & ~std::size_t{ 3 };
+            if (padded <= m_px.size()) return;
+            memory::scope tag(memory::tag::PARTICLES);
+            std::size_t size = std::max<std::size_t>(std::bit_ceil(padded), 1024);
+            for (auto *array : { &m_px, &m_py, &m_pz, &m_vx, &m_vy, &m_vz, &m_life, &m_inverse_lifetime }) array->resize(size);
+            m_color.resize(size);
+        }
+
+        /* Interleaves [begin, end) into vertices; the alpha channel fades out with the remaining life. */
+        void write_vertices(vertex::particle *vertices, std::size_t begin, std::size_t end) const {
+            std::size_t i = begin;
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+            // four particles at a time: the arrays are transposed into four 16-byte vertices, the color rides along as float bits
+            static_assert(sizeof(vertex::particle) == 4 * sizeof(float));
+            __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), scale = _mm_set1_ps(255.0f);
+            __m128i rgb = _mm_set1_epi32(0x00FFFFFF);
+            for (; i + 4 <= end; i += 4) {
+                __m128 fade = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(&m_life[i]), _mm_loadu_ps(&m_inverse_lifetime[i])), zero), one);
+                __m128i alpha = _mm_slli_epi32(_mm_cvttps_epi32(_mm_mul_ps(fade, scale)), 24);
+                __m128i color = _mm_or_si128(_mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&m_color[i])), rgb), alpha);
+                __m128 x = _mm_loadu_ps(&m_px[i]), y = _mm_loadu_ps(&m_py[i]), z = _mm_loadu_ps(&m_pz[i]), c = _mm_castsi128_ps(color);
+                _MM_TRANSPOSE4_PS(x, y, z, c);
+                auto *out = reinterpret_cast<float *>(vertices + i);
+                _mm_storeu_ps(out, x);
+                _mm_storeu_ps(out + 4, y);
+                _mm_storeu_ps(out + 8, z);
+                _mm_storeu_ps(out + 12, c);
+            }
+#endif
+            for (; i < end; ++i) {
+                auto fade = static_cast<std::uint32_t>(std::clamp(m_life[i] * m_inverse_lifetime[i], 0.0f, 1.0f) * 255.0f);
+                std::uint32_t color = (m_color[i] & 0x00FFFFFFu) | (fade << 24);
+                auto &&v = vertices[i];
+                v.pos = { { m_px[i], m_py[i], m_pz[i] } };
+                std::memcpy(v.color.value, &color, sizeof color);
+            }
+        }
+
+        void simulate_block(std::size_t begin, std::size_t end, float dt, std::vector<std::uint32_t> &dead) {
+            dead.clear();
+            float damping = std::max(1.0f - drag * dt, 0.0f);
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+            // the last group may reach into the padding; lanes past `end` are updated but never reported
+            __m128 step = _mm_set1_ps(dt), fall = _mm_set1_ps(gravity * dt), keep = _mm_set1_ps(damping), zero = _mm_setzero_ps();
+            for (std::size_t i = begin; i < end; i += 4) {
+                __m128 vx = _mm_mul_ps(_mm_loadu_ps(&m_vx[i]), keep);
+                __m128 vy = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&m_vy[i]), keep), fall);
+                __m128 vz = _mm_mul_ps(_mm_loadu_ps(&m_vz[i]), keep);
+                _mm_storeu_ps(&m_vx[i], vx);
+                _mm_storeu_ps(&m_vy[i], vy);
+                _mm_storeu_ps(&m_vz[i], vz);
+                _mm_storeu_ps(&m_px[i], _mm_add_ps(_mm_loadu_ps(&m_px[i]), _mm_mul_ps(vx, step)));
+                _mm_storeu_ps(&m_py[i], _mm_add_ps(_mm_loadu_ps(&m_py[i]), _mm_mul_ps(vy, step)));
+                _mm_storeu_ps(&m_pz[i], _mm_add_ps(_mm_loadu_ps(&m_pz[i]), _mm_mul_ps(vz, step)));
+                __m128 life = _mm_sub_ps(_mm_loadu_ps(&m_life[i]), step);
+                _mm_storeu_ps(&m_life[i], life);
+                for (int mask = _mm_movemask_ps(_mm_cmple_ps(life, zero)); mask != 0; mask &= mask - 1) {
+                    std::size_t index = i + static_cast<std::size_t>(std::countr_zero(static_cast<unsigned>(mask)));
+                    if (index < end) dead.push_back(static_cast<std::uint32_t>(index));
+                }
+            }
+#else
+            for (std::size_t i = begin; i < end; ++i) {
+                m_vx[i] *= damping;
+                m_vy[i] = m_vy[i] * damping + gravity * dt;
+                m_vz[i] *= damping;
+                m_px[i] += m_vx[i] * dt;
+                m_py[i] += m_vy[i] * dt;
+                m_pz[i] += m_vz[i] * dt;
+                m_life[i] -= dt;
+                if (m_life[i] <= 0.0f) dead.push_back(static_cast<std::uint32_t>(i));
+            }
+#endif
+        }
+
+        static std::uint32_t pack_color(glm::vec3 color) {
+            auto channel = [](float c) { return static_cast<std::uint32_t>(std::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f); };
+            return channel(color.x) | channel(color.y) << 8 | channel(color.z) << 16 | 0xFF000000u;
+        }
+
+        inline static const std::string glsl_vertex = std::string(
+            "#version 330 core\n"
+            "layout (location = 0) in vec3 aPos;"
+            "layout (location = 1) in vec4 aColor;"
+            "") + late_latch::glsl_block +
+            ""
+            "uniform mat4 view_projection;"
+            "uniform float point_scale;"
+            "out vec4 color;"
+            ""
+            "void main() {"
+            "    gl_Position = latch_correction * (view_projection * vec4(aPos, 1.0));"
+            "    gl_PointSize = clamp(point_scale / gl_Position.w, 1.0, 64.0);"
+            "    color = aColor;"
+            "}";
+
+        static constexpr const char *glsl_fragment =
+            "#version 330 core\n"
+            "in vec4 color;"
+            "out vec4 FragColor;"
+            ""
+            "void main() {"
+            "    vec2 d = gl_PointCoord * 2.0 - 1.0;"
+            "    float r2 = dot(d, d);"
+            "    if (r2 > 1.0) discard;"
+            "    FragColor = vec4(color.rgb, color.a * (1.0 - r2));"
+            "}";
+
+        std::size_t m_capacity;
+        std::size_t m_count = 0;
+        std::vector<float> m_px, m_py, m_pz;
+        std::vector<float> m_vx, m_vy, m_vz;
+        std::vector<float> m_life;
+        std::vector<float> m_inverse_lifetime;
+        std::vector<std::uint32_t> m_color;     // RGBA8, alpha replaced by the fade on upload
+        std::vector<std::vector<std::uint32_t>> m_dead;     // per block, ascending
+
+        shader m_program;
+        GLint m_view_projection_loc;
+        GLint m_point_scale_loc;
+        GLuint m_vao = 0;
+        GLuint m_vbo = 0;
+        std::size_t m_buffer_capacity = 0;
+        std::size_t m_uploaded = 0;
+        particle_stats m_stats;
+    };
+}
+
+namespace mk::debug {
+    /*
+     * Immediate-mode debug lines. line(), aabb(), sphere(), axes() and grid() may be called from any
+     * thread at any time; each thread appends to its own vertex lists behind its own, practically
+     * uncontended, mutex. Once per frame lines::upload() moves every thread's vertices into one
+     * orphaned vertex buffer and draw() submits them in at most two calls, depth-tested and
+     * overlay. Nothing is retained: a shape has to be drawn again every frame it should stay
+     * visible. With a pipelined frame, lines recorded by simulate tasks of the next frame can
+     * show up one frame early.
+     */
+
+    /* RGBA8, red in the lowest byte. */
+    using color = std::uint32_t;
+
+    constexpr color rgba(float r, float g, float b, float a = 1.0f) noexcept {
+        auto channel = [](float c) { return static_cast<std::uint32_t>(std::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f); };
+        return channel(r) | channel(g) << 8 | channel(b) << 16 | channel(a) << 24;
+    }
+
+    constexpr color red = rgba(1.0f, 0.0f, 0.0f);
+    constexpr color green = rgba(0.0f, 1.0f, 0.0f);
+    constexpr color blue = rgba(0.0f, 0.0f, 1.0f);
+    constexpr color white = rgba(1.0f, 1.0f, 1.0f);
+
+    enum class layer : std::uint8_t { WORLD, OVERLAY, COUNT };
+    constexpr std::size_t layer_count = static_cast<std::size_t>(layer::COUNT);
+
+    namespace detail {
+        struct thread_lines {
+            std::mutex mutex;
+            std::array<std::vector<vertex::colored>, layer_count> vertices;
+        };
+
+        struct registry_state {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<thread_lines>> threads;
+        };
+
+        registry_state &registry() {
+            static registry_state state;
+            return state;
+        }
+
+        thread_lines &local() {
+            thread_local thread_lines *lines = [] {
+                auto &&r = registry();
+                std::lock_guard lock(r.mutex);
+                memory::scope charge(memory::tag::DEBUG_DRAW);
+                return r.threads.emplace_back(std::make_unique<thread_lines>()).get();
+            }();
+            return *lines;
+        }
+
+        /* Locks this thread's list once for a whole shape. */
+        class writer {
+        public:
+            explicit writer(layer l) : m_lines(local()), m_lock(m_lines.mutex), m_vertices(m_lines.vertices[static_cast<std::size_t>(l)]), m_tag(memory::tag::DEBUG_DRAW) { }
+
+            void line(glm::vec3 a, glm::vec3 b, color c) {
+                m_vertices.push_back(make(a, c));
+                m_vertices.push_back(make(b, c));
+            }
+
+        private:
+            static vertex::colored make(glm::vec3 p, color c) {
+                vertex::colored v;
+                v.pos = { { p.x, p.y, p.z } };
+                std::memcpy(v.color.value, &c, sizeof c);
+                return v;
+            }
+
+            thread_lines &m_lines;
+            std::lock_guard<std::mutex> m_lock;
+            std::vector<vertex::colored> &m_vertices;
+            memory::scope m_tag;
+        };
+    }
+
+    void line(glm::vec3 a, glm::vec3 b, color c, layer l = layer::WORLD) {
+        detail::writer(l).line(a, b, c);
+    }
+
+    void aabb(glm::vec3 min, glm::vec3 max, color c, layer l = layer::WORLD) {
+        detail::writer w(l);
+        for (int i = 0; i < 4; ++i) {
+            // the four edges along each axis, at every combination of the other two axes' extremes
+            bool u = i & 1, v = i & 2;
+            w.line({ min.x, u ? max.y : min.y, v ? max.z : min.z }, { max.x, u ? max.y : min.y, v ? max.z : min.z }, c);
+            w.line({ u ? max.x : min.x, min.y, v ? max.z : min.z }, { u ? max.x : min.x, max.y, v ? max.z : min.z }, c);
+            w.line({ u ? max.x : min.x, v ? max.y : min.y, min.z }, { u ? max.x : min.x, v ? max.y : min.y, max.z }, c);
+        }
+    }
+
+    /* Three great circles, one per axis plane. */
+    void sphere(glm::vec3 center, float radius, color c, layer l = layer::WORLD, int segments = 16) {
+        detail::writer w(l);
+        float step = 6.2831853f / static_cast<float>(segments);
+        for (int s = 0; s < segments; ++s) {
+            float c0 = std::cos(s * step) * radius, s0 = std::sin(s * step) * radius;
+            float c1 = std::cos((s + 1) * step) * radius, s1 = std::sin((s + 1) * step) * radius;
+            w.line(center + glm::vec3{ c0, s0, 0.0f }, center + glm::vec3{ c1, s1, 0.0f }, c);
+            w.line(center + glm::vec3{ c0, 0.0f, s0 }, center + glm::vec3{ c1, 0.0f, s1 }, c);
+            w.line(center + glm::vec3{ 0.0f, c0, s0 }, center + glm::vec3{ 0.0f, c1, s1 }, c);
+        }
+    }
+
+    /* The basis of `transform` at its origin: x red, y green, z blue. */
+    void axes(const glm::mat4 &transform, float size, layer l = layer::WORLD) {
+        detail::writer w(l);
+        auto origin = glm::vec3(transform[3]);
+        w.line(origin, origin + glm::vec3(transform[0]) * size, red);
+        w.line(origin, origin + glm::vec3(transform[1]) * size, green);
+        w.line(origin, origin + glm::vec3(transform[2]) * size, blue);
+    }
+
+    /* Square grid on the xz plane through `center`, `cells` cells of `spacing` to each side. */
+    void grid(glm::vec3 center, int cells, float spacing, color c, layer l = layer::WORLD) {
+        detail::writer w(l);
+        float extent = static_cast<float>(cells) * spacing;
+        for (int i = -cells; i <= cells; ++i) {
+            float offset = static_cast<float>(i) * spacing;
+            w.line(center + glm::vec3{ offset, 0.0f, -extent }, center + glm::vec3{ offset, 0.0f, extent }, c);
+            w.line(center + glm::vec3{ -extent, 0.0f, offset }, center + glm::vec3{ extent, 0.0f, offset }, c);
+        }
+    }
+
+    struct stats {
+        std::size_t threads = 0;
+        std::array<std::size_t, layer_count> vertices{};
+        float upload_ms = 0.0f;
+    };
+
+    /* Owns the streaming buffer and the program; one per context. */
+    class lines {
+    public:
+        lines() : m_program(shader::create_shader(glsl_vertex.c_str(), glsl_fragment)) {
+            memory::gen_vertex_arrays(1, &m_vao);
+            memory::gen_buffers(1, &m_vbo);
+            glBindVertexArray(m_vao);
+            glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+            vertex::colored::layout::apply();
+            glBindVertexArray(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            m_view_projection_loc = glGetUniformLocation(m_program.get_program(), "view_projection");
+            late_latch::attach(m_program.get_program());
+        }
+
+        ~lines() {
+            memory::delete_vertex_arrays(1, &m_vao);
+            memory::delete_buffers(1, &m_vbo);
+            glDeleteProgram(m_program.get_program());
+        }
+
+        lines(const lines &) = delete;
+        lines &operator=(const lines &) = delete;
+
+        /* Moves everything recorded since the last call into the vertex buffer, layer by layer, and empties the thread lists. */
+        void upload() {
+            auto start = frame_clock::now();
+            auto &&r = detail::registry();
+            std::lock_guard lock(r.mutex);
+            std::vector<std::unique_lock<std::mutex>> held;
+            held.reserve(r.threads.size());
+            m_stats.threads = r.threads.size();
+            m_stats.vertices = {};
+            for (auto &&thread : r.threads) {
+                held.emplace_back(thread->mutex);
+                for (std::size_t l = 0; l < layer_count; ++l) m_stats.vertices[l] += thread->vertices[l].size();
+            }
+
+            std::size_t total = 0;
+            for (auto count : m_stats.vertices) total += count;
+            m_uploaded = {};
+            if (total != 0) {
+                glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+                if (m_capacity < total) {
+                    m_capacity = std::bit_ceil(total);
+                    memory::buffer_data(memory::tag::DEBUG_DRAW, GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(m_capacity * sizeof(vertex::colored)), nullptr, GL_STREAM_DRAW);
+                }
+                auto bytes = static_cast<GLsizeiptr>(total * sizeof(vertex::colored));
+                if (auto *out = static_cast<vertex::colored *>(glMapBufferRange(GL_ARRAY_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT))) {
+                    for (std::size_t l = 0; l < layer_count; ++l) {
+                        for (auto &&thread : r.threads) {
+                            auto &&vertices = thread->vertices[l];
+                            if (!vertices.empty()) std::memcpy(out, vertices.data(), vertices.size() * sizeof(vertex::colored));
+                            out += vertices.size();
+                        }
+                    }
+                    if (glUnmapBuffer(GL_ARRAY_BUFFER) == GL_TRUE) m_uploaded = m_stats.vertices;
+                }
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+            for (auto &&thread : r.threads) {
+                for (auto &&vertices : thread->vertices) vertices.clear();
+            }
+            m_stats.upload_ms = std::chrono::duration<float, std::milli>(frame_clock::now() - start).count();
+        }
+
+        void draw(const glm::mat4 &view_projection) const {
+            if (m_uploaded[0] + m_uploaded[1] == 0) return;
+            glUseProgram(m_program.get_program());
+            glUniformMatrix4fv(m_view_projection_loc, 1, GL_FALSE, glm::value_ptr(view_projection));
+            glBindVertexArray(m_vao);
+            if (m_uploaded[0] != 0) glDrawArrays(GL_LINES, 0, static_cast<GLsizei>(m_uploaded[0]));
+            if (m_uploaded[1] != 0) {
+                glDisable(GL_DEPTH_TEST);
+                glDrawArrays(GL_LINES, static_cast<GLint>(m_uploaded[0]), static_cast<GLsizei>(m_uploaded[1]));
+                glEnable(GL_DEPTH_TEST);
+            }
+            glBindVertexArray(0);
+        }
+
+        const stats &get_stats() const noexcept { return m_stats; }
+
+    private:
+        inline static const std::string glsl_vertex = std::string(
+            "#version 330 core\n"
+            "layout (location = 0) in vec3 aPos;"
+            "layout (location = 1) in vec4 aColor;"
+            "") + late_latch::glsl_block +
+            ""
+            "uniform mat4 view_projection;"
+            "out vec4 color;"
+            ""
+            "void main() {"
+            "    gl_Position = latch_correction * (view_projection * vec4(aPos, 1.0));"
+            "    color = aColor;"
+            "}";
+
+        static constexpr const char *glsl_fragment =
+            "#version 330 core\n"
+            "in vec4 color;"
+            "out vec4 FragColor;"
+            ""
+            "void main() {"
+            "    FragColor = color;"
+            "}";
+
+        shader m_program;
+        GLint m_view_projection_loc;
+        GLuint m_vao = 0;
+        GLuint m_vbo = 0;
+        std::size_t m_capacity = 0;
+        std::array<std::size_t, layer_count> m_uploaded{};
+        stats m_stats;
+    };
+}
+
+namespace mk {
+    /*
+     * Declarative render passes. Each frame_graph::add_pass() declares the textures a pass reads
+     * and writes through a builder; compile() then turns the declarations into a plan once per
+     * configuration:
+     *   - passes whose writes nobody reads are dropped, transitively (the backbuffer always counts
+     *     as read, side_effect() pins a pass),
+     *   - transient textures get a lifetime over the surviving passes and share a physical texture
+     *     with any earlier transient of the same format and size that is dead by then,
+     *   - every pass gets a cached FBO for its attachment set, and only the clears it asked for.
+     * execute() walks the plan and binds an FBO only when it differs from the previous pass's.
+     * Passes run in declaration order, so a pass can only read what an earlier pass wrote.
+     */
+    class frame_graph {
+    public:
+        using resource = std::uint32_t;
+
+        struct texture_desc {
+            GLenum format = GL_RGBA8;
+            float scale = 1.0f;                 // relative to the size passed to compile()
+            glm::vec4 clear_color{ 0.0f };      // depth formats clear to 1
+        };
+
+        struct pass_info {
+            std::string_view name;
+            bool culled;
+        };
+
+        struct stats {
+            std::size_t passes = 0;
+            std::size_t culled = 0;
+            std::size_t transients = 0;
+            std::size_t textures = 0;           // physical textures after aliasing
+            std::size_t requested_bytes = 0;    // without aliasing
+            std::size_t allocated_bytes = 0;
+            std::size_t framebuffers = 0;
+            std::size_t binds = 0;              // last execute()
+            std::size_t clears = 0;             // last execute()
+        };
+
+        class builder {
+        public:
+            resource create(std::string name, const texture_desc &desc) {
+                m_graph.m_resources.push_back({ std::move(name), desc, false });
+                return static_cast<resource>(m_graph.m_resources.size() - 1);
+            }
+
+            void read(resource r) { m_graph.m_passes[m_pass].reads.push_back(r); }
+
+            /* Attaches `r` as a render target; color and depth attachments are told apart by format. */
+            void write(resource r, bool clear = false) { m_graph.m_passes[m_pass].writes.push_back({ r, clear }); }
+
+            /* Keeps the pass even when nothing reads its outputs. */
+            void side_effect() { m_graph.m_passes[m_pass].side_effect = true; }
+
+        private:
+            friend class frame_graph;
+            builder(frame_graph &graph, std::size_t pass) : m_graph(graph), m_pass(pass) { }
+
+            frame_graph &m_graph;
+            std::size_t m_pass;
+        };
+
+        /* Handed to pass callbacks; resolves the physical texture behind a resource. */
+        class context {
+        public:
+            GLuint texture(resource r) const { return m_graph.m_textures[m_graph.m_resources[r].physical].id; }
+            glm::ivec2 size(resource r) const { return m_graph.size_of(r); }
+
+        private:
+            friend class frame_graph;
+            explicit context(const frame_graph &graph) : m_graph(graph) { }
+
+            const frame_graph &m_graph;
+        };
+
+        using setup_fn = std::function<void(builder &)>;
+        using execute_fn = std::function<void(const context &)>;
+
+        frame_graph() = default;
+        ~frame_graph() { release(); }
+
+        frame_graph(const frame_graph &) = delete;
+        frame_graph &operator=(const frame_graph &) = delete;
+
+        /* Drops all passes and resources, GL objects are released on the next compile(). */
+        void reset() {
+            m_passes.clear();
+            m_resources.clear();
+            m_plan.clear();
+        }
+
+        resource import_backbuffer(std::string name, glm::vec4 clear_color) {
+            m_resources.push_back({ std::move(name), { GL_RGBA8, 1.0f, clear_color }, true });
+            return static_cast<resource>(m_resources.size() - 1);
+        }
+
+        void add_pass(std::string name, const setup_fn &setup, execute_fn execute) {
+            pass_node pass;
+            pass.name = std::move(name);
+            pass.execute = std::move(execute);
+            m_passes.push_back(std::move(pass));
+            builder b(*this, m_passes.size() - 1);
+            setup(b);
+        }
+
+        void compile(int width, int height) {
+            release();
+            m_width = width;
+            m_height = height;
+            m_stats = {};
+            m_stats.passes = m_passes.size();
+
+            cull();
+            assign_lifetimes();
+            allocate_textures();
+            build_plan();
+        }
+
+        void execute() {
+            m_stats.binds = 0;
+            m_stats.clears = 0;
+            context ctx(*this);
+            GLuint bound = std::numeric_limits<GLuint>::max();
+            for (auto &&step : m_plan) {
+                if (step.fbo != bound) {
+                    glBindFramebuffer(GL_FRAMEBUFFER, step.fbo);
+                    glViewport(0, 0, step.size.x, step.size.y);
+                    bound = step.fbo;
+                    ++m_stats.binds;
+                }
+                for (auto &&clear : step.clears) {
+                    if (clear.depth) {
+                        float one = 1.0f;
+                        glClearBufferfv(GL_DEPTH, 0, &one);
+                    }
+                    else {
+                        glClearBufferfv(GL_COLOR, clear.draw_buffer, glm::value_ptr(clear.color));
+                    }
+                    ++m_stats.clears;
+                }
+                m_passes[step.pass].execute(ctx);
+            }
+            if (bound != 0) {
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                glViewport(0, 0, m_width, m_height);
+            }
+        }
+
+        std::pmr::vector<pass_info> get_passes(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) const {
+            std::pmr::vector<pass_info> passes(resource);
+            passes.reserve(m_passes.size());
+            for (auto &&p : m_passes) passes.push_back({ p.name, p.culled });
+            return passes;
+        }
+
+        const stats &get_stats() const noexcept { return m_stats; }
+
+    private:
+        static constexpr std::size_t none = std::numeric_limits<std::size_t>::max();
+
+        struct resource_node {
+            std::string name;
+            texture_desc desc;
+            bool imported;
+            std::size_t readers = 0;
+            std::size_t first = none;       // plan index of the first and last surviving use
+            std::size_t last = 0;
+            std::size_t physical = none;
+        };
+
+        struct write_info {
+            resource target;
+            bool clear;
+        };
+
+        struct pass_node {
+            std::string name;
+            std::vector<resource> reads;
+            std::vector<write_info> writes;
+            bool side_effect = false;
+            bool culled = false;
+            std::size_t refcount = 0;
+            execute_fn execute;
+        };
+
+        struct physical_texture {
+            GLenum format;
+            glm::ivec2 size;
+            GLuint id;
+            std::size_t free_after;         // plan index of the last use so far
+        };
+
+        struct clear_op {
+            bool depth;
+            GLint draw_buffer;
+            glm::vec4 color;
+        };
+
+        struct step {
+            std::size_t pass;
+            GLuint fbo;
+            glm::ivec2 size;
+            std::vector<clear_op> clears;
+        };
+
+        static bool is_depth(GLenum format) noexcept {
+            return format == GL_DEPTH_COMPONENT16 || format == GL_DEPTH_COMPONENT24 || format == GL_DEPTH_COMPONENT32F
+                || format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+        }
+
+        static std::size_t bytes_per_pixel(GLenum format) noexcept {
+            switch (format) {
+            case GL_R8: return 1;
+            case GL_RGBA16F: case GL_DEPTH32F_STENCIL8: return 8;
+            case GL_RGBA32F: return 16;
+            default: return 4;
+            }
+        }
+
+        glm::ivec2 size_of(resource r) const noexcept {
+            float scale = m_resources[r].desc.scale;
+            return { std::max(static_cast<int>(m_width * scale), 1), std::max(static_cast<int>(m_height * scale), 1) };
+        }
+
+        /* Reference counting from the outputs backwards. */
+        void cull() {
+            std::vector<std::vector<std::size_t>> producers(m_resources.size());
+            for (std::size_t p = 0; p < m_passes.size(); ++p) {
+                auto &&pass = m_passes[p];
+                pass.refcount = pass.writes.size();
+                pass.culled = false;
+                for (auto r : pass.reads) {
+                    if (!m_resources[r].imported && producers[r].empty()) {
+                        throw std::runtime_error("Frame graph pass " + pass.name + " reads " + m_resources[r].name + " before any pass writes it.");
+                    }
+                    ++m_resources[r].readers;
+                }
+                for (auto &&w : pass.writes) producers[w.target].push_back(p);
+            }
+
+            std::vector<resource> unreferenced;
+            for (std::size_t r = 0; r < m_resources.size(); ++r) {
+                if (m_resources[r].imported) ++m_resources[r].readers;
+                if (m_resources[r].readers == 0) unreferenced.push_back(static_cast<resource>(r));
+            }
+            while (!unreferenced.empty()) {
+                auto r = unreferenced.back();
+                unreferenced.pop_back();
+                for (auto p : producers[r]) {
+                    auto &&pass = m_passes[p];
+                    if (pass.side_effect || --pass.refcount > 0) continue;
+                    pass.culled = true;
+                    ++m_stats.culled;
+                    for (auto read : pass.reads) {
+                        if (--m_resources[read].readers == 0) unreferenced.push_back(read);
+                    }
+                }
+            }
+        }
+
+        void assign_lifetimes() {
+            std::size_t index = 0;
+            for (auto &&pass : m_passes) {
+                if (pass.culled) continue;
+                auto use = [&](resource r) {
+                    auto &&node = m_resources[r];
+                    node.first = std::min(node.first, index);
+                    node.last = std::max(node.last, index);
+                };
+                for (auto r : pass.reads) use(r);
+                for (auto &&w : pass.writes) use(w.target);
+                ++index;
+            }
+        }
+
+        /* Greedy aliasing in order of first use. */
+        void allocate_textures() {
+            std::vector<resource> order;
+            for (std::size_t r = 0; r < m_resources.size(); ++r) {
+                if (!m_resources[r].imported && m_resources[r].first != none) order.push_back(static_cast<resource>(r));
+            }
+            std::sort(order.begin(), order.end(), [&](resource a, resource b) { return m_resources[a].first < m_resources[b].first; });
+
+            for (auto r : order) {
+                auto &&node = m_resources[r];
+                auto size = size_of(r);
+                std::size_t bytes = static_cast<std::size_t>(size.x) * size.y * bytes_per_pixel(node.desc.format);
+                m_stats.requested_bytes += bytes;
+                ++m_stats.transients;
+
+                auto reusable = std::find_if(m_textures.begin(), m_textures.end(), [&](const physical_texture &t) {
+                    return t.format == node.desc.format && t.size == size && t.free_after < node.first;
+                });
+                if (reusable == m_textures.end()) {
+                    m_textures.push_back({ node.desc.format, size, create_texture(node.desc.format, size), 0 });
+                    reusable = m_textures.end() - 1;
+                    m_stats.allocated_bytes += bytes;
+                }
+                reusable->free_after = node.last;
+                node.physical = static_cast<std::size_t>(reusable - m_textures.begin());
+            }
+            m_stats.textures = m_textures.size();
+        }
+
+        static GLuint create_texture(GLenum format, glm::ivec2 size) {
+            GLuint id;
+            memory::gen_textures(1, &id);
+            glBindTexture(GL_TEXTURE_2D, id);
+            if (is_depth(format)) {
+                bool stencil = format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8;
+                glTexImage2D(GL_TEXTURE_2D, 0, format, size.x, size.y, 0, stencil ? GL_DEPTH_STENCIL : GL_DEPTH_COMPONENT,
+                    stencil ? GL_UNSIGNED_INT_24_8 : GL_FLOAT, nullptr);
+            }
+            else {
+                glTexImage2D(GL_TEXTURE_2D, 0, format, size.x, size.y, 0, GL_RGBA, GL_FLOAT, nullptr);
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            return id;
+        }
+
+        void build_plan() {
+            for (std::size_t p = 0; p < m_passes.size(); ++p) {
+                auto &&pass = m_passes[p];
+                if (pass.culled) continue;
+
+                step s{ p, 0, { m_width, m_height }, {} };
+                bool backbuffer = std::any_of(pass.writes.begin(), pass.writes.end(), [&](const write_info &w) { return m_resources[w.target].imported; });
+                if (backbuffer) {
+                    if (pass.writes.size() != 1) {
+                        throw std::runtime_error("Frame graph pass " + pass.name + " mixes the backbuffer with other targets.");
+                    }
+                    if (pass.writes[0].clear) {
+                        s.clears.push_back({ false, 0, m_resources[pass.writes[0].target].desc.clear_color });
+                        s.clears.push_back({ true, 0, {} });
+                    }
+                }
+                else if (!pass.writes.empty()) {
+                    std::vector<GLuint> attachments;
+                    GLint draw_buffer = 0;
+                    for (auto &&w : pass.writes) {
+                        auto &&node = m_resources[w.target];
+                        attachments.push_back(m_textures[node.physical].id);
+                        bool depth = is_depth(node.desc.format);
+                        if (w.clear) s.clears.push_back({ depth, depth ? 0 : draw_buffer, node.desc.clear_color });
+                        if (!depth) ++draw_buffer;
+                    }
+                    s.fbo = framebuffer_for(pass, attachments);
+                    s.size = size_of(pass.writes[0].target);
+                }
+                m_plan.push_back(std::move(s));
+            }
+            m_stats.framebuffers = m_framebuffers.size();
+        }
+
+        /* One FBO per distinct attachment set; identical sets across passes share it. */
+        GLuint framebuffer_for(const pass_node &pass, const std::vector<GLuint> &attachments) {
+            auto found = m_framebuffers.find(attachments);
+            if (found != m_framebuffers.end()) return found->second;
+
+            GLuint fbo;
+            memory::gen_framebuffers(1, &fbo);
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            std::vector<GLenum> draw_buffers;
+            for (std::size_t i = 0; i < pass.writes.size(); ++i) {
+                auto format = m_resources[pass.writes[i].target].desc.format;
+                GLenum attachment;
+                if (is_depth(format)) {
+                    attachment = format == GL_DEPTH24_STENCIL8 || format == GL_DEPTH32F_STENCIL8 ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+                }
+                else {
+                    attachment = GL_COLOR_ATTACHMENT0 + static_cast<GLenum>(draw_buffers.size());
+                    draw_buffers.push_back(attachment);
+                }
+                glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, attachments[i], 0);
+            }
+            if (draw_buffers.empty()) glDrawBuffer(GL_NONE);
+            else glDrawBuffers(static_cast<GLsizei>(draw_buffers.size()), draw_buffers.data());
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+                glBindFramebuffer(GL_FRAMEBUFFER, 0);
+                memory::delete_framebuffers(1, &fbo);
+                throw std::runtime_error("Frame graph framebuffer for pass " + pass.name + " is incomplete.");
+            }
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            m_framebuffers.emplace(attachments, fbo);
+            return fbo;
+        }
+
+        void release() {
+            for (auto &&[_, fbo] : m_framebuffers) memory::delete_framebuffers(1, &fbo);
+            m_framebuffers.clear();
+            for (auto &&t : m_textures) memory::delete_textures(1, &t.id);
+            m_textures.clear();
+            m_plan.clear();
+            for (auto &&r : m_resources) {
+                r.readers = 0;
+                r.first = none;
+                r.last = 0;
+                r.physical = none;
+            }
+        }
+
+        std::vector<pass_node> m_passes;
+        std::vector<resource_node> m_resources;
+        std::vector<physical_texture> m_textures;
+        std::map<std::vector<GLuint>, GLuint> m_framebuffers;
+        std::vector<step> m_plan;
+        int m_width = 0;
+        int m_height = 0;
+        stats m_stats;
+    };
+}
+
+namespace mk::net {
+#ifdef _WIN32
+    using native_socket = SOCKET;
+    constexpr native_socket invalid_socket = INVALID_SOCKET;
+#else
+    using native_socket = int;
+    constexpr native_socket invalid_socket = -1;
+#endif
+
+    /* IPv4 address and port in host byte order. */
+    struct endpoint {
+        std::uint32_t address = 0;
+        std::uint16_t port = 0;
+
+        bool operator==(const endpoint &) const = default;
+    };
+
+    constexpr std::uint32_t loopback = 0x7f000001;
+
+    /* Non-blocking UDP socket; everything replication sends fits one datagram per message. */
+    class udp_socket {
+    public:
+        udp_socket() = default;
+
+        /* Binds to `port` on the loopback interface, 0 picks any free port. */
+        explicit udp_socket(std::uint16_t port) {
+#ifdef _WIN32
+            static const bool started = [] {
+                WSADATA data;
+                return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+            }();
+            if (!started) throw std::runtime_error("Failed to start Winsock.");
+#endif
+            m_socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+            if (m_socket == invalid_socket) throw std::runtime_error("Failed to create a UDP socket.");
+
+            sockaddr_in address = to_native({ loopback, port });
+            if (::bind(m_socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+                close();
+                throw std::runtime_error("Failed to bind UDP port " + std::to_string(port) + ".");
+            }
+#ifdef _WIN32
+            u_long non_blocking = 1;
+            ioctlsocket(m_socket, FIONBIO, &non_blocking);
+#else
+            fcntl(m_socket, F_SETFL, fcntl(m_socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+        }
+
+        ~udp_socket() { close(); }
+
+        udp_socket(udp_socket &&other) noexcept : m_socket(std::exchange(other.m_socket, invalid_socket)) { }
+
+        udp_socket &operator=(udp_socket &&other) noexcept {
+            if (this != &other) {
+                close();
+                m_socket = std::exchange(other.m_socket, invalid_socket);
+            }
+            return *this;
+        }
+
+        explicit operator bool() const noexcept { return m_socket != invalid_socket; }
+
+        bool send(const endpoint &to, std::span<const std::uint8_t> data) {
+            sockaddr_in address = to_native(to);
+            return ::sendto(m_socket, reinterpret_cast<const char *>(data.data()), static_cast<int>(data.size()), 0,
+                reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == static_cast<int>(data.size());
+        }
+
+        /* Size of the next pending datagram copied into `buffer`, 0 when nothing is waiting. */
+        std::size_t receive(std::span<std::uint8_t> buffer, endpoint &from) {
+            sockaddr_in address{};
+#ifdef _WIN32
+            int length = sizeof(address);
+#else
+            socklen_t length = sizeof(address);
+#endif
+            auto received = ::recvfrom(m_socket, reinterpret_cast<char *>(buffer.data()), static_cast<int>(buffer.size()), 0,
+                reinterpret_cast<sockaddr *>(&address), &length);
+            if (received <= 0) return 0;
+            from = { ntohl(address.sin_addr.s_addr), ntohs(address.sin_port) };
+            return static_cast<std::size_t>(received);
+        }
+
+    private:
+        static sockaddr_in to_native(const endpoint &e) noexcept {
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(e.address);
+            address.sin_port = htons(e.port);
+            return address;
+        }
+
+        void close() noexcept {
+            if (m_socket == invalid_socket) return;
+#ifdef _WIN32
+            closesocket(m_socket);
+#else
+            ::close(m_socket);
+#endif
+            m_socket = invalid_socket;
+        }
+
+        native_socket m_socket = invalid_socket;
+    };
+
+    /* Appends values of up to 32 bits, least significant bit first. */
+    class bit_writer {
+    public:
+        explicit bit_writer(std::vector<std::uint8_t> &out) : m_out(out) { }
+
+        void write(std::uint32_t value, int bits) {
+            m_scratch |= static_cast<std::uint64_t>(value & mask(bits)) << m_scratch_bits;
+            m_scratch_bits += bits;
+            m_bits += static_cast<std::size_t>(bits);
+            while (m_scratch_bits >= 8) {
+                m_out.push_back(static_cast<std::uint8_t>(m_scratch));
+                m_scratch >>= 8;
+                m_scratch_bits -= 8;
+            }
+        }
+
+        /* Pads the last byte with zeros. */
+        void flush() {
+            if (m_scratch_bits > 0) m_out.push_back(static_cast<std::uint8_t>(m_scratch));
+            m_scratch = 0;
+            m_scratch_bits = 0;
+        }
+
+        std::size_t bit_count() const noexcept { return m_bits; }
+
+        static constexpr std::uint32_t mask(int bits) noexcept {
+            return bits >= 32 ? 0xffffffffu : (1u << bits) - 1;
+        }
+
+    private:
+        std::vector<std::uint8_t> &m_out;
+        std::uint64_t m_scratch = 0;
+        int m_scratch_bits = 0;
+        std::size_t m_bits = 0;
+    };
+
+    /* Reads what bit_writer wrote; past the end it returns zeros and sets overflowed(). */
+    class bit_reader {
+    public:
+        explicit bit_reader(std::span<const std::uint8_t> data) : m_data(data) { }
+
+        std::uint32_t read(int bits) {
+            while (m_scratch_bits < bits) {
+                if (m_next == m_data.size()) {
+                    m_overflowed = true;
+                    return 0;
+                }
+                m_scratch |= static_cast<std::uint64_t>(m_data[m_next++]) << m_scratch_bits;
+                m_scratch_bits += 8;
+            }
+            auto value = static_cast<std::uint32_t>(m_scratch) & bit_writer::mask(bits);
+            m_scratch >>= bits;
+            m_scratch_bits -= bits;
+            return value;
+        }
+
+        bool overflowed() const noexcept { return m_overflowed; }
+
+    private:
+        std::span<const std::uint8_t> m_data;
+        std::size_t m_next = 0;
+        std::uint64_t m_scratch = 0;
+        int m_scratch_bits = 0;
+        bool m_overflowed = false;
+    };
+
+    /* Positions as fixed point over [-extent, extent], colors as 8 bits per channel. */
+    struct quantization {
+        float extent = 1024.0f;
+        int position_bits = 20;
+
+        std::uint32_t quantize(float v) const noexcept {
+            float t = std::clamp((v + extent) / (2.0f * extent), 0.0f, 1.0f);
+            return static_cast<std::uint32_t>(std::lround(t * static_cast<float>(bit_writer::mask(position_bits))));
+        }
+
+        float dequantize(std::uint32_t q) const noexcept {
+            return static_cast<float>(q) / static_cast<float>(bit_writer::mask(position_bits)) * 2.0f * extent - extent;
+        }
+
+        static std::uint32_t quantize_unit(float v) noexcept {
+            return static_cast<std::uint32_t>(std::lround(std::clamp(v, 0.0f, 1.0f) * 255.0f));
+        }
+
+        static float dequantize_unit(std::uint32_t q) noexcept { return static_cast<float>(q) / 255.0f; }
+    };
+
+    /*
+     * Wire format, all integers little endian:
+     *   header:   magic u16, kind u8, flags u8, fragment u16, fragment_count u16, position_bits u8, index_bits u8
+     *   SNAPSHOT: session u32, tick u32, baseline u32, extent f32, then a bit stream of removals and
+     *             updates, each announced by a 1 bit and ended by a 0 bit
+     *   HELLO:    nothing, subscribes the sender
+     *   ACK:      session u32, tick u32, every fragment of that snapshot arrived
+     * Snapshots carry everything that changed after `baseline`, the client's last acknowledged
+     * tick, so a lost datagram is covered by the next snapshot without any resend logic. A
+     * snapshot flagged TRUNCATED did not fit max_fragments and must not be acknowledged. The
+     * session is picked at random by each host; a new one (a restarted host) tells the client to
+     * drop its replicas and start over from baseline 0.
+     */
+    namespace wire {
+        constexpr std::uint16_t magic = 0x4b4d;
+        enum kind : std::uint8_t { HELLO = 1, SNAPSHOT = 2, ACK = 3 };
+        enum flags : std::uint8_t { TRUNCATED = 1 };
+        constexpr std::size_t header_size = 10;
+        constexpr std::size_t snapshot_header_size = header_size + 16;
+        constexpr std::size_t fragment_budget = 1200;  // bytes, stays below common MTUs
+        constexpr std::size_t max_fragments = 0xffff;
+        constexpr std::size_t max_datagram = 2048;
+        constexpr int generation_bits = 16;
+
+        inline void put_u16(std::vector<std::uint8_t> &out, std::size_t at, std::uint16_t v) {
+            out[at] = static_cast<std::uint8_t>(v);
+            out[at + 1] = static_cast<std::uint8_t>(v >> 8);
+        }
+
+        inline std::uint16_t get_u16(std::span<const std::uint8_t> in, std::size_t at) {
+            return static_cast<std::uint16_t>(in[at] | in[at + 1] << 8);
+        }
+
+        inline void put_u32(std::vector<std::uint8_t> &out, std::size_t at, std::uint32_t v) {
+            for (int i = 0; i < 4; ++i) out[at + i] = static_cast<std::uint8_t>(v >> (8 * i));
+        }
+
+        inline std::uint32_t get_u32(std::span<const std::uint8_t> in, std::size_t at) {
+            std::uint32_t v = 0;
+            for (int i = 0; i < 4; ++i) v |= static_cast<std::uint32_t>(in[at + i]) << (8 * i);
+            return v;
+        }
+
+        inline void header(std::vector<std::uint8_t> &out, kind k) {
+            out.assign(k == SNAPSHOT ? snapshot_header_size : header_size, 0);
+            out[0] = static_cast<std::uint8_t>(magic);
+            out[1] = static_cast<std::uint8_t>(magic >> 8);
+            out[2] = k;
+        }
+
+        inline bool valid(std::span<const std::uint8_t> in) {
+            return in.size() >= header_size && in[0] == static_cast<std::uint8_t>(magic) && in[1] == static_cast<std::uint8_t>(magic >> 8);
+        }
+    }
+
+    struct host_stats {
+        std::size_t clients = 0;
+        std::size_t datagrams = 0;      // last update()
+        std::size_t bytes = 0;          // last update()
+        std::size_t records = 0;        // last update(), entity updates and removals over all clients
+        std::size_t pending_removals = 0;
+        float encode_ms = 0.0f;
+        std::uint64_t connects = 0;     // since the host started
+        std::uint64_t timeouts = 0;
+        std::uint64_t truncated = 0;    // snapshots cut at wire::max_fragments
+    };
+
+    /*
+     * Serves a world to any number of viewers on a loopback UDP port. Every update() sends each
+     * client one snapshot holding the locations and materials written after that client's last
+     * acknowledged tick, found through the chunk versions, plus entities removed since then.
+     * Clients acknowledging the same tick share the encoded datagrams. Work and bandwidth follow
+     * the number of changed chunks, not the size of the world.
+     */
+    class replication_host {
+    public:
+        static constexpr float client_timeout = 5.0f;   // seconds without hearing from a client
+
+        explicit replication_host(std::uint16_t port, quantization q = {}) 
+            : m_socket(port), m_quantization(q), m_session(std::random_device{}()) { }
+
+        /* Call once per frame, before world::end_frame(). */
+        void update(ecs::world &world) {
+            auto start = std::chrono::steady_clock::now();
+            m_stats.datagrams = 0;
+            m_stats.bytes = 0;
+            m_stats.records = 0;
+            receive(start);
+
+            // removals published by the last end_frame() are stamped with the tick they become visible at
+            auto tick = world.checkpoint();
+            for (auto e : world.removed<location>()) {
+                if (!world.has<location>(e)) m_removals.push_back({ tick, e });
+            }
+            ecs::tick oldest = tick;
+            for (auto &&c : m_clients) oldest = std::min(oldest, c.acked);
+            while (!m_removals.empty() && (m_clients.empty() || m_removals.front().tick <= oldest)) m_removals.pop_front();
+
+            std::map<ecs::tick, std::vector<std::vector<std::uint8_t>>> encoded;
+            for (auto &&c : m_clients) {
+                auto &&datagrams = encoded[c.acked];
+                if (datagrams.empty()) {
+                    m_stats.records += encode(world, c.acked, tick, datagrams);
+                }
+                for (auto &&d : datagrams) {
+                    m_socket.send(c.address, d);
+                    ++m_stats.datagrams;
+                    m_stats.bytes += d.size();
+                }
+            }
+            m_stats.clients = m_clients.size();
+            m_stats.pending_removals = m_removals.size();
+            m_stats.encode_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        const host_stats &get_stats() const noexcept { return m_stats; }
+
+    private:
+        struct client {
+            endpoint address;
+            ecs::tick acked = 0;
+            std::chrono::steady_clock::time_point heard{};
+        };
+
+        struct removal {
+            ecs::tick tick;
+            ecs::entity e;
+        };
+
+        void receive(std::chrono::steady_clock::time_point now) {
+            std::array<std::uint8_t, wire::max_datagram> buffer;
+            endpoint from;
+            while (auto size = m_socket.receive(buffer, from)) {
+                std::span<const std::uint8_t> message(buffer.data(), size);
+                if (!wire::valid(message)) continue;
+                auto known = std::find_if(m_clients.begin(), m_clients.end(), [&](const client &c) { return c.address == from; });
+                if (known == m_clients.end()) {
+                    ++m_stats.connects;
+                    known = m_clients.insert(m_clients.end(), { from });
+                }
+                known->heard = now;
+                // an acknowledgement meant for an earlier session would skip everything this one sent
+                if (message[2] == wire::ACK && size >= wire::header_size + 8 && wire::get_u32(message, wire::header_size) == m_session) {
+                    known->acked = std::max<ecs::tick>(known->acked, wire::get_u32(message, wire::header_size + 4));
+                }
+            }
+            m_stats.timeouts += std::erase_if(m_clients, [&](const client &c) {
+                return std::chrono::duration<float>(now - c.heard).count() > client_timeout;
+            });
+        }
+
+        /* Splits everything changed after `baseline` into datagrams; returns the number of records. */
+        std::size_t encode(ecs::world &world, ecs::tick baseline, ecs::tick tick, std::vector<std::vector<std::uint8_t>> &datagrams) {
+            int index_bits = std::max(static_cast<int>(std::bit_width(world.index_count())), 1);
+            std::size_t records = 0;
+            std::vector<std::uint8_t> current;
+            std::optional<bit_writer> bits;
+
+            auto begin = [&] {
+                wire::header(current, wire::SNAPSHOT);
+                current[8] = static_cast<std::uint8_t>(m_quantization.position_bits);
+                current[9] = static_cast<std::uint8_t>(index_bits);
+                wire::put_u32(current, wire::header_size, m_session);
+                wire::put_u32(current, wire::header_size + 4, static_cast<std::uint32_t>(tick));
+                wire::put_u32(current, wire::header_size + 8, static_cast<std::uint32_t>(baseline));
+                wire::put_u32(current, wire::header_size + 12, std::bit_cast<std::uint32_t>(m_quantization.extent));
+                bits.emplace(current);
+            };
+            bool in_updates = false;
+            auto finish = [&] {
+                bits->write(0, 1);
+                if (!in_updates) bits->write(0, 1);
+                bits->flush();
+                datagrams.push_back(std::move(current));
+            };
+            // every record starts with a 1 bit; the largest one is an update with both components
+            std::size_t largest = static_cast<std::size_t>(2 + index_bits + wire::generation_bits + 2 + 3 * m_quantization.position_bits + 24);
+            auto record = [&](ecs::entity e) {
+                if (wire::snapshot_header_size * 8 + bits->bit_count() + largest + 2 > wire::fragment_budget * 8) {
+                    // removals and updates are two sections, a new fragment picks up in the current one
+                    finish();
+                    begin();
+                    if (in_updates) bits->write(0, 1);
+                }
+                bits->write(1, 1);
+                bits->write(e.index, index_bits);
+                bits->write(e.generation, wire::generation_bits);
+                ++records;
+            };
+
+            begin();
+            for (auto &&r : m_removals) {
+                if (r.tick > baseline) record(r.e);
+            }
+            bits->write(0, 1);
+            in_updates = true;
+
+            auto &&q = m_quantization;
+            world.query<const location>().changed_since(baseline).each([&](ecs::entity e, const location &l) {
+                record(e);
+                bits->write(1, 1);
+                for (int axis = 0; axis < 3; ++axis) bits->write(q.quantize(l.pos[axis]), q.position_bits);
+                bits->write(0, 1);
+            });
+            world.query<const material, const location>().changed_since(baseline).each([&](ecs::entity e, const material &m, const location &) {
+                record(e);
+                bits->write(0, 1);
+                bits->write(1, 1);
+                for (int channel = 0; channel < 3; ++channel) bits->write(quantization::quantize_unit(m.albedo[channel]), 8);
+            });
+            finish();
+
+            // the client applies what arrives but does not acknowledge it, so the next snapshot starts from the same baseline
+            std::uint8_t flags = 0;
+            if (datagrams.size() > wire::max_fragments) {
+                datagrams.resize(wire::max_fragments);
+                flags |= wire::TRUNCATED;
+                ++m_stats.truncated;
+            }
+            for (std::size_t i = 0; i < datagrams.size(); ++i) {
+                datagrams[i][3] = flags;
+                wire::put_u16(datagrams[i], 4, static_cast<std::uint16_t>(i));
+                wire::put_u16(datagrams[i], 6, static_cast<std::uint16_t>(datagrams.size()));
+            }
+            return records;
+        }
+
+        udp_socket m_socket;
+        quantization m_quantization;
+        std::vector<client> m_clients;
+        std::deque<removal> m_removals;
+        std::uint32_t m_session;
+        host_stats m_stats;
+    };
+
+    struct client_stats {
+        bool connected = false;
+        std::size_t replicas = 0;
+        std::size_t datagrams = 0;      // last update()
+        std::size_t bytes = 0;          // last update()
+        std::size_t records = 0;        // last update()
+        std::uint64_t acked = 0;
+        std::uint64_t dropped = 0;      // stale or malformed fragments
+        std::uint64_t sessions = 0;     // host sessions joined, more than one means the host restarted
+        std::uint64_t truncated = 0;    // fragments of snapshots too large to acknowledge
+    };
+
+    /*
+     * Viewer side: applies snapshots from a replication_host straight into a local world, one
+     * entity per remote entity, with mk::location and mk::material (slot 0) components.
+     */
+    class replication_client {
+    public:
+        static constexpr float hello_interval = 1.0f;
+
+        explicit replication_client(std::uint16_t host_port) : m_socket(std::uint16_t{ 0 }), m_host{ loopback, host_port } { }
+
+        void update(ecs::world &world) {
+            auto now = std::chrono::steady_clock::now();
+            m_stats.datagrams = 0;
+            m_stats.bytes = 0;
+            m_stats.records = 0;
+
+            std::array<std::uint8_t, wire::max_datagram> buffer;
+            endpoint from;
+            while (auto size = m_socket.receive(buffer, from)) {
+                if (!(from == m_host)) continue;
+                ++m_stats.datagrams;
+                m_stats.bytes += size;
+                if (apply(world, std::span<const std::uint8_t>(buffer.data(), size))) m_heard = now;
+            }
+
+            // until snapshots flow, keep announcing ourselves; a restarted host forgets its clients
+            m_stats.connected = std::chrono::duration<float>(now - m_heard).count() < hello_interval;
+            if (!m_stats.connected && std::chrono::duration<float>(now - m_hello).count() > hello_interval) {
+                std::vector<std::uint8_t> hello;
+                wire::header(hello, wire::HELLO);
+                m_socket.send(m_host, hello);
+                m_hello = now;
+            }
+            m_stats.replicas = world.size();
+        }
+
+        const client_stats &get_stats() const noexcept { return m_stats; }
+
+    private:
+        struct replica {
+            ecs::entity local;
+            std::uint32_t generation = 0;
+        };
+
+        // a remote index past this is corrupt or hostile; the table would otherwise grow to whatever the wire says
+        static constexpr std::uint32_t max_replicas = 1u << 20;
+
+        struct assembly {
+            std::uint32_t tick;
+            std::size_t missing;
+            std::vector<bool> received;
+        };
+
+        /* False when the fragment was dropped. */
+        bool apply(ecs::world &world, std::span<const std::uint8_t> message) {
+            if (!wire::valid(message) || message[2] != wire::SNAPSHOT || message.size() < wire::snapshot_header_size) {
+                ++m_stats.dropped;
+                return false;
+            }
+            std::uint8_t flags = message[3];
+            std::uint16_t fragment = wire::get_u16(message, 4), count = wire::get_u16(message, 6);
+            auto session = wire::get_u32(message, wire::header_size);
+            auto tick = wire::get_u32(message, wire::header_size + 4);
+            int position_bits = message[8], index_bits = message[9];
+            if (fragment >= count || position_bits < 1 || position_bits > 32 || index_bits < 1 || index_bits > 32) {
+                ++m_stats.dropped;
+                return false;
+            }
+            quantization q{ std::bit_cast<float>(wire::get_u32(message, wire::header_size + 12)), position_bits };
+            auto payload = message.subspan(wire::snapshot_header_size);
+            // check the whole fragment before touching the world so a corrupt one cannot half apply
+            if (!read_records(payload, index_bits, q, [](auto...) { }, [](auto...) { })) {
+                ++m_stats.dropped;
+                return false;
+            }
+            if (session != m_session) {
+                // a new host knows nothing of our replicas, nor of the removals we would need to clear them
+                reset(world);
+                m_session = session;
+                ++m_stats.sessions;
+            }
+            // applying an older snapshot after a newer one would move entities back in time
+            if (tick < m_newest) {
+                ++m_stats.dropped;
+                return false;
+            }
+            if (tick > m_newest) {
+                // fragments of older ticks are dropped from here on, so their assemblies can never complete
+                std::erase_if(m_assemblies, [&](const assembly &a) { return a.tick < tick; });
+                m_newest = tick;
+            }
+
+            read_records(payload, index_bits, q,
+                [&](std::uint32_t index, std::uint32_t generation) {
+                    if (index < m_replicas.size() && m_replicas[index].generation == generation && world.alive(m_replicas[index].local)) {
+                        world.destroy(m_replicas[index].local);
+                    }
+                    ++m_stats.records;
+                },
+                [&](std::uint32_t index, std::uint32_t generation, const std::optional<glm::vec3> &pos, const std::optional<glm::vec3> &albedo) {
+                    auto e = resolve(world, index, generation);
+                    if (pos) world.get<location>(e).pos = *pos;
+                    if (albedo) {
+                        if (world.has<material>(e)) world.get<material>(e).albedo = *albedo;
+                        else world.emplace<material>(e, *albedo, 0u);
+                    }
+                    ++m_stats.records;
+                });
+            if (flags & wire::TRUNCATED) {
+                ++m_stats.truncated;
+                return true;
+            }
+
+            auto pending = std::find_if(m_assemblies.begin(), m_assemblies.end(), [&](const assembly &a) { return a.tick == tick; });
+            if (pending == m_assemblies.end()) pending = m_assemblies.insert(m_assemblies.end(), { tick, count, std::vector<bool>(count) });
+            if (pending->received.size() != count || pending->received[fragment]) return true;
+            pending->received[fragment] = true;
+            if (--pending->missing == 0) {
+                std::vector<std::uint8_t> ack;
+                wire::header(ack, wire::ACK);
+                ack.resize(wire::header_size + 8);
+                wire::put_u32(ack, wire::header_size, session);
+                wire::put_u32(ack, wire::header_size + 4, tick);
+                m_socket.send(m_host, ack);
+                m_stats.acked = tick;
+                std::erase_if(m_assemblies, [&](const assembly &a) { return a.tick <= tick; });
+            }
+            return true;
+        }
+
+        /*
+         * Walks the removals and then the updates of a snapshot payload. False when the payload runs short
+         * or names an index past the replica table, which both the index width and max_replicas bound.
+         */
+        template<typename Removal, typename Update>
+        static bool read_records(std::span<const std::uint8_t> payload, int index_bits, const quantization &q, Removal &&on_removal, Update &&on_update) {
+            auto in_range = [&](std::uint32_t index) {
+                return (index_bits == 32 || index < (1u << index_bits)) && index < max_replicas;
+            };
+            bit_reader bits(payload);
+            while (bits.read(1) && !bits.overflowed()) {
+                auto index = bits.read(index_bits);
+                auto generation = bits.read(wire::generation_bits);
+                if (bits.overflowed() || !in_range(index)) return false;
+                on_removal(index, generation);
+            }
+            while (bits.read(1) && !bits.overflowed()) {
+                auto index = bits.read(index_bits);
+                auto generation = bits.read(wire::generation_bits);
+                std::optional<glm::vec3> pos, albedo;
+                if (bits.read(1)) {
+                    pos.emplace();
+                    for (int axis = 0; axis < 3; ++axis) (*pos)[axis] = q.dequantize(bits.read(q.position_bits));
+                }
+                if (bits.read(1)) {
+                    albedo.emplace();
+                    for (int channel = 0; channel < 3; ++channel) (*albedo)[channel] = quantization::dequantize_unit(bits.read(8));
+                }
+                if (bits.overflowed() || !in_range(index)) return false;
+                on_update(index, generation, pos, albedo);
+            }
+            return !bits.overflowed();
+        }
+
+        void reset(ecs::world &world) {
+            for (auto &&r : m_replicas) {
+                if (world.alive(r.local)) world.destroy(r.local);
+            }
+            m_replicas.clear();
+            m_assemblies.clear();
+            m_newest = 0;
+            m_stats.acked = 0;
+        }
+
+        /* The local entity for a remote one; a new generation at the same index replaces the old replica. */
+        ecs::entity resolve(ecs::world &world, std::uint32_t index, std::uint32_t generation) {
+            if (index >= m_replicas.size()) m_replicas.resize(static_cast<std::size_t>(index) + 1);
+            auto &&r = m_replicas[index];
+            if (world.alive(r.local) && r.generation == generation) return r.local;
+            if (world.alive(r.local)) world.destroy(r.local);
+            r.local = world.create();
+            r.generation = generation;
+            world.emplace<location>(r.local);
+            return r.local;
+        }
+
+        udp_socket m_socket;
+        endpoint m_host;
+        std::vector<replica> m_replicas;
+        std::vector<assembly> m_assemblies;
+        std::optional<std::uint32_t> m_session;
+        std::uint32_t m_newest = 0;
+        std::chrono::steady_clock::time_point m_heard{};
+        std::chrono::steady_clock::time_point m_hello{};
+        client_stats m_stats;
+    };
+}
+
+namespace mk::png {
+    std::uint32_t crc32(std::uint32_t crc, const std::uint8_t *data, std::size_t size) noexcept {
+        static const auto table = [] {
+            std::array<std::uint32_t, 256> t{};
+            for (std::uint32_t n = 0; n < 256; ++n) {
+                std::uint32_t c = n;
+                for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (std::size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    /*
+     * Encodes 8-bit RGBA rows, bottom row first as glReadPixels returns them, into `out`. The
+     * zlib stream uses stored deflate blocks only: a capture should cost a memcpy, not a compressor.
+     */
+    void encode(int width, int height, const std::uint8_t *bottom_up_rgba, std::vector<std::uint8_t> &out) {
+        auto put32 = [&](std::uint32_t v) {
+            for (int shift = 24; shift >= 0; shift -= 8) out.push_back(static_cast<std::uint8_t>(v >> shift));
+        };
+        auto chunk = [&](const char *type, auto &&write_data) {
+            std::size_t length_at = out.size();
+            put32(0);
+            out.insert(out.end(), type, type + 4);
+            write_data();
+            auto length = static_cast<std::uint32_t>(out.size() - length_at - 8);
+            for (int i = 0; i < 4; ++i) out[length_at + i] = static_cast<std::uint8_t>(length >> (24 - 8 * i));
+            put32(crc32(0, out.data() + length_at + 4, length + 4));
+        };
+
+        std::size_t row_bytes = static_cast<std::size_t>(width) * 4;
+        std::size_t raw_bytes = (row_bytes + 1) * height;
+        out.clear();
+        out.reserve(raw_bytes + raw_bytes / 65535 * 5 + 128);
+
+        const std::uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+        out.insert(out.end(), std::begin(signature), std::end(signature));
+        chunk("IHDR", [&] {
+            put32(static_cast<std::uint32_t>(width));
+            put32(static_cast<std::uint32_t>(height));
+            out.insert(out.end(), { 8, 6, 0, 0, 0 });   // 8 bits, RGBA, deflate, adaptive filtering, no interlace
+        });
+        chunk("IDAT", [&] {
+            out.insert(out.end(), { 0x78, 0x01 });
+            std::uint32_t a = 1, b = 0;
+            std::size_t block_left = 0;
+            auto emit = [&](std::uint8_t byte) {
+                if (block_left == 0) {
+                    block_left = std::min<std::size_t>(65535, raw_bytes);
+                    raw_bytes -= block_left;
+                    auto len = static_cast<std::uint16_t>(block_left);
+                    out.insert(out.end(), { static_cast<std::uint8_t>(raw_bytes == 0 ? 1 : 0),
+                        static_cast<std::uint8_t>(len), static_cast<std::uint8_t>(len >> 8),
+                        static_cast<std::uint8_t>(~len), static_cast<std::uint8_t>(~len >> 8) });
+                }
+                out.push_back(byte);
+                --block_left;
+                a = (a + byte) % 65521;
+                b = (b + a) % 65521;
+            };
+            for (int y = height - 1; y >= 0; --y) {
+                emit(0);    // filter: none
+                const std::uint8_t *row = bottom_up_rgba + row_bytes * y;
+                for (std::size_t x = 0; x < row_bytes; ++x) emit(row[x]);
+            }
+            put32((b << 16) | a);
+        });
+        chunk("IEND", [] {});
+    }
+}
+
+namespace mk {
+    enum class capture_format : int { PNG, RAW };
+
+    struct capture_stats {
+        std::uint64_t requested = 0;    // frames handed to read()
+        std::uint64_t written = 0;
+        std::uint64_t dropped = 0;      // ring or writer queue full
+        std::uint64_t failed = 0;       // files that could not be opened or written
+        std::size_t in_flight = 0;      // readbacks the GPU has not finished yet
+        std::size_t queued = 0;         // frames waiting for the writer
+        float write_ms = 0.0f;          // last file
+    };
+
+    /*
+     * Asynchronous framebuffer capture. read() starts a glReadPixels into the next pixel buffer
+     * object of a small ring and fences it; poll() maps the buffers whose fence has signalled and
+     * hands a copy to a writer thread that encodes PNG or raw RGBA files into `directory`. Nothing
+     * here waits on the GPU: a frame is dropped instead when the ring or the writer queue is full.
+     */
+    class frame_capture {
+    public:
+        static constexpr std::size_t ring = 3;
+        static constexpr std::size_t max_queued = 8;
+
+        explicit frame_capture(std::filesystem::path directory) : m_directory(std::move(directory)) {
+            for (auto &&s : m_slots) memory::gen_buffers(1, &s.pbo);
+            m_writer = std::thread([this] { writer_loop(); });
+        }
+
+        ~frame_capture() {
+            {
+                std::lock_guard lock(m_mutex);
+                m_stopping = true;
+            }
+            m_cv.notify_all();
+            m_writer.join();
+            for (auto &&s : m_slots) {
+                if (s.fence != nullptr) glDeleteSync(s.fence);
+                memory::delete_buffers(1, &s.pbo);
+            }
+        }
+
+        frame_capture(const frame_capture &) = delete;
+        frame_capture &operator=(const frame_capture &) = delete;
+
+        void set_format(capture_format format) noexcept { m_format.store(format, std::memory_order_relaxed); }
+        capture_format get_format() const noexcept { return m_format.load(std::memory_order_relaxed); }
+        const std::filesystem::path &get_directory() const noexcept { return m_directory; }
+
+        /* Reads the back buffer of the default framebuffer, which must be bound for reading. */
+        void read(glm::ivec2 size) {
+            auto &&s = m_slots[m_head];
+            ++m_requested;
+            if (s.fence != nullptr) {
+                // the GPU is a whole ring behind; skipping a frame beats stalling on it
+                ++m_dropped;
+                return;
+            }
+
+            std::size_t bytes = static_cast<std::size_t>(size.x) * size.y * 4;
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+            if (bytes != s.bytes) {
+                memory::buffer_data(memory::tag::CAPTURE, GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(bytes), nullptr, GL_STREAM_READ);
+                s.bytes = bytes;
+            }
+            glReadBuffer(GL_BACK);
+            glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            s.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            s.size = size;
+            s.sequence = m_sequence++;
+            m_head = (m_head + 1) % ring;
+        }
+
+        /* Queues every readback that has finished, oldest first; returns without waiting otherwise. */
+        void poll() {
+            while (m_slots[m_tail].fence != nullptr) {
+                auto &&s = m_slots[m_tail];
+                if (glClientWaitSync(s.fence, 0, 0) == GL_TIMEOUT_EXPIRED) break;
+                glDeleteSync(s.fence);
+                s.fence = nullptr;
+                m_tail = (m_tail + 1) % ring;
+
+                std::vector<std::uint8_t> pixels;
+                {
+                    std::lock_guard lock(m_mutex);
+                    if (m_jobs.size() >= max_queued) {
+                        ++m_dropped;
+                        continue;
+                    }
+                    if (!m_free.empty()) {
+                        pixels = std::move(m_free.back());
+                        m_free.pop_back();
+                    }
+                }
+
+                memory::scope tag(memory::tag::CAPTURE);
+                pixels.resize(s.bytes);
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, s.pbo);
+                if (auto *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(s.bytes), GL_MAP_READ_BIT)) {
+                    std::memcpy(pixels.data(), mapped, s.bytes);
+                    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+                }
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                {
+                    std::lock_guard lock(m_mutex);
+                    m_jobs.push_back({ s.sequence, s.size, std::move(pixels) });
+                }
+                m_cv.notify_one();
+            }
+        }
+
+        capture_stats get_stats() const {
+            capture_stats stats;
+            stats.requested = m_requested;
+            stats.written = m_written.load(std::memory_order_relaxed);
+            stats.dropped = m_dropped;
+            stats.failed = m_failed.load(std::memory_order_relaxed);
+            stats.in_flight = static_cast<std::size_t>(std::count_if(m_slots.begin(), m_slots.end(), [](const slot &s) { return s.fence != nullptr; }));
+            stats.write_ms = m_write_ms.load(std::memory_order_relaxed);
+            std::lock_guard lock(m_mutex);
+            stats.queued = m_jobs.size();
+            return stats;
+        }
+
+    private:
+        struct slot {
+            GLuint pbo = 0;
+            GLsync fence = nullptr;
+            std::size_t bytes = 0;
+            glm::ivec2 size{ 0 };
+            std::uint64_t sequence = 0;
+        };
+
+        struct job {
+            std::uint64_t sequence;
+            glm::ivec2 size;
+            std::vector<std::uint8_t> pixels;
+        };
+
+        void writer_loop() {
+            memory::scope tag(memory::tag::CAPTURE);
+            std::vector<std::uint8_t> encoded;
+            for (;;) {
+                job next;
+                {
+                    std::unique_lock lock(m_mutex);
+                    m_cv.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+                    if (m_stopping && m_jobs.empty()) return;
+                    next = std::move(m_jobs.front());
+                    m_jobs.pop_front();
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                bool written = write(next, encoded);
+                m_write_ms.store(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+                (written ? m_written : m_failed).fetch_add(1, std::memory_order_relaxed);
+
+                std::lock_guard lock(m_mutex);
+                m_free.push_back(std::move(next.pixels));
+            }
+        }
+
+        /* False when the file could not be opened or not every byte reached it. */
+        bool write(const job &j, std::vector<std::uint8_t> &encoded) {
+            std::error_code error;
+            std::filesystem::create_directories(m_directory, error);
+            bool png = m_format.load(std::memory_order_relaxed) == capture_format::PNG;
+            auto name = png ? std::format("frame_{:06}.png", j.sequence) : std::format("frame_{:06}_{}x{}.rgba", j.sequence, j.size.x, j.size.y);
+            std::ofstream file(m_directory / name, std::ios::binary);
+            if (!file) return false;
+
+            if (png) {
+                png::encode(j.size.x, j.size.y, j.pixels.data(), encoded);
+                file.write(reinterpret_cast<const char *>(encoded.data()), static_cast<std::streamsize>(encoded.size()));
+            }
+            else {
+                // rows top first, like the PNG
+                std::size_t row_bytes = static_cast<std::size_t>(j.size.x) * 4;
+                for (int y = j.size.y - 1; y >= 0; --y) {
+                    file.write(reinterpret_cast<const char *>(j.pixels.data() + row_bytes * y), static_cast<std::streamsize>(row_bytes));
+                }
+            }
+            file.close();
+            return static_cast<bool>(file);
+        }
+
+        std::filesystem::path m_directory;
+        std::array<slot, ring> m_slots;
+        std::size_t m_head = 0;                 // next slot read() fills
+        std::size_t m_tail = 0;                 // oldest slot poll() waits for
+        std::uint64_t m_sequence = 0;
+        std::uint64_t m_requested = 0;
+        std::uint64_t m_dropped = 0;
+        std::atomic<capture_format> m_format{ capture_format::PNG };
+        std::atomic<std::uint64_t> m_written{ 0 };
+        std::atomic<std::uint64_t> m_failed{ 0 };
+        std::atomic<float> m_write_ms{ 0.0f };
+
+        mutable std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque<job> m_jobs;
+        std::vector<std::vector<std::uint8_t>> m_free;
+        bool m_stopping = false;
+        std::thread m_writer;
+    };
+}
 
 //template <typename Func>
 //void static_run(Func &&l) {
@@ -764,81 +6647,36 @@ struct static_run {
     static_run(Func &&l) { std::invoke(l); }
 };
 
-void __Deprecated_RecreateSphere(
-        float sphere_radius, float sector_count, float stack_count,
-        GLuint &sphere_vao, GLuint &sphere_vbo, GLuint &sphere_ebo, 
-        std::vector<float> &sphere_vertices,  std::vector<int> &sphere_indices) {
-    static constexpr float PI = 3.14159265359;
-
-    sphere_vertices.clear();
-    sphere_indices.clear();
-    glDeleteBuffers(1, &sphere_vbo);
-    glDeleteBuffers(1, &sphere_ebo);
-    glDeleteVertexArrays(1, &sphere_vao);
-
-    float x, y, z, xy;
-    float nx, ny, nz, length_inv = 1.0f / sphere_radius;
-    float s, t;
-
-    float sector_step = 2 * PI / sector_count;
-    float stack_step = PI / stack_count;
-    float sector_angle, stack_angle;
-
-    for (int i = 0; i <= stack_count; ++i) {
-        stack_angle = PI / 2 - i * stack_step;
-        xy = sphere_radius * cosf(stack_angle);
-        z = sphere_radius * sinf(stack_angle);
-
-        for (int j = 0; j <= sector_count; ++j) {
-            sector_angle = j * sector_step;
-
-            // vertex position (x, y, z)
-            x = xy * cosf(sector_angle);
-            y = xy * sinf(sector_angle);
-            sphere_vertices.push_back(x);
-            sphere_vertices.push_back(y);
-            sphere_vertices.push_back(z);
-
-            // normalized vertex normal (nx, ny, nz)
-
-            // vertex tex coord (s, t) range between [0, 1]
+int main(int argc, char **argv) {
+    // --host <port> serves the scene to viewers, --viewer <port> shows a host's scene instead of the local one,
+    // --check-allocations <frames> exits with a failure if a steady-state frame allocates on the host
+    int host_port = 0;
+    int viewer_port = 0;
+    int check_allocations = 0;
+    for (int i = 1; i < argc; i += 2) {
+        std::string_view option = argv[i];
+        int *target = nullptr;
+        int max = std::numeric_limits<int>::max();
+        if (option == "--host") target = &host_port, max = 65535;
+        else if (option == "--viewer") target = &viewer_port, max = 65535;
+        else if (option == "--check-allocations") target = &check_allocations;
+        else {
+            std::cerr << "Unknown option " << option << '\n';
+            return EXIT_FAILURE;
         }
-    }
-
-    int k1, k2;
-    for (int i = 0; i < stack_count; ++i) {
-        k1 = i * (sector_count + 1);
-        k2 = k1 + sector_count + 1;
-
-        for (int j = 0; j < sector_count; ++j, ++k1, ++k2) {
-            if (i != 0) {
-                sphere_indices.push_back(k1);
-                sphere_indices.push_back(k2);
-                sphere_indices.push_back(k1 + 1);
-            }
-
-            if (i != stack_count - 1) {
-                sphere_indices.push_back(k1 + 1);
-                sphere_indices.push_back(k2);
-                sphere_indices.push_back(k2 + 1);
-            }
+        if (i + 1 == argc) {
+            std::cerr << "Option " << option << " needs a value\n";
+            return EXIT_FAILURE;
+        }
+        std::string_view value = argv[i + 1];
+        auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), *target);
+        if (error != std::errc{} || end != value.data() + value.size() || *target < 1 || *target > max) {
+            std::cerr << "Option " << option << " takes a number from 1 to " << max << ", not '" << value << "'\n";
+            return EXIT_FAILURE;
         }
     }
 
-    glGenVertexArrays(1, &sphere_vao);
-    glBindVertexArray(sphere_vao);
-    glGenBuffers(1, &sphere_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, sphere_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sphere_vertices.size() * sizeof(float), sphere_vertices.data(), GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), static_cast<void *>(0));
-    glGenBuffers(1, &sphere_ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphere_ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sphere_indices.size() * sizeof(int), sphere_indices.data(), GL_STATIC_DRAW);
-}
-
-int main() {
-    gl_context context({ 800, 600, "OpenGL Program" });
+    gl_context context({ 800, 600, "OpenGL Program", nullptr, nullptr, true });
     gl_scene default_scene;
 
     auto triangle1 = mk::geo::create_triangle({ {
@@ -857,6 +6695,9 @@ int main() {
     auto cube2 = mk::geo::create_cube();
     cube2->location().pos = glm::vec3{ 10, 3, 0 };
 
+    // props that never move after this point; cube1 follows the light and cube2 stays dynamic for comparison
+    std::unordered_set<std::size_t> static_props{ triangle1->get_id(), triangle2->get_id() };
+
     default_scene.add_geometry(triangle1);
     default_scene.add_geometry(triangle2);
     default_scene.add_geometry(cube1);
@@ -864,80 +6705,124 @@ int main() {
 
     srand(time(nullptr));
 
-    for (auto i = 0; i < 100; ++i) {
-        auto cube = mk::geo::create_cube();
-        cube->location().pos = glm::vec3{
-            fmod(static_cast<double>(rand()) / RAND_MAX * 5, 5.0),
-            fmod(static_cast<double>(rand()) / RAND_MAX * 5, 5.0),
-            fmod(static_cast<double>(rand()) / RAND_MAX * 5, 5.0)
-        };
-        auto pos = glm::translate(glm::identity<glm::mat4>(), glm::vec3{ 5, 5, 5 }) * glm::vec4{ 1.0f };
-        cube->location().pos += glm::vec3{ pos.x, pos.y, pos.z };
-        default_scene.add_geometry(cube);
-    }
+    // the cube props are prefab instances in the ECS sharing this one mesh, see prop_prefab
+    auto prop_cube = mk::geo::create_cube();
+    auto random_prop_positions = [](std::size_t count, glm::vec3 origin, float extent) {
+        std::vector<mk::location> positions;
+        positions.reserve(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            positions.emplace_back(origin + extent * glm::vec3{
+                static_cast<float>(rand()) / RAND_MAX,
+                static_cast<float>(rand()) / RAND_MAX,
+                static_cast<float>(rand()) / RAND_MAX
+            });
+        }
+        return positions;
+    };
+
+    // -- START OF LIGHTING
 
-    const char *glsl_vertex =
+    // every 3D vertex shader goes through the late latch correction, identity while latching is off
+    std::string glsl_light_vertex = std::string(
         "#version 330 core\n"
         "layout (location = 0) in vec3 aPos;"
-        "out vec3 color;"
+        "") + mk::late_latch::glsl_block +
         ""
         "uniform mat4 transform;"
         ""
         "void main() {"
-        "    gl_Position = transform * vec4(aPos, 1.0f);"
-        "    color = vec3(0.3);"
+        "    gl_Position = latch_correction * (transform * vec4(aPos, 1.0));"
         "}";
 
-    const char *glsl_fragment =
+    // light_color is the ambient term, point lights come from the light clusters
+    std::string glsl_light_fragment = std::string(
         "#version 330 core\n"
         "out vec4 FragColor;"
-        "in vec3 color;"
+        ""
+        "uniform int material;"
+        "uniform vec3 light_color;"
+        "") + mk::material_buffer::glsl_block + mk::light_clusters::glsl_shading +
         ""
         "void main() {"
-        "    FragColor = vec4(color, 1.0);"
+        "    vec3 albedo = material_albedo[material].rgb;"
+        "    FragColor = vec4(light_color * albedo + clustered_lighting(albedo), 1.0);"
         "}";
 
-    mk::shader shader = mk::shader::create_shader(glsl_vertex, glsl_fragment);
-    GLint transform_loc = glGetUniformLocation(shader.get_program(), "transform");
-
-    // -- START OF LIGHTING
-
-    const char *glsl_light_vertex =
+    // light_fragment with a screen-door dither for LOD cross-fades
+    std::string glsl_lod_fragment = std::string(
         "#version 330 core\n"
-        "layout (location = 0) in vec3 aPos;"
+        "out vec4 FragColor;"
         ""
-        "uniform mat4 transform;"
+        "uniform vec3 object_color;"
+        "uniform vec3 light_color;"
+        "uniform float lod_fade;"
+        "uniform bool lod_fade_out;"
+        "") + mk::light_clusters::glsl_shading +
+        ""
+        "const float bayer[16] = float[16](0, 8, 2, 10, 12, 4, 14, 6, 3, 11, 1, 9, 15, 7, 13, 5);"
         ""
         "void main() {"
-        "    gl_Position = transform * vec4(aPos, 1.0);"
+        "    ivec2 p = ivec2(gl_FragCoord.xy) & 3;"
+        "    float threshold = (bayer[p.y * 4 + p.x] + 0.5) / 16.0;"
+        "    if ((threshold < lod_fade) == lod_fade_out) discard;"
+        "    FragColor = vec4(light_color * object_color + clustered_lighting(object_color), 1.0);"
         "}";
 
-    const char *glsl_light_fragment =
+    mk::shader light_shader = mk::shader::create_shader(glsl_light_vertex.c_str(), glsl_light_fragment.c_str());
+    GLint light_transform_loc = glGetUniformLocation(light_shader.get_program(), "transform");
+    GLint material_loc = glGetUniformLocation(light_shader.get_program(), "material");
+    GLint light_color_loc = glGetUniformLocation(light_shader.get_program(), "light_color");
+    mk::material_buffer::attach(light_shader.get_program());
+    mk::late_latch::attach(light_shader.get_program());
+
+    // static batches: world-space positions, the material slot comes with each vertex
+    std::string glsl_batch_vertex = std::string(
         "#version 330 core\n"
-        "out vec4 FragColor;"
+        "layout (location = 0) in vec3 aPos;"
+        "layout (location = 1) in vec2 aMaterial;"
+        "flat out int material;"
+        "") + mk::late_latch::glsl_block +
         ""
-        "uniform vec3 object_color;"
-        "uniform vec3 light_color;"
+        "uniform mat4 transform;"
         ""
         "void main() {"
-        "    FragColor = vec4(light_color * object_color, 1.0);"
+        "    material = int(aMaterial.x + 0.5);"
+        "    gl_Position = latch_correction * (transform * vec4(aPos, 1.0));"
         "}";
 
-    const char *glsl_light_fragment2 =
+    std::string glsl_batch_fragment = std::string(
         "#version 330 core\n"
         "out vec4 FragColor;"
         ""
+        "flat in int material;"
+        "uniform vec3 light_color;"
+        "") + mk::material_buffer::glsl_block + mk::light_clusters::glsl_shading +
+        ""
         "void main() {"
-        "    FragColor = vec4(1.0);"
+        "    vec3 albedo = material_albedo[material].rgb;"
+        "    FragColor = vec4(light_color * albedo + clustered_lighting(albedo), 1.0);"
         "}";
 
-    mk::shader light_shader = mk::shader::create_shader(glsl_light_vertex, glsl_light_fragment);
-    GLint light_transform_loc = glGetUniformLocation(light_shader.get_program(), "transform");
-    GLint object_color_loc = glGetUniformLocation(light_shader.get_program(), "object_color");
-    GLint light_color_loc = glGetUniformLocation(light_shader.get_program(), "light_color");
-
-    mk::shader light_object_shader = mk::shader::create_shader(glsl_light_vertex, glsl_light_fragment2);
-    GLint light_object_transform_loc = glGetUniformLocation(light_object_shader.get_program(), "transform");
+    mk::shader batch_shader = mk::shader::create_shader(glsl_batch_vertex.c_str(), glsl_batch_fragment.c_str());
+    GLint batch_transform_loc = glGetUniformLocation(batch_shader.get_program(), "transform");
+    GLint batch_light_color_loc = glGetUniformLocation(batch_shader.get_program(), "light_color");
+    mk::material_buffer::attach(batch_shader.get_program());
+    mk::late_latch::attach(batch_shader.get_program());
+
+    mk::shader lod_shader = mk::shader::create_shader(glsl_light_vertex.c_str(), glsl_lod_fragment.c_str());
+    mk::late_latch::attach(lod_shader.get_program());
+    GLint lod_transform_loc = glGetUniformLocation(lod_shader.get_program(), "transform");
+    GLint lod_object_color_loc = glGetUniformLocation(lod_shader.get_program(), "object_color");
+    GLint lod_light_color_loc = glGetUniformLocation(lod_shader.get_program(), "light_color");
+    GLint lod_fade_loc = glGetUniformLocation(lod_shader.get_program(), "lod_fade");
+    GLint lod_fade_out_loc = glGetUniformLocation(lod_shader.get_program(), "lod_fade_out");
+
+    mk::light_clusters light_clusters;
+    auto light_cluster_locs = mk::light_clusters::locate(light_shader.get_program());
+    auto lod_light_cluster_locs = mk::light_clusters::locate(lod_shader.get_program());
+    auto batch_light_cluster_locs = mk::light_clusters::locate(batch_shader.get_program());
+    int point_light_count = 1024;
+    auto point_lights = mk::scatter_point_lights(static_cast<std::size_t>(point_light_count), 30.0f);
 
     auto light_source = mk::geo::create_cube();
     auto light_color = glm::vec3{ 0.33f, 0.42f, 0.18f };
@@ -956,236 +6841,591 @@ int main() {
 
     // -- END OF IMGUI INIT
 
-    std::vector<glm::vec3> grid_vertices;
-    std::vector<glm::uvec4> grid_indices;
-
+    // reference grid and origin axes are recorded through mk::debug every frame
     int radius = 30;
-    int slices = radius * 2;
+    mk::debug::lines debug_lines;
+    bool show_grid = true;
+    bool show_origin = true;
+    bool show_entity_bounds = false;
+    bool show_light_radii = false;
+    bool show_emitters = false;
+    bool show_transforms = false;
+
+    std::unique_ptr<mk::terrain> terrain;
+    {
+        mk::memory::scope tag(mk::memory::tag::TERRAIN);
+        // 2 km square, its highest point a little below the reference grid
+        terrain = std::make_unique<mk::terrain>(2048.0f, 160.0f, -170.0f, 1024, 7);
+    }
+    mk::terrain_settings terrain_settings;
 
-    for (int j = 0; j <= slices; ++j) {
-        for (int i = 0; i <= slices; ++i) {
-            float x = static_cast<float>(i) / slices * slices;
-            float y = 0/* static_cast<float>(i*i / (j+1)) + i*/;
-            float z = static_cast<float>(j) / slices * slices;
-            grid_vertices.push_back(glm::vec3{ x, y, z });
-        }
+    // begin sphere
+
+    float sphere_radius = 5;
+    float sector_count = 64;
+    float stack_count = 64;
+
+    // sector/stack counts are the finest level; coarser ones are picked by screen size
+    auto sphere_lods = std::make_unique<mk::lod_chain>(static_cast<int>(sector_count), static_cast<int>(stack_count));
+    std::array<mk::lod_instance, 1> lod_instances{};
+    mk::lod_settings lod_settings;
+
+    // the sphere is tilted onto its side at the root and spun around its own axis by a child node
+    mk::transform_hierarchy transforms;
+    auto sphere_root = transforms.create(mk::transform_hierarchy::no_parent, 
+        { glm::vec3{ 0.0f }, glm::angleAxis(glm::radians(90.0f), glm::vec3{ 1.0f, 0.0f, 0.0f }), glm::vec3{ sphere_radius } });
+    auto sphere_spin = transforms.create(sphere_root);
+
+    // optional stress tree hanging off its own root, four children per node
+    mk::transform_hierarchy::handle stress_root = mk::transform_hierarchy::no_parent;
+    int stress_nodes = 0;
+    bool animate_stress = true;
+    float hierarchy_ms = 0.0f;
+
+    // end sphere
+
+    mk::default_camera.pos.y = 0.0f;
+    mk::default_camera.pos.z = 2.0f;
+    mk::default_camera.set_rotation(0, 0);
+    //mk::default_camera.field_of_view = 150;
+
+    // the camera is sampled again right before submission; the pacer sleeps off slack before the last sample
+    mk::late_latch camera_latch;
+    bool late_latching = true;
+    mk::frame_pacer pacer;
+    bool pace_frames = false;
+    float pace_rate = pacer.get_rate();
+
+    // Memory panel: counts host allocations per tag over the next allocation_frames presented frames
+    int allocation_frames = 120;
+    mk::memory::allocation_window allocations;
+    int exit_code = EXIT_SUCCESS;
+    if (check_allocations > 0) {
+        // give the pipeline, pools and frame arenas time to reach their steady-state sizes
+        constexpr int warmup_frames = 120;
+        allocations.start(check_allocations, warmup_frames);
+    }
+
+    std::unique_ptr<mk::geometry_arena> geometry_arena;
+    std::unique_ptr<mk::indirect_renderer> indirect_renderer;
+    std::unique_ptr<mk::gpu_culler> gpu_culler;
+    if (mk::indirect_renderer::is_supported(context)) {
+        mk::memory::scope tag(mk::memory::tag::INSTANCES);
+        geometry_arena = std::make_unique<mk::geometry_arena>();
+        indirect_renderer = std::make_unique<mk::indirect_renderer>(*geometry_arena);
+        gpu_culler = std::make_unique<mk::gpu_culler>(*geometry_arena);
     }
 
-    for (int j = 0; j < slices; ++j) {
-        for (int i = 0; i < slices; ++i) {
-            int row1 = j        * (slices + 1);
-            int row2 = (j + 1)  * (slices + 1);
+    mk::material_buffer materials;
+    std::unordered_map<std::size_t, std::uint32_t> material_slots;
+    materials.allocate(toy_color);
+    mk::ecs::world scene_world;
+    mk::gpu_instance_owners gpu_instances;
+    for (auto &&[id, shape] : default_scene.geometries) {
+        mk::memory::scope tag(mk::memory::tag::SCENE);
+        // spread the hues a little so per-entity materials are visible
+        float hue = static_cast<float>(material_slots.size()) * 0.618034f;
+        auto albedo = toy_color * (0.6f + 0.4f * glm::vec3{ std::cos(6.2832f * hue), std::cos(6.2832f * (hue + 0.33f)), std::cos(6.2832f * (hue + 0.67f)) });
+        auto slot = materials.allocate(albedo);
+        material_slots.emplace(id, slot);
+
+        auto entity = scene_world.create();
+        scene_world.emplace<mk::location>(entity, shape->get_location());
+        scene_world.emplace<mk::scene_node>(entity, shape.get(), mk::scene_node::no_instance);
+        scene_world.emplace<mk::material>(entity, albedo, slot);
+        if (static_props.contains(id)) scene_world.emplace<mk::static_geometry>(entity);
+    }
 
-            grid_indices.push_back(glm::uvec4{ row1 + i, row1 + i + 1, row1 + i + 1, row2 + i + 1 });
-            grid_indices.push_back(glm::uvec4{ row2 + i + 1, row2 + i, row2 + i, row1 + i });
+    // culls and builds the draw list on a worker, against the settings each frame was started with
+    mk::frame_pipeline pipeline(mk::default_thread_pool(), 2, [&default_scene, &material_slots](mk::frame_packet &packet) {
+        auto &&settings = packet.settings;
+        if (settings.cpu_culling) {
+            mk::build_draw_list(default_scene.geometries, material_slots, *settings.batched, packet, settings.occlusion);
         }
+    });
+    int pipeline_depth = pipeline.get_depth();
+
+    // static cube props: one prefab stamped out with a location per instance, later stamps go through simulation_input
+    mk::ecs::prefab prop_prefab;
+    prop_prefab.set<mk::location>()
+        .set<mk::scene_node>(prop_cube.get(), mk::scene_node::no_instance)
+        .set<mk::material>(toy_color, materials.allocate(toy_color))
+        .set<mk::static_geometry>();
+    {
+        mk::memory::scope tag(mk::memory::tag::SCENE);
+        auto positions = random_prop_positions(100, glm::vec3{ 5.0f }, 5.0f);
+        scene_world.instantiate(prop_prefab, positions.size(), std::span<const mk::location>(positions));
     }
+    if (gpu_culler) {
+        mk::memory::scope tag(mk::memory::tag::INSTANCES);
+        gpu_instances.reconcile(scene_world, *gpu_culler);
+    }
+    int prop_stamp_count = 10000;
+    int prop_stamp_request = 0;
+    std::size_t props_stamped = 0;
+    float prop_stamp_ms = 0.0f;
+
+    mk::static_batcher static_batches;
+    float static_cell_size = 4.0f;
+    bool static_batching = true;
+    // replaced rather than modified, simulate tasks still in flight keep the set they started with
+    std::shared_ptr<const std::unordered_set<std::size_t>> batched_ids;
+    auto no_batched_ids = std::make_shared<const std::unordered_set<std::size_t>>();
+    auto rebuild_static_batches = [&] {
+        mk::memory::scope tag(mk::memory::tag::MESHES);
+        batched_ids = std::make_shared<const std::unordered_set<std::size_t>>(static_batches.build(scene_world, static_cell_size));
+        if (gpu_culler) {
+            scene_world.query<const mk::scene_node, const mk::static_geometry>().each([&](mk::ecs::entity, const mk::scene_node &node, const mk::static_geometry &) {
+                gpu_culler->set_enabled(node.gpu_instance, !static_batching);
+            });
+        }
+    };
+    rebuild_static_batches();
+
+    std::unique_ptr<mk::net::replication_host> replication_host;
+    std::unique_ptr<mk::net::replication_client> replication_client;
+    mk::ecs::world replica_world;
+    int replication_port = host_port != 0 ? host_port : 27015;
+    std::string replication_error;
+    if (host_port != 0) replication_host = std::make_unique<mk::net::replication_host>(static_cast<std::uint16_t>(host_port));
+    if (viewer_port != 0) replication_client = std::make_unique<mk::net::replication_client>(static_cast<std::uint16_t>(viewer_port));
+    mk::ecs::tick materials_seen = 0;
+    std::size_t materials_uploaded = 0;
+    mk::ecs::command_queue spawn_commands;
+    mk::ecs::command_queue age_commands;
+    int spawn_per_frame = 0;
+    float spawn_lifetime = 2.0f;
+    mk::ecs::tick gpu_instances_seen = 0;
+    std::size_t gpu_instances_synced = 0;
+    bool bob_instances = false;
+    // rewind/replay requests from the History panel are served at the next ECS sync point
+    mk::scene_recorder recorder(300);
+    bool record_scene = false;
+    int rewind_index = 0;
+    std::optional<std::size_t> rewind_request;
+    bool replay_request = false;
+    int replay_matched = -1;
+    std::size_t replay_steps = 0;
+    bool use_indirect = indirect_renderer != nullptr;
+    bool use_gpu_culling = false;
+    std::optional<mk::gpu_culler::validation> culling_validation;
+
+    // emitters are scene entities; new ones take the settings of the Particles panel
+    mk::particle_system particles(std::size_t{ 1 } << 21);
+    mk::particle_emitter emitter_settings;
+    float particle_size = 0.08f;
+    bool simulate_particles = true;
+    std::uint32_t next_emitter_seed = 1;
+    auto add_emitter = [&](glm::vec3 position) {
+        mk::memory::scope tag(mk::memory::tag::SCENE);
+        auto entity = scene_world.create();
+        scene_world.emplace<mk::location>(entity, position);
+        auto &&emitter = scene_world.emplace<mk::particle_emitter>(entity, emitter_settings);
+        emitter.seed = next_emitter_seed++ * 2654435761u | 1u;
+    };
+    add_emitter(glm::vec3{ -6.0f, 0.0f, -6.0f });
 
-    GLuint grid_vao;
-    GLuint grid_vbo;
-    GLuint grid_ebo;
-    glGenVertexArrays(1, &grid_vao);
-    glBindVertexArray(grid_vao);
+    mk::occlusion_settings occlusion_settings;
+    mk::occlusion_debug_view occlusion_view;
 
-    glGenBuffers(1, &grid_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, grid_vbo);
-    glBufferData(GL_ARRAY_BUFFER, grid_vertices.size() * sizeof(glm::vec3), glm::value_ptr(grid_vertices[0]), GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, static_cast<void *>(0));
+    // -- FRAME GRAPH
 
-    glGenBuffers(1, &grid_ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, grid_ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, grid_indices.size() * sizeof(glm::uvec4), glm::value_ptr(grid_indices[0]), GL_STATIC_DRAW);
+    // state the passes read, filled in by the update part of each frame
+    mk::frame_packet *frame = nullptr;
+    glm::vec3 camera_pos{ 0.0f };
+    glm::mat4 sphere_transform{ 1.0f };
+    float particle_point_scale = 1.0f;
+
+    auto draw_scene = [&] {
+        auto view = frame->view_projection;
+
+        // -- DEBUG LINES: grid, axes, cursor and whatever else was recorded this frame
+        debug_lines.draw(view);
+
+        // -- TERRAIN
+        if (terrain_settings.enabled) {
+            terrain->draw(view, camera_pos, light_color, terrain_settings);
+        }
 
-    glBindVertexArray(0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+        // -- SCENE GEOMETRY (handled outside of default_scene to test lighting)
+        if (replication_client == nullptr) {
+            if (use_gpu_culling) {
+                gpu_culler->draw(view, light_color, light_clusters);
+            }
+            else if (use_indirect) {
+                indirect_renderer->submit(frame->draws, light_color, light_clusters);
+            }
+            glUseProgram(light_shader.get_program());
+            light_clusters.bind(light_cluster_locs);
+            glUniform3fv(light_color_loc, 1, glm::value_ptr(light_color));
+            if (!use_indirect && !use_gpu_culling) {
+                // the GL 3.3 path still needs a uniform per draw for the transform; the material is one more int
+                for (auto &&command : frame->draws) {
+                    glUniformMatrix4fv(light_transform_loc, 1, GL_FALSE, glm::value_ptr(command.transform));
+                    glUniform1i(material_loc, static_cast<GLint>(command.material));
+                    command.shape->draw();
+                }
+            }
+            if (!static_batching && !use_gpu_culling) {
+                // the prefab props are not in default_scene and have no draw list entry
+                scene_world.query<const mk::location, const mk::scene_node, const mk::material>().each(
+                    [&](mk::ecs::entity, const mk::location &l, const mk::scene_node &node, const mk::material &m) {
+                        if (node.shape != prop_cube.get()) return;
+                        glUniformMatrix4fv(light_transform_loc, 1, GL_FALSE, glm::value_ptr(view * l.get_matrix()));
+                        glUniform1i(material_loc, static_cast<GLint>(m.slot));
+                        prop_cube->draw();
+                    });
+            }
+            if (static_batching) {
+                glUseProgram(batch_shader.get_program());
+                light_clusters.bind(batch_light_cluster_locs);
+                glUniform3fv(batch_light_color_loc, 1, glm::value_ptr(light_color));
+                glUniformMatrix4fv(batch_transform_loc, 1, GL_FALSE, glm::value_ptr(view));
+                static_batches.draw(mk::frustum(view));
+            }
+        }
+        else {
+            // viewer: the host's entities replace the local scene, one cube each with the replicated albedo
+            glUseProgram(lod_shader.get_program());
+            light_clusters.bind(lod_light_cluster_locs);
+            glUniform3fv(lod_light_color_loc, 1, glm::value_ptr(light_color));
+            glUniform1f(lod_fade_loc, 1.0f);
+            glUniform1i(lod_fade_out_loc, GL_FALSE);
+            replica_world.query<const mk::location>().each([&](mk::ecs::entity e, const mk::location &l) {
+                auto albedo = replica_world.has<mk::material>(e) ? replica_world.read<mk::material>(e).albedo : toy_color;
+                glUniform3fv(lod_object_color_loc, 1, glm::value_ptr(albedo));
+                glUniformMatrix4fv(lod_transform_loc, 1, GL_FALSE, glm::value_ptr(view * l.get_matrix()));
+                cube1->draw();
+            });
+        }
 
-    GLuint grid_idx_length = static_cast<GLuint>(grid_indices.size() * 4);
+        // -- SPHERE
+        auto &sphere_lod = lod_instances[0];
+        glUseProgram(lod_shader.get_program());
+        light_clusters.bind(lod_light_cluster_locs);
+        glUniform3fv(lod_object_color_loc, 1, glm::value_ptr(toy_color));
+        glUniform3fv(lod_light_color_loc, 1, glm::value_ptr(light_color));
+        glUniformMatrix4fv(lod_transform_loc, 1, GL_FALSE, glm::value_ptr(sphere_transform));
+        glUniform1f(lod_fade_loc, sphere_lod.fade);
+        glUniform1i(lod_fade_out_loc, GL_FALSE);
+        sphere_lods->draw(sphere_lod.level);
+        if (sphere_lod.fade < 1.0f) {
+            glUniform1i(lod_fade_out_loc, GL_TRUE);
+            sphere_lods->draw(sphere_lod.previous_level);
+        }
 
-    // origin axis
+        // -- PARTICLES: blended on top of everything opaque
+        particles.draw(view, particle_point_scale);
+    };
 
-    const char *axis_vertex =
+    // post-processing: bright pass and separable blur at half resolution, composited onto the backbuffer
+    const char *fullscreen_vertex =
         "#version 330 core\n"
-        "layout (location = 0) in vec3 aPos;"
+        "out vec2 uv;"
         ""
-        "uniform mat4 transform;"
-        "out vec3 pos;"
+        "void main() {"
+        "    uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);"
+        "    gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);"
+        "}";
+
+    const char *bright_fragment =
+        "#version 330 core\n"
+        "in vec2 uv;"
+        "out vec4 FragColor;"
+        ""
+        "uniform sampler2D source;"
+        "uniform float threshold;"
         ""
         "void main() {"
-        "    gl_Position = transform * vec4(aPos, 1.0);"
-        "    pos = aPos;"
+        "    vec3 c = texture(source, uv).rgb;"
+        "    FragColor = vec4(max(c - vec3(threshold), vec3(0.0)), 1.0);"
         "}";
 
-    const char *axis_fragment =
+    const char *blur_fragment =
         "#version 330 core\n"
+        "in vec2 uv;"
         "out vec4 FragColor;"
         ""
-        "in vec3 pos;"
+        "uniform sampler2D source;"
+        "uniform vec2 direction;"  // one texel along the blur axis
+        ""
+        "const float weights[5] = float[5](0.227027, 0.1945946, 0.1216216, 0.054054, 0.016216);"
         ""
         "void main() {"
-        "    FragColor = vec4(ceil(pos), 1.0);"
+        "    vec3 sum = texture(source, uv).rgb * weights[0];"
+        "    for (int i = 1; i < 5; ++i) {"
+        "        sum += texture(source, uv + direction * i).rgb * weights[i];"
+        "        sum += texture(source, uv - direction * i).rgb * weights[i];"
+        "    }"
+        "    FragColor = vec4(sum, 1.0);"
         "}";
 
-    mk::shader axis_shader = mk::shader::create_shader(axis_vertex, axis_fragment);
-    GLint axis_transform_loc = glGetUniformLocation(axis_shader.get_program(), "transform");
+    const char *composite_fragment =
+        "#version 330 core\n"
+        "in vec2 uv;"
+        "out vec4 FragColor;"
+        ""
+        "uniform sampler2D scene;"
+        "uniform sampler2D bloom;"
+        "uniform float bloom_strength;"
+        ""
+        "void main() {"
+        "    FragColor = vec4(texture(scene, uv).rgb + texture(bloom, uv).rgb * bloom_strength, 1.0);"
+        "}";
 
-    std::array<glm::vec3, 6> line_vertices{
-        glm::vec3{ 0.0f, 0.0f, 0.0f },
-        glm::vec3{ 2.0f, 0.0f, 0.0f },
-        glm::vec3{ 0.0f, 0.0f, 0.0f },
-        glm::vec3{ 0.0f, 2.0f, 0.0f },
-        glm::vec3{ 0.0f, 0.0f, 0.0f },
-        glm::vec3{ 0.0f, 0.0f, 2.0f }
+    mk::shader bright_shader = mk::shader::create_shader(fullscreen_vertex, bright_fragment);
+    GLint bright_threshold_loc = glGetUniformLocation(bright_shader.get_program(), "threshold");
+    mk::shader blur_shader = mk::shader::create_shader(fullscreen_vertex, blur_fragment);
+    GLint blur_direction_loc = glGetUniformLocation(blur_shader.get_program(), "direction");
+    mk::shader composite_shader = mk::shader::create_shader(fullscreen_vertex, composite_fragment);
+    GLint composite_bloom_strength_loc = glGetUniformLocation(composite_shader.get_program(), "bloom_strength");
+    glUseProgram(composite_shader.get_program());
+    glUniform1i(glGetUniformLocation(composite_shader.get_program(), "bloom"), 1);
+
+    // core profile needs a bound VAO even when the vertex shader makes up its own positions
+    GLuint fullscreen_vao;
+    mk::memory::gen_vertex_arrays(1, &fullscreen_vao);
+    auto draw_fullscreen = [&](GLuint program, GLuint source) {
+        glDisable(GL_DEPTH_TEST);
+        glUseProgram(program);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, source);
+        glBindVertexArray(fullscreen_vao);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glEnable(GL_DEPTH_TEST);
     };
 
-    GLuint origin_vao;
-    GLuint origin_vbo;
-    glGenVertexArrays(1, &origin_vao);
-    glBindVertexArray(origin_vao);
-    glGenBuffers(1, &origin_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, origin_vbo);
-    glBufferData(GL_ARRAY_BUFFER, line_vertices.size() * sizeof(glm::vec3), glm::value_ptr(line_vertices[0]), GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), static_cast<void *>(0));
+    struct render_config {
+        int width = 0;
+        int height = 0;
+        bool post_processing = false;
+        bool bloom = true;
+        bool capture = false;
+        bool capture_ui = false;
 
-    // end of origin axis
-
-    // begin sphere
+        bool operator==(const render_config &) const = default;
+    };
+    render_config render_settings;
+    render_config compiled_render_config{ -1, -1 };
+    float bloom_threshold = 0.8f;
+    float bloom_strength = 0.6f;
+    mk::frame_graph render_graph;
+    mk::frame_capture capture("captures");
+
+    using pass_builder = mk::frame_graph::builder;
+    using pass_context = mk::frame_graph::context;
+    auto build_render_graph = [&](const render_config &config) {
+        render_graph.reset();
+        auto &&sky = default_scene.get_sky_color();
+        auto backbuffer = render_graph.import_backbuffer("backbuffer", { sky[0], sky[1], sky[2], sky[3] });
+
+        if (!config.post_processing) {
+            render_graph.add_pass("opaque", [&](pass_builder &b) { b.write(backbuffer, true); }, [&](const pass_context &) { draw_scene(); });
+        }
+        else {
+            mk::frame_graph::resource scene_color, scene_depth, bright, blur_x, blur_y;
+            render_graph.add_pass("opaque", [&](pass_builder &b) {
+                scene_color = b.create("scene_color", { GL_RGBA16F, 1.0f, { sky[0], sky[1], sky[2], sky[3] } });
+                scene_depth = b.create("scene_depth", { GL_DEPTH_COMPONENT24 });
+                b.write(scene_color, true);
+                b.write(scene_depth, true);
+            }, [&](const pass_context &) { draw_scene(); });
+
+            // declared unconditionally; without bloom nothing reads blur_y and the graph drops all three
+            render_graph.add_pass("bright", [&](pass_builder &b) {
+                b.read(scene_color);
+                bright = b.create("bright", { GL_RGBA16F, 0.5f });
+                b.write(bright);
+            }, [&, scene_color](const pass_context &ctx) {
+                glUseProgram(bright_shader.get_program());
+                glUniform1f(bright_threshold_loc, bloom_threshold);
+                draw_fullscreen(bright_shader.get_program(), ctx.texture(scene_color));
+            });
+            render_graph.add_pass("blur_x", [&](pass_builder &b) {
+                b.read(bright);
+                blur_x = b.create("blur_x", { GL_RGBA16F, 0.5f });
+                b.write(blur_x);
+            }, [&, bright](const pass_context &ctx) {
+                glUseProgram(blur_shader.get_program());
+                glUniform2f(blur_direction_loc, 1.0f / static_cast<float>(ctx.size(bright).x), 0.0f);
+                draw_fullscreen(blur_shader.get_program(), ctx.texture(bright));
+            });
+            render_graph.add_pass("blur_y", [&](pass_builder &b) {
+                b.read(blur_x);
+                blur_y = b.create("blur_y", { GL_RGBA16F, 0.5f });
+                b.write(blur_y);
+            }, [&, blur_x](const pass_context &ctx) {
+                glUseProgram(blur_shader.get_program());
+                glUniform2f(blur_direction_loc, 0.0f, 1.0f / static_cast<float>(ctx.size(blur_x).y));
+                draw_fullscreen(blur_shader.get_program(), ctx.texture(blur_x));
+            });
+
+            render_graph.add_pass("composite", [&](pass_builder &b) {
+                b.read(scene_color);
+                if (config.bloom) b.read(blur_y);
+                b.write(backbuffer);
+            }, [&, scene_color, blur_y, bloom = config.bloom](const pass_context &ctx) {
+                glUseProgram(composite_shader.get_program());
+                glUniform1f(composite_bloom_strength_loc, bloom ? bloom_strength : 0.0f);
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, ctx.texture(bloom ? blur_y : scene_color));
+                draw_fullscreen(composite_shader.get_program(), ctx.texture(scene_color));
+                glActiveTexture(GL_TEXTURE1);
+                glBindTexture(GL_TEXTURE_2D, 0);
+                glActiveTexture(GL_TEXTURE0);
+            });
+        }
 
-    constexpr float PI = 3.14159265359;
-    float sphere_radius = 5;
-    float sector_count = 5;
-    float stack_count = 5;
+        // reads the backbuffer into the capture ring, before or after the UI goes on top
+        auto add_capture_pass = [&] {
+            render_graph.add_pass("capture", [&](pass_builder &b) {
+                b.read(backbuffer);
+                b.side_effect();
+            }, [&, backbuffer](const pass_context &ctx) { capture.read(ctx.size(backbuffer)); });
+        };
+        if (config.capture && !config.capture_ui) add_capture_pass();
 
-    std::vector<float> sphere_vertices;
-    std::vector<float> sphere_normals;
-    std::vector<float> sphere_texcoords;
+        render_graph.add_pass("imgui", [&](pass_builder &b) {
+            b.write(backbuffer);
+            b.side_effect();
+        }, [](const pass_context &) { ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData()); });
 
-    float x, y, z, xy;
-    float nx, ny, nz, length_inv = 1.0f / sphere_radius;
-    float s, t;
+        if (config.capture && config.capture_ui) add_capture_pass();
 
-    float sector_step = 2 * PI / sector_count;
-    float stack_step = PI / stack_count;
-    float sector_angle, stack_angle;
+        render_graph.compile(config.width, config.height);
+    };
 
-    for (int i = 0; i <= stack_count; ++i) {
-        stack_angle = PI / 2 - i * stack_step;
-        xy = sphere_radius * cosf(stack_angle);
-        z = sphere_radius * sinf(stack_angle);
+    while (!glfwWindowShouldClose(context.get_window())) {
+        if (pace_frames && !late_latching) pacer.wait();
+        handle_input(context.get_window());
+        auto input_time = mk::frame_clock::now();
+        //default_scene.draw(shader);
 
-        for (int j = 0; j <= sector_count; ++j) {
-            sector_angle = j * sector_step;
+        frame = pipeline.advance(mk::default_camera, input_time, { static_batching ? batched_ids : no_batched_ids, !use_gpu_culling, occlusion_settings });
+        if (frame == nullptr) {
+            // pipeline is still filling, nothing to submit yet
+            glfwPollEvents();
+            continue;
+        }
 
-            // vertex position (x, y, z)
-            x = xy * cosf(sector_angle);
-            y = xy * sinf(sector_angle);
-            sphere_vertices.push_back(x);
-            sphere_vertices.push_back(y);
-            sphere_vertices.push_back(z);
+        // everything up to the frame graph only updates state and uploads data, the passes draw it
+        auto view = frame->view_projection;
+        camera_pos = glm::vec3(glm::inverse(frame->view)[3]);
 
-            // normalized vertex normal (nx, ny, nz)
-            
-            // vertex tex coord (s, t) range between [0, 1]
+        // -- TERRAIN
+        if (terrain_settings.enabled && !terrain_settings.freeze_selection) {
+            mk::memory::scope tag(mk::memory::tag::TERRAIN);
+            terrain->select(camera_pos, frame->view_projection, terrain_settings);
         }
-    }
-
-    std::vector<int> sphere_indices;
-    std::vector<int> sphere_line_indices;
 
-    int k1, k2;
-    for (int i = 0; i < stack_count; ++i) {
-        k1 = i * (sector_count + 1);
-        k2 = k1 + sector_count + 1;
+        // -- LIGHT CLUSTERS
+        int framebuffer_width, framebuffer_height;
+        glfwGetFramebufferSize(context.get_window(), &framebuffer_width, &framebuffer_height);
+        {
+            mk::memory::scope tag(mk::memory::tag::SCENE);
+            light_clusters.assign(point_lights, frame->view, frame->projection, mk::default_camera.near, mk::default_camera.far,
+                framebuffer_width, framebuffer_height, mk::default_thread_pool());
+            light_clusters.upload();
+        }
 
-        for (int j = 0; j < sector_count; ++j, ++k1, ++k2) {
-            if (i != 0) {
-                sphere_indices.push_back(k1);
-                sphere_indices.push_back(k2);
-                sphere_indices.push_back(k1 + 1);
+        // -- ECS: record structural changes in parallel, apply them at this sync point, then move entities
+        {
+            mk::memory::scope tag(mk::memory::tag::SCENE);
+            // restores and stamps change which entities have a scene_node, everything else only moves them
+            bool restructured = rewind_request || replay_request || prop_stamp_request > 0;
+            if (rewind_request) {
+                recorder.rewind(scene_world, *rewind_request);
+                rewind_request.reset();
             }
-
-            if (i != stack_count - 1) {
-                sphere_indices.push_back(k1 + 1);
-                sphere_indices.push_back(k2);
-                sphere_indices.push_back(k2 + 1);
+            if (replay_request) {
+                replay_matched = recorder.replay(scene_world, 0, spawn_commands, age_commands, prop_prefab) ? 1 : 0;
+                replay_steps = recorder.get_history().size();
+                replay_request = false;
             }
 
-            sphere_line_indices.push_back(k1);
-            sphere_line_indices.push_back(k2);
-            if (i != 0) {
-                sphere_line_indices.push_back(k1);
-                sphere_line_indices.push_back(k1 + 1);
+            static float last_update = static_cast<float>(glfwGetTime());
+            float now = static_cast<float>(glfwGetTime());
+            mk::simulation_input input{ now, now - last_update, static_cast<std::uint32_t>(spawn_per_frame), spawn_lifetime, bob_instances };
+            if (prop_stamp_request > 0) {
+                input.props = random_prop_positions(static_cast<std::size_t>(prop_stamp_request), glm::vec3{ -30.0f, 0.0f, -30.0f }, 60.0f);
+                prop_stamp_request = 0;
+            }
+            if (record_scene) recorder.record(scene_world, input);
+            auto start = mk::frame_clock::now();
+            mk::step_simulation(scene_world, spawn_commands, age_commands, prop_prefab, input);
+            last_update = now;
+
+            if (restructured) {
+                if (gpu_culler != nullptr) {
+                    mk::memory::scope tag(mk::memory::tag::INSTANCES);
+                    gpu_instances.reconcile(scene_world, *gpu_culler);
+                }
+                rebuild_static_batches();
+            }
+            if (!input.props.empty()) {
+                props_stamped = input.props.size();
+                prop_stamp_ms = std::chrono::duration<float, std::milli>(mk::frame_clock::now() - start).count();
             }
         }
-    }
-
-    GLuint sphere_vao;
-    GLuint sphere_vbo;
-    GLuint sphere_ebo;
-    glGenVertexArrays(1, &sphere_vao);
-    glBindVertexArray(sphere_vao);
-    glGenBuffers(1, &sphere_vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, sphere_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sphere_vertices.size() * sizeof(float), sphere_vertices.data(), GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), static_cast<void *>(0));
-    glGenBuffers(1, &sphere_ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphere_ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sphere_indices.size() * sizeof(int), sphere_indices.data(), GL_STATIC_DRAW);
-    std::cout << sphere_indices.size() << '\n';
-
-    // end sphere
-
-    mk::default_camera.pos.y = 0.0f;
-    mk::default_camera.pos.z = 2.0f;
-    mk::default_camera.set_rotation(0, 0);
-    //mk::default_camera.field_of_view = 150;
-    while (!glfwWindowShouldClose(context.get_window())) {
-        handle_input(context.get_window());
-        //default_scene.draw(shader);
+        if (gpu_culler != nullptr) {
+            auto since = std::exchange(gpu_instances_seen, scene_world.checkpoint());
+            gpu_instances_synced = mk::sync_gpu_instances(scene_world, *gpu_culler, since);
+        }
+        {
+            auto since = std::exchange(materials_seen, scene_world.checkpoint());
+            materials_uploaded = mk::sync_materials(scene_world, materials, since);
+            materials.bind();
+        }
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        auto view = mk::default_camera.get_perspective() * mk::default_camera.get_view();
-
-        // -- GRID
-        glUseProgram(shader.get_program());
-        glUniformMatrix4fv(transform_loc, 1, GL_FALSE, glm::value_ptr(glm::translate(view, glm::vec3{ -radius, 0, -radius })));
-        glBindVertexArray(grid_vao);
-        glDrawElements(GL_LINES, grid_idx_length, GL_UNSIGNED_INT, nullptr);
-
-        // -- AXES
-        glLineWidth(2);
-        glUseProgram(axis_shader.get_program());
-        glUniformMatrix4fv(axis_transform_loc, 1, GL_FALSE, glm::value_ptr(view));
-        glBindVertexArray(origin_vao);
-        glDrawArrays(GL_LINES, 0, 6);
-        glLineWidth(1);
+        // -- PARTICLES: emitters are read from the world, the particles live in the system's own arrays
+        {
+            mk::memory::scope tag(mk::memory::tag::PARTICLES);
+            static float last_particles = static_cast<float>(glfwGetTime());
+            float now = static_cast<float>(glfwGetTime());
+            if (simulate_particles) {
+                particles.emit(scene_world, now - last_particles);
+                particles.simulate(now - last_particles, mk::default_thread_pool());
+            }
+            particles.upload(mk::default_thread_pool());
+            particle_point_scale = particle_size * frame->projection[1][1] * 0.5f * static_cast<float>(framebuffer_height);
+            last_particles = now;
+        }
 
-        // -- SCENE GEOMETRY (handled outside of default_scene to test lighting)
-        glUseProgram(light_shader.get_program());
-        glUniform3fv(object_color_loc, 1, glm::value_ptr(toy_color));
-        glUniform3fv(light_color_loc, 1, glm::value_ptr(light_color));
-        for (auto &&[_, shape] : default_scene.geometries) {
-            auto transform = view * shape->get_location().get_matrix();
-            glUniformMatrix4fv(light_transform_loc, 1, GL_FALSE, glm::value_ptr(transform));
-            shape->draw();
+        // -- REPLICATION: after every write of the frame, before end_frame() publishes the removals
+        if (replication_host != nullptr) {
+            replication_host->update(scene_world);
+        }
+        if (replication_client != nullptr) {
+            replication_client->update(replica_world);
+            replica_world.end_frame();
         }
 
         static glm::vec3 sphere_pos{ 0, 0, 0 };
-        auto sphere_transform = glm::translate(view, sphere_pos);
-        sphere_transform = glm::rotate(sphere_transform, glm::radians(90.0f), glm::vec3{ 1.0f, 0.0f, 0.0f });
-        sphere_transform = glm::rotate(sphere_transform, static_cast<float>(glfwGetTime()), glm::vec3{ 0.0f, 0.0f, 1.0f });
-        glUniformMatrix4fv(light_transform_loc, 1, GL_FALSE, glm::value_ptr(sphere_transform));
-        glBindVertexArray(sphere_vao);
-        glDrawElements(GL_TRIANGLES, sphere_indices.size(), GL_UNSIGNED_INT, nullptr);
-
-        // Temporarily disabled for debugging
-        //glUseProgram(light_object_shader.get_program());
-        //auto light_source_model = glm::scale(light_source->get_location().get_matrix(), glm::vec3{ 0.5, 0.5, 0.5 });
-        //glUniformMatrix4fv(light_object_transform_loc, 1, GL_FALSE, glm::value_ptr(view * light_source_model));
-        //light_source->draw();
+        auto &sphere_lod = lod_instances[0];
+        sphere_lod.center = sphere_pos;
+        sphere_lod.radius = sphere_radius;
+        {
+            static float last_select = static_cast<float>(glfwGetTime());
+            float now = static_cast<float>(glfwGetTime());
+            mk::select_lods(lod_instances, sphere_lods->get_level_count(), frame->view,
+                frame->projection[1][1] * framebuffer_height * 0.5f, now - last_select, lod_settings);
+            last_select = now;
+        }
+
+        {
+            auto root = transforms.get_local(sphere_root);
+            root.translation = sphere_pos;
+            root.scale = glm::vec3{ sphere_radius };
+            transforms.set_local(sphere_root, root);
+            transforms.set_local(sphere_spin, { glm::vec3{ 0.0f }, glm::angleAxis(static_cast<float>(glfwGetTime()), glm::vec3{ 0.0f, 0.0f, 1.0f }) });
+            if (animate_stress && stress_root != mk::transform_hierarchy::no_parent) {
+                transforms.set_local(stress_root, { glm::vec3{ 0.0f, 10.0f, 0.0f }, glm::angleAxis(static_cast<float>(glfwGetTime()), glm::vec3{ 0.0f, 1.0f, 0.0f }) });
+            }
+            auto start = mk::frame_clock::now();
+            transforms.update(mk::default_thread_pool());
+            hierarchy_ms = std::chrono::duration<float, std::milli>(mk::frame_clock::now() - start).count();
+        }
+        sphere_transform = view * transforms.get_world(sphere_spin);
 
         double c_x, c_y;
         glfwGetCursorPos(context.get_window(), &c_x, &c_y);
@@ -1208,24 +7448,38 @@ int main() {
         );
         projection = distance * projection + mk::default_camera.pos;
 
+        // -- DEBUG LINES
         if (glfwGetInputMode(context.get_window(), GLFW_CURSOR) == GLFW_CURSOR_NORMAL) {
-            auto model = glm::translate(glm::identity<glm::mat4>(), projection);
-            model = glm::scale(model, glm::vec3{ 0.5f });
-            auto transform 
-                = mk::default_camera.get_perspective() 
-                * mk::default_camera.get_view() 
-                * model;
-            glUseProgram(light_object_shader.get_program());
-            glUniformMatrix4fv(light_object_transform_loc, 1, GL_FALSE, glm::value_ptr(transform));
-            light_source->draw();
-        }
-
-        glfwSetWindowTitle(context.get_window(), 
-            std::format("Coordinates: {}x, {}y, {}z",
-                mk::default_camera.pos.x,
-                mk::default_camera.pos.y,
-                mk::default_camera.pos.z
-            ).data());
+            mk::debug::aabb(projection - glm::vec3{ 0.25f }, projection + glm::vec3{ 0.25f }, mk::debug::white);
+        }
+        if (show_grid) mk::debug::grid(glm::vec3{ 0.0f }, radius, 1.0f, mk::debug::rgba(0.3f, 0.3f, 0.3f));
+        if (show_origin) mk::debug::axes(glm::identity<glm::mat4>(), 2.0f);
+        if (show_entity_bounds) {
+            // recorded from the workers, every thread fills its own list
+            scene_world.query<const mk::location>().each_parallel(mk::default_thread_pool(), [](mk::ecs::entity, const mk::location &l) {
+                mk::debug::aabb(l.pos - glm::vec3{ 0.5f }, l.pos + glm::vec3{ 0.5f }, mk::debug::rgba(0.2f, 0.9f, 0.4f));
+            });
+        }
+        if (show_light_radii) {
+            for (auto &&light : point_lights) mk::debug::sphere(light.position, light.radius, mk::debug::rgba(light.color.x, light.color.y, light.color.z));
+        }
+        if (show_emitters) {
+            scene_world.query<const mk::location, const mk::particle_emitter>().each([](mk::ecs::entity, const mk::location &l, const mk::particle_emitter &emitter) {
+                mk::debug::line(l.pos, l.pos + glm::vec3{ 0.0f, emitter.speed * 0.5f, 0.0f }, mk::debug::rgba(emitter.color.x, emitter.color.y, emitter.color.z), mk::debug::layer::OVERLAY);
+            });
+        }
+        if (show_transforms) mk::debug::axes(transforms.get_world(sphere_spin), sphere_radius * 1.5f, mk::debug::layer::OVERLAY);
+
+        // per-frame temporaries on the GL thread come from the submitted frame's arena
+        auto &frame_memory = mk::memory::frame_arenas::local(frame->frame_index);
+
+        std::pmr::string title(&frame_memory);
+        std::format_to(std::back_inserter(title), "Coordinates: {}x, {}y, {}z",
+            mk::default_camera.pos.x,
+            mk::default_camera.pos.y,
+            mk::default_camera.pos.z
+        );
+        glfwSetWindowTitle(context.get_window(), title.c_str());
 
         // -- IMGUI
 
@@ -1275,6 +7529,16 @@ int main() {
         ImGui::SliderInt("Stacks", &param_stacks, 1, 64);
         ImGui::SliderFloat3("Position", glm::value_ptr(sphere_pos), -50.0f, 50.0f, "%.3f", 1);
 
+        ImGui::Text("LOD %d of %d, %zu triangles, %.1f px", sphere_lod.level, sphere_lods->get_level_count(),
+            sphere_lods->get_triangle_count(sphere_lod.level), sphere_lod.screen_radius);
+        {
+            const auto &stats = sphere_lods->get_stats(sphere_lod.level);
+            ImGui::Text("Mesh: %zu -> %zu vertices, ACMR %.2f -> %.2f", stats.source_vertices, stats.unique_vertices, stats.acmr_before, stats.acmr_after);
+        }
+        ImGui::SliderFloat("LOD 0 radius (px)", &lod_settings.finest_radius, 16.0f, 1024.0f);
+        ImGui::SliderFloat("Hysteresis", &lod_settings.hysteresis, 0.0f, 0.5f);
+        ImGui::Checkbox("Cross-fade", &lod_settings.cross_fade);
+
         if (param_radius != static_cast<int>(sphere_radius) 
             || param_sectors != static_cast<int>(sector_count) 
             || param_stacks != static_cast<int>(stack_count)) {
@@ -1282,19 +7546,399 @@ int main() {
             sector_count = static_cast<float>(param_sectors);
             stack_count = static_cast<float>(param_stacks);
 
-            __Deprecated_RecreateSphere(sphere_radius, sector_count, stack_count, sphere_vao, sphere_vbo, sphere_ebo, sphere_vertices, sphere_indices);
+            sphere_lods = std::make_unique<mk::lod_chain>(param_sectors, param_stacks);
+            sphere_lod.level = std::min(sphere_lod.level, sphere_lods->get_level_count() - 1);
+            sphere_lod.previous_level = sphere_lod.level;
+            sphere_lod.fade = 1.0f;
+        }
+
+        ImGui::End();
+
+        ImGui::Begin("Memory");
+        if (ImGui::BeginTable("memory_tags", 7)) {
+            for (auto &&column : { "Subsystem", "Host live", "Host peak", "Live blocks", "Allocations", "GPU live", "GPU peak" }) ImGui::TableSetupColumn(column);
+            ImGui::TableHeadersRow();
+            auto kib = [](const std::atomic<std::int64_t> &bytes) { return static_cast<double>(bytes.load(std::memory_order_relaxed)) / 1024.0; };
+            for (std::size_t t = 0; t < mk::memory::tag_count; ++t) {
+                auto &&host = mk::memory::host[t];
+                auto &&gpu = mk::memory::gpu[t];
+                ImGui::TableNextRow();
+                ImGui::TableNextColumn(); ImGui::Text("%s", mk::memory::tag_names[t]);
+                ImGui::TableNextColumn(); ImGui::Text("%.1f KiB", kib(host.live_bytes));
+                ImGui::TableNextColumn(); ImGui::Text("%.1f KiB", kib(host.peak_bytes));
+                ImGui::TableNextColumn(); ImGui::Text("%lld", static_cast<long long>(host.live_count.load(std::memory_order_relaxed)));
+                ImGui::TableNextColumn(); ImGui::Text("%llu", static_cast<unsigned long long>(host.total_count.load(std::memory_order_relaxed)));
+                ImGui::TableNextColumn(); ImGui::Text("%.1f KiB", kib(gpu.live_bytes));
+                ImGui::TableNextColumn(); ImGui::Text("%.1f KiB", kib(gpu.peak_bytes));
+            }
+            ImGui::EndTable();
+        }
+        ImGui::Text("GL objects: %zu buffers, %zu vertex arrays, %zu textures, %zu framebuffers",
+            mk::memory::live_buffers(), mk::memory::live_vertex_arrays(), mk::memory::live_textures(), mk::memory::live_framebuffers());
+        {
+            auto arenas = mk::memory::frame_arenas::get_usage();
+            ImGui::Text("Frame arenas: %zu threads, %.1f KiB reserved, largest frame %.1f KiB, %llu regrowths", arenas.threads,
+                arenas.capacity / 1024.0, arenas.used / 1024.0, static_cast<unsigned long long>(arenas.overflows));
+
+            ImGui::SliderInt("Frames", &allocation_frames, 10, 1000);
+            if (ImGui::Button("Count allocations") && !allocations.is_counting()) allocations.start(allocation_frames);
+            if (allocations.is_counting()) {
+                ImGui::Text("Counting, %d frames left", allocations.get_frames_left());
+            }
+            else if (auto &&result = allocations.get_result()) {
+                ImGui::Text("%llu host allocations over %d frames, %.2f per frame", static_cast<unsigned long long>(result->total), 
+                    result->frames, result->per_frame());
+                for (std::size_t t = 0; t < mk::memory::tag_count; ++t) {
+                    if (result->counts[t] != 0) ImGui::BulletText("%s: %llu", mk::memory::tag_names[t], static_cast<unsigned long long>(result->counts[t]));
+                }
+            }
+        }
+        ImGui::End();
+
+        ImGui::Begin("Transform Hierarchy");
+        {
+            int requested = stress_nodes;
+            ImGui::SliderInt("Stress nodes", &requested, 0, 200000);
+            ImGui::Checkbox("Animate stress root", &animate_stress);
+            if (requested != stress_nodes) {
+                stress_nodes = requested;
+                transforms.destroy(stress_root);
+                stress_root = mk::transform_hierarchy::no_parent;
+                if (stress_nodes > 0) {
+                    std::vector<mk::transform_hierarchy::handle> nodes;
+                    nodes.reserve(static_cast<std::size_t>(stress_nodes));
+                    stress_root = transforms.create();
+                    nodes.push_back(stress_root);
+                    for (int i = 1; i < stress_nodes; ++i) {
+                        float angle = static_cast<float>(i % 4) * glm::radians(90.0f);
+                        nodes.push_back(transforms.create(nodes[(i - 1) / 4], 
+                            { glm::vec3{ std::cos(angle), 0.5f, std::sin(angle) }, glm::identity<glm::quat>(), glm::vec3{ 0.9f } }));
+                    }
+                }
+            }
+            ImGui::Text("%zu nodes in %zu levels, %zu updated", transforms.size(), transforms.get_level_count(), transforms.get_updated_count());
+            ImGui::Text("Update: %.3f ms", hierarchy_ms);
+        }
+        ImGui::End();
+
+        ImGui::Begin("Terrain");
+        {
+            const auto &stats = terrain->get_stats();
+            ImGui::Checkbox("Enabled", &terrain_settings.enabled);
+            ImGui::SameLine();
+            ImGui::Checkbox("Wireframe", &terrain_settings.wireframe);
+            ImGui::SameLine();
+            ImGui::Checkbox("Freeze selection", &terrain_settings.freeze_selection);
+            ImGui::SliderFloat("LOD distance", &terrain_settings.lod_distance, terrain->get_leaf_size() * 2.0f, 1000.0f);
+            ImGui::SliderFloat("Morph start", &terrain_settings.morph_start, 0.0f, 0.95f);
+            ImGui::Text("%.0f m square, %d levels, %.0f m leaves", terrain->get_size(), terrain->get_level_count(), terrain->get_leaf_size());
+            ImGui::Text("Patches: %zu, triangles: %zu, culled nodes: %zu", stats.patches, stats.triangles, stats.culled_nodes);
+            ImGui::Text("Select: %.3f ms, memory: %.1f MiB", stats.select_ms, terrain->get_memory_bytes() / (1024.0f * 1024.0f));
+        }
+        ImGui::End();
+
+        ImGui::Begin("Entities");
+        ImGui::Text("Entities: %zu, location chunks: %zu", scene_world.size(), scene_world.pool<mk::location>().chunk_count());
+        ImGui::Text("Added: %zu, removed: %zu last frame", scene_world.added<mk::location>().size(), scene_world.removed<mk::location>().size());
+        ImGui::Text("GPU instances synced: %zu", gpu_instances_synced);
+        ImGui::Checkbox("Bob GPU-culled instances", &bob_instances);
+        ImGui::SliderInt("Spawn per frame", &spawn_per_frame, 0, 20000);
+        ImGui::SliderFloat("Lifetime (s)", &spawn_lifetime, 0.1f, 10.0f);
+        ImGui::SliderInt("Props", &prop_stamp_count, 1, 100000);
+        ImGui::SameLine();
+        if (ImGui::Button("Stamp prefab")) prop_stamp_request = prop_stamp_count;
+        if (props_stamped > 0) ImGui::Text("Last stamp: %zu props, %.2f ms including the step, culler and batch updates", props_stamped, prop_stamp_ms);
+        ImGui::Separator();
+        ImGui::Text("Materials: %zu of %zu, %zu uploaded last frame", materials.size(), mk::material_buffer::capacity, materials_uploaded);
+        {
+            static int selected = 0;
+            std::pmr::vector<mk::ecs::entity> with_material(&frame_memory);
+            scene_world.query<const mk::material>().each([&](mk::ecs::entity e, const mk::material &) { with_material.push_back(e); });
+            if (!with_material.empty()) {
+                ImGui::SliderInt("Material entity", &selected, 0, static_cast<int>(with_material.size()) - 1);
+                auto entity = with_material[static_cast<std::size_t>(std::clamp(selected, 0, static_cast<int>(with_material.size()) - 1))];
+                auto albedo = scene_world.read<mk::material>(entity).albedo;
+                // only write through get() on an actual edit so untouched chunks keep their version
+                if (ImGui::ColorEdit3("Albedo", glm::value_ptr(albedo))) {
+                    scene_world.get<mk::material>(entity).albedo = albedo;
+                }
+            }
+        }
+        ImGui::End();
+
+        ImGui::Begin("Clustered Lights");
+        {
+            const auto &stats = light_clusters.get_stats();
+            if (ImGui::SliderInt("Point lights", &point_light_count, 0, 8192)) {
+                point_lights = mk::scatter_point_lights(static_cast<std::size_t>(point_light_count), 30.0f);
+            }
+            ImGui::Text("Clusters: %d x %d x %d, %zu occupied", mk::light_clusters::tiles_x, mk::light_clusters::tiles_y,
+                mk::light_clusters::slices, stats.occupied);
+            ImGui::Text("Indices: %zu, at most %zu per cluster", stats.indices, stats.max_per_cluster);
+            ImGui::Text("Assign: %.3f ms", stats.assign_ms);
+        }
+        ImGui::End();
+
+        ImGui::Begin("Occlusion Culling");
+        {
+            static int occlusion_level = 0;
+            static int max_occluders = static_cast<int>(occlusion_settings.max_occluders);
+            const auto &counters = frame->occlusion_counters;
+            ImGui::Checkbox("Enabled", &occlusion_settings.enabled);
+            ImGui::SliderInt("Max occluders", &max_occluders, 1, 64);
+            occlusion_settings.max_occluders = static_cast<std::size_t>(max_occluders);
+            ImGui::Text("Occluders: %zu (%zu triangles)", counters.occluders, counters.triangles);
+            ImGui::Text("Culled: %zu of %zu tested", counters.culled, counters.tested);
+            ImGui::Text("Raster + test: %.3f ms", counters.raster_ms);
+            ImGui::SliderInt("Pyramid level", &occlusion_level, 0, frame->occlusion.get_level_count() - 1);
+            occlusion_view.draw(frame->occlusion, occlusion_level, mk::default_camera.near, mk::default_camera.far);
+        }
+        ImGui::End();
+
+        ImGui::Begin("Static Batching");
+        {
+            const auto &stats = static_batches.get_stats();
+            bool was_batching = static_batching;
+            ImGui::Checkbox("Enabled", &static_batching);
+            bool rebuild = ImGui::SliderFloat("Cell size", &static_cell_size, 1.0f, 64.0f);
+            if (rebuild || was_batching != static_batching) rebuild_static_batches();
+            ImGui::Text("%zu props in %zu batches, %zu drawn", stats.sources, stats.batches, stats.drawn);
+            ImGui::Text("%zu vertices, %zu triangles, %.1f KiB", stats.vertices, stats.triangles, stats.bytes / 1024.0f);
+            ImGui::Text("Build: %.3f ms", stats.build_ms);
+        }
+        ImGui::End();
+
+        ImGui::Begin("Frame Graph");
+        {
+            const auto &stats = render_graph.get_stats();
+            ImGui::Checkbox("Post-processing", &render_settings.post_processing);
+            ImGui::SameLine();
+            ImGui::Checkbox("Bloom", &render_settings.bloom);
+            ImGui::SliderFloat("Bloom threshold", &bloom_threshold, 0.0f, 1.0f);
+            ImGui::SliderFloat("Bloom strength", &bloom_strength, 0.0f, 2.0f);
+            for (auto &&pass : render_graph.get_passes(&frame_memory)) {
+                ImGui::BulletText("%.*s%s", static_cast<int>(pass.name.size()), pass.name.data(), pass.culled ? " (culled)" : "");
+            }
+            ImGui::Text("Passes: %zu, culled %zu", stats.passes, stats.culled);
+            ImGui::Text("Transients: %zu in %zu textures, %.1f of %.1f MiB", stats.transients, stats.textures,
+                stats.allocated_bytes / (1024.0f * 1024.0f), stats.requested_bytes / (1024.0f * 1024.0f));
+            ImGui::Text("Framebuffers: %zu, binds: %zu, clears: %zu", stats.framebuffers, stats.binds, stats.clears);
+        }
+        ImGui::End();
+
+        ImGui::Begin("History");
+        {
+            const auto &history = recorder.get_history();
+            if (ImGui::Checkbox("Record", &record_scene) && !record_scene) recorder.clear();
+            ImGui::Text("Snapshots: %zu of %zu, %.1f KiB held only by history", history.size(), history.capacity(), history.exclusive_bytes() / 1024.0);
+            if (history.size() > 0) {
+                ImGui::SliderInt("Step", &rewind_index, 0, static_cast<int>(history.size()) - 1);
+                if (ImGui::Button("Rewind")) rewind_request = static_cast<std::size_t>(std::clamp(rewind_index, 0, static_cast<int>(history.size()) - 1));
+                ImGui::SameLine();
+                if (ImGui::Button("Replay from oldest")) replay_request = true;
+            }
+            if (replay_matched >= 0) ImGui::Text("Last replay of %zu steps %s the live scene", replay_steps, replay_matched ? "matched" : "diverged from");
+        }
+        ImGui::End();
+
+        ImGui::Begin("Replication");
+        if (replication_host != nullptr) {
+            const auto &stats = replication_host->get_stats();
+            ImGui::Text("Hosting on port %d, %zu clients", replication_port, stats.clients);
+            ImGui::Text("Last frame: %zu records in %zu datagrams, %.1f KiB", stats.records, stats.datagrams, stats.bytes / 1024.0);
+            ImGui::Text("Encode: %.3f ms, pending removals: %zu", stats.encode_ms, stats.pending_removals);
+            ImGui::Text("Connects: %llu, timeouts: %llu, truncated snapshots: %llu", static_cast<unsigned long long>(stats.connects),
+                static_cast<unsigned long long>(stats.timeouts), static_cast<unsigned long long>(stats.truncated));
+        }
+        else if (replication_client != nullptr) {
+            const auto &stats = replication_client->get_stats();
+            ImGui::Text("Viewing port %d: %s", viewer_port, stats.connected ? "connected" : "waiting for host");
+            ImGui::Text("Replicas: %zu, acknowledged tick %llu", stats.replicas, static_cast<unsigned long long>(stats.acked));
+            ImGui::Text("Last frame: %zu records in %zu datagrams, %.1f KiB", stats.records, stats.datagrams, stats.bytes / 1024.0);
+            ImGui::Text("Dropped fragments: %llu, truncated: %llu", static_cast<unsigned long long>(stats.dropped), 
+                static_cast<unsigned long long>(stats.truncated));
+            ImGui::Text("Host sessions: %llu", static_cast<unsigned long long>(stats.sessions));
+        }
+        else {
+            if (ImGui::InputInt("Port", &replication_port)) replication_port = std::clamp(replication_port, 1, 65535);
+            if (ImGui::Button("Host")) {
+                try {
+                    replication_host = std::make_unique<mk::net::replication_host>(static_cast<std::uint16_t>(replication_port));
+                    replication_error.clear();
+                }
+                catch (const std::runtime_error &error) {
+                    replication_error = error.what();
+                }
+            }
+            if (!replication_error.empty()) ImGui::Text("%s", replication_error.c_str());
+            ImGui::Text("Viewers start with --viewer <port>");
+        }
+        ImGui::End();
+
+        ImGui::Begin("Debug Draw");
+        {
+            const auto &stats = debug_lines.get_stats();
+            ImGui::Checkbox("Grid", &show_grid);
+            ImGui::SameLine();
+            ImGui::Checkbox("Origin", &show_origin);
+            ImGui::SameLine();
+            ImGui::Checkbox("Sphere transform", &show_transforms);
+            ImGui::Checkbox("Entity bounds", &show_entity_bounds);
+            ImGui::SameLine();
+            ImGui::Checkbox("Light radii", &show_light_radii);
+            ImGui::SameLine();
+            ImGui::Checkbox("Emitters", &show_emitters);
+            ImGui::Text("Lines: %zu depth-tested, %zu overlay from %zu threads", stats.vertices[0] / 2, stats.vertices[1] / 2, stats.threads);
+            ImGui::Text("Upload: %.2f ms", stats.upload_ms);
+        }
+        ImGui::End();
+
+        ImGui::Begin("Particles");
+        {
+            const auto &stats = particles.get_stats();
+            ImGui::Checkbox("Simulate", &simulate_particles);
+            ImGui::SliderFloat("Size", &particle_size, 0.01f, 0.5f);
+            ImGui::Text("Alive: %zu of %zu, %zu emitters", stats.alive, particles.get_capacity(), stats.emitters);
+            ImGui::Text("Last frame: %zu spawned, %zu died, %zu dropped", stats.spawned, stats.died, stats.dropped);
+            ImGui::Text("Emit %.2f ms, simulate %.2f ms, upload %.2f ms", stats.emit_ms, stats.simulate_ms, stats.upload_ms);
+            ImGui::Text("Memory: %.1f MiB", particles.get_memory_bytes() / (1024.0 * 1024.0));
+            ImGui::SliderFloat("Rate", &emitter_settings.rate, 0.0f, 1000000.0f, "%.0f/s");
+            ImGui::SliderFloat("Lifetime", &emitter_settings.lifetime, 0.1f, 10.0f);
+            ImGui::SliderFloat("Speed", &emitter_settings.speed, 0.0f, 30.0f);
+            ImGui::SliderFloat("Spread", &emitter_settings.spread, 0.0f, 1.0f);
+            ImGui::ColorEdit3("Color", glm::value_ptr(emitter_settings.color));
+            if (ImGui::Button("Add emitter")) {
+                float angle = static_cast<float>(next_emitter_seed) * 2.39996f;
+                add_emitter(glm::vec3{ 12.0f * std::cos(angle), 0.0f, 12.0f * std::sin(angle) });
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Apply to all")) {
+                scene_world.query<mk::particle_emitter>().each([&](mk::ecs::entity, mk::particle_emitter &emitter) {
+                    auto seed = emitter.seed;
+                    emitter = emitter_settings;
+                    emitter.seed = seed;
+                });
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Remove emitters")) {
+                std::vector<mk::ecs::entity> emitters;
+                scene_world.query<const mk::particle_emitter>().each([&](mk::ecs::entity e, const mk::particle_emitter &) { emitters.push_back(e); });
+                for (auto e : emitters) scene_world.destroy(e);
+                particles.clear();
+            }
+        }
+        ImGui::End();
+
+        ImGui::Begin("Capture");
+        {
+            auto stats = capture.get_stats();
+            ImGui::Checkbox("Capture frames", &render_settings.capture);
+            ImGui::SameLine();
+            ImGui::Checkbox("Include UI", &render_settings.capture_ui);
+            int format = static_cast<int>(capture.get_format());
+            ImGui::RadioButton("PNG", &format, static_cast<int>(mk::capture_format::PNG));
+            ImGui::SameLine();
+            ImGui::RadioButton("Raw RGBA", &format, static_cast<int>(mk::capture_format::RAW));
+            capture.set_format(static_cast<mk::capture_format>(format));
+            ImGui::Text("Directory: %s", capture.get_directory().string().c_str());
+            ImGui::Text("Frames: %llu requested, %llu written, %llu dropped, %llu failed", static_cast<unsigned long long>(stats.requested),
+                static_cast<unsigned long long>(stats.written), static_cast<unsigned long long>(stats.dropped), 
+                static_cast<unsigned long long>(stats.failed));
+            ImGui::Text("In flight: %zu of %zu, queued: %zu, last write %.1f ms", stats.in_flight, mk::frame_capture::ring, stats.queued, stats.write_ms);
         }
+        ImGui::End();
 
+        ImGui::Begin("Frame Pipeline");
+        const auto &telemetry = pipeline.telemetry();
+        ImGui::SliderInt("Depth", &pipeline_depth, mk::frame_pipeline::min_depth, mk::frame_pipeline::max_depth);
+        ImGui::Text("Draws: %zu (culled %zu)", frame->draws.size(), frame->culled);
+        if (indirect_renderer != nullptr) {
+            ImGui::Checkbox("Multi-draw indirect", &use_indirect);
+            ImGui::SameLine();
+            ImGui::Text("%zu commands", use_indirect ? indirect_renderer->get_command_count() : std::size_t{ 0 });
+            ImGui::Checkbox("GPU culling", &use_gpu_culling);
+            ImGui::SameLine();
+            ImGui::Text("%zu instances", gpu_culler->get_instance_count());
+            if (ImGui::Button("Validate GPU culling")) culling_validation = gpu_culler->validate(frame->view_projection);
+            if (culling_validation) {
+                ImGui::SameLine();
+                if (culling_validation->mismatched == 0) ImGui::Text("matches CPU reference, %zu visible", culling_validation->visible);
+                else ImGui::Text("%zu of %zu commands differ: %zu visible, expected %zu", culling_validation->mismatched,
+                    culling_validation->commands, culling_validation->visible, culling_validation->expected);
+            }
+        }
+        else {
+            ImGui::Text("Multi-draw indirect: unavailable, GL 4.3 required");
+        }
+        ImGui::Checkbox("Late latching", &late_latching);
+        ImGui::SameLine();
+        if (ImGui::Checkbox("Pace frames", &pace_frames)) pacer.reset();
+        if (ImGui::SliderFloat("Target rate", &pace_rate, 24.0f, 240.0f, "%.0f Hz")) pacer.set_rate(pace_rate);
+        if (pace_frames) {
+            const auto &pacing = pacer.get_stats();
+            ImGui::Text("Slept %.2f ms, work %.2f ms, oversleep %.2f ms, %llu missed", pacing.slept_ms, pacing.work_ms, pacing.oversleep_ms,
+                static_cast<unsigned long long>(pacing.missed));
+        }
+        ImGui::Text("Input to present: %.2f ms (frame built from input %.2f ms before present)",
+            telemetry.average(telemetry.latency_ms), telemetry.average(telemetry.built_ms));
+        ImGui::PlotLines("Latency", telemetry.latency_ms.data(), mk::frame_telemetry::history, static_cast<int>(telemetry.cursor));
+        ImGui::Text("Simulate: %.2f ms", telemetry.average(telemetry.simulate_ms));
+        ImGui::Text("Submit: %.2f ms", telemetry.average(telemetry.submit_ms));
         ImGui::End();
 
         ImGui::Render();
-        int display_w, display_h;
-        glfwGetFramebufferSize(context.get_window(), &display_w, &display_h);
-        ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
         // -- END OF IMGUI
 
+        // -- RENDER: recompiled only when the configuration changes
+        render_settings.width = framebuffer_width;
+        render_settings.height = framebuffer_height;
+        if (render_settings != compiled_render_config) {
+            mk::memory::scope tag(mk::memory::tag::SCENE);
+            build_render_graph(render_settings);
+            compiled_render_config = render_settings;
+        }
+        debug_lines.upload();
+
+        // -- LATE LATCH: sleep off the slack, then sample the camera once more and correct what the frame was built with
+        if (pace_frames && late_latching) pacer.wait();
+        if (late_latching) {
+            glfwPollEvents();
+            handle_input(context.get_window());
+            frame->latched = mk::frame_clock::now();
+            camera_latch.latch(frame->view, frame->projection, mk::default_camera.get_view(), mk::default_camera.get_perspective());
+        }
+        else {
+            camera_latch.reset();
+        }
+        camera_latch.bind();
+
+        render_graph.execute();
+        capture.poll();
+
         glfwSwapBuffers(context.get_window());
+        pipeline.present(*frame);
+        if (pace_frames) pacer.presented();
+        scene_world.end_frame();
         glfwPollEvents();
+
+        if (pipeline_depth != pipeline.get_depth()) {
+            pipeline.set_depth(pipeline_depth);
+        }
+
+        if (allocations.end_frame() && check_allocations > 0) {
+            auto &&result = *allocations.get_result();
+            if (result.total != 0) {
+                std::cerr << "Steady-state frames allocated " << result.total << " times over " << result.frames << " frames\n";
+                for (std::size_t t = 0; t < mk::memory::tag_count; ++t) {
+                    if (result.counts[t] != 0) std::cerr << "  " << mk::memory::tag_names[t] << ": " << result.counts[t] << '\n';
+                }
+                exit_code = EXIT_FAILURE;
+            }
+            break;
+        }
     }
+
+    mk::memory::delete_vertex_arrays(1, &fullscreen_vao);
+    return exit_code;
 }
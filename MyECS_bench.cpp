@@ -0,0 +1,260 @@
+﻿/*
+ * ECS micro-benchmarks. Needs no window or GL context, only ecs.hpp and thread_pool.hpp:
+ *
+ *   MyECS_bench [--sizes 1000,100000,10000000] [--threads N]
+ *
+ * Every result is one JSON object per line on stdout so runs can be diffed or plotted. The "baseline"
+ * implementation mirrors gl_scene: an unordered_map from id to shared_ptr of a polymorphic node.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ecs.hpp"
+
+namespace bench {
+    struct position { float x, y, z; };
+    struct velocity { float x, y, z; };
+    struct health { float value; };
+    struct tag { std::uint32_t value; };
+
+    /* Stand-in for mk::geo::geometry: heap allocated, virtual, owned through shared_ptr. */
+    class baseline_node {
+    public:
+        virtual ~baseline_node() = default;
+        virtual void update(float dt) {
+            pos.x += vel.x * dt;
+            pos.y += vel.y * dt;
+            pos.z += vel.z * dt;
+        }
+
+        position pos{};
+        velocity vel{ 1.0f, 0.0f, 0.0f };
+        health hp{ 100.0f };
+        tag flags{ 0 };
+    };
+
+    using baseline_scene = std::unordered_map<std::size_t, std::shared_ptr<baseline_node>>;
+
+    struct result {
+        std::string_view name;
+        std::string_view implementation;
+        std::size_t entities;
+        std::size_t threads;
+        double total_ms;
+        double ns_per_op;
+    };
+
+    void emit(const result &r) {
+        std::cout << "{\"bench\":\"" << r.name << "\",\"impl\":\"" << r.implementation
+            << "\",\"entities\":" << r.entities << ",\"threads\":" << r.threads
+            << ",\"total_ms\":" << r.total_ms << ",\"ns_per_op\":" << r.ns_per_op << "}\n";
+    }
+
+    /*
+     * Runs setup() then body() until at least three samples and 200 ms are collected, or once for
+     * runs that take longer than that, and reports the fastest sample.
+     */
+    result measure(std::string_view name, std::string_view implementation, std::size_t entities, std::size_t threads,
+                   std::size_t ops, const std::function<void()> &setup, const std::function<void()> &body) {
+        using clock = std::chrono::steady_clock;
+        double best = std::numeric_limits<double>::max();
+        double spent = 0.0;
+        for (int sample = 0; sample < 3 || spent < 200.0; ++sample) {
+            setup();
+            auto start = clock::now();
+            body();
+            double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+            best = std::min(best, ms);
+            spent += ms;
+            if (sample == 0 && ms > 200.0) break;
+        }
+        result r{ name, implementation, entities, threads, best, best * 1e6 / static_cast<double>(std::max<std::size_t>(ops, 1)) };
+        emit(r);
+        return r;
+    }
+
+    void populate(mk::ecs::world &world, std::size_t count, int components, std::vector<mk::ecs::entity> *handles = nullptr) {
+        for (std::size_t i = 0; i < count; ++i) {
+            auto e = world.create();
+            world.emplace<position>(e, 0.0f, 0.0f, 0.0f);
+            if (components > 1) world.emplace<velocity>(e, 1.0f, 0.0f, 0.0f);
+            if (components > 2) world.emplace<health>(e, 100.0f);
+            if (components > 3) world.emplace<tag>(e, std::uint32_t{ 0 });
+            if (handles) handles->push_back(e);
+        }
+    }
+
+    void populate(baseline_scene &scene, std::size_t count) {
+        scene.reserve(count);
+        for (std::size_t i = 0; i < count; ++i) scene.emplace(i + 1, std::make_shared<baseline_node>());
+    }
+
+    /* Keeps the optimizer from dropping loops whose result is otherwise unused. */
+    volatile float sink;
+
+    void create_destroy(std::size_t n) {
+        std::unique_ptr<mk::ecs::world> world;
+        std::vector<mk::ecs::entity> handles;
+        measure("create", "ecs", n, 1, n, [&] { world = std::make_unique<mk::ecs::world>(); handles.clear(); handles.reserve(n); },
+            [&] { populate(*world, n, 1, &handles); });
+        mk::ecs::prefab prefab;
+        prefab.set<position>(0.0f, 0.0f, 0.0f);
+        measure("instantiate", "ecs", n, 1, n, [&] { world = std::make_unique<mk::ecs::world>(); },
+            [&] { handles = world->instantiate(prefab, n); });
+        measure("destroy", "ecs", n, 1, n, [&] { world = std::make_unique<mk::ecs::world>(); handles.clear(); populate(*world, n, 1, &handles); },
+            [&] { for (auto e : handles) world->destroy(e); });
+
+        std::unique_ptr<baseline_scene> scene;
+        measure("create", "baseline", n, 1, n, [&] { scene = std::make_unique<baseline_scene>(); }, [&] { populate(*scene, n); });
+        measure("destroy", "baseline", n, 1, n, [&] { scene = std::make_unique<baseline_scene>(); populate(*scene, n); }, [&] { for (std::size_t i = 0; i < n; ++i) scene->erase(i + 1); });
+    }
+
+    void add_remove(std::size_t n) {
+        mk::ecs::world world;
+        std::vector<mk::ecs::entity> handles;
+        populate(world, n, 1, &handles);
+        measure("add_component", "ecs", n, 1, n, [&] { for (auto e : handles) world.remove<health>(e); },
+            [&] { for (auto e : handles) world.emplace<health>(e, 1.0f); });
+        measure("remove_component", "ecs", n, 1, n, [&] { for (auto e : handles) if (!world.has<health>(e)) world.emplace<health>(e, 1.0f); },
+            [&] { for (auto e : handles) world.remove<health>(e); });
+    }
+
+    void iterate(std::size_t n) {
+        mk::ecs::world world;
+        populate(world, n, 4);
+        measure("iterate_1", "ecs", n, 1, n, [] {}, [&] {
+            float sum = 0.0f;
+            world.query<const position>().each([&](mk::ecs::entity, const position &p) { sum += p.x; });
+            sink = sum;
+        });
+        measure("iterate_2", "ecs", n, 1, n, [] {}, [&] {
+            world.query<position, const velocity>().each([](mk::ecs::entity, position &p, const velocity &v) {
+                p.x += v.x; p.y += v.y; p.z += v.z;
+            });
+        });
+        measure("iterate_4", "ecs", n, 1, n, [] {}, [&] {
+            world.query<position, const velocity, health, const tag>().each([](mk::ecs::entity, position &p, const velocity &v, health &h, const tag &t) {
+                p.x += v.x; p.y += v.y; p.z += v.z;
+                h.value -= static_cast<float>(t.value & 1);
+            });
+        });
+
+        baseline_scene scene;
+        populate(scene, n);
+        measure("iterate_1", "baseline", n, 1, n, [] {}, [&] {
+            float sum = 0.0f;
+            for (auto &&[_, node] : scene) sum += node->pos.x;
+            sink = sum;
+        });
+        measure("iterate_2", "baseline", n, 1, n, [] {}, [&] {
+            for (auto &&[_, node] : scene) node->update(1.0f);
+        });
+        measure("iterate_4", "baseline", n, 1, n, [] {}, [&] {
+            for (auto &&[_, node] : scene) {
+                node->update(1.0f);
+                node->hp.value -= static_cast<float>(node->flags.value & 1);
+            }
+        });
+    }
+
+    void random_access(std::size_t n) {
+        std::mt19937 rng(42);
+        mk::ecs::world world;
+        std::vector<mk::ecs::entity> handles;
+        populate(world, n, 2, &handles);
+        std::shuffle(handles.begin(), handles.end(), rng);
+        measure("random_access", "ecs", n, 1, n, [] {}, [&] {
+            float sum = 0.0f;
+            for (auto e : handles) sum += world.read<position>(e).x;
+            sink = sum;
+        });
+
+        baseline_scene scene;
+        populate(scene, n);
+        std::vector<std::size_t> ids(n);
+        std::iota(ids.begin(), ids.end(), std::size_t{ 1 });
+        std::shuffle(ids.begin(), ids.end(), rng);
+        measure("random_access", "baseline", n, 1, n, [] {}, [&] {
+            float sum = 0.0f;
+            for (auto id : ids) sum += scene.find(id)->second->pos.x;
+            sink = sum;
+        });
+    }
+
+    void query_construction(std::size_t n) {
+        mk::ecs::world world;
+        populate(world, n, 4);
+        constexpr std::size_t queries = 100000;
+        // only O(1) work on the view, so the result does not grow with the chunk count
+        measure("query_construction", "ecs", n, 1, queries, [] {}, [&] {
+            std::size_t chunks = 0;
+            for (std::size_t i = 0; i < queries; ++i) chunks += world.query<position, const velocity, const health>().changed_since(1).chunk_count();
+            sink = static_cast<float>(chunks);
+        });
+        measure("changed_chunk_scan", "ecs", n, 1, n, [] {}, [&] {
+            sink = static_cast<float>(world.query<position, const velocity, const health>().changed_since(1).changed_chunk_count());
+        });
+    }
+
+    void parallel_scaling(std::size_t n, std::size_t max_threads) {
+        mk::ecs::world world;
+        populate(world, n, 2);
+        auto update = [](mk::ecs::entity, position &p, const velocity &v) {
+            p.x += v.x; p.y += v.y; p.z += v.z;
+        };
+        measure("parallel_iterate_2", "ecs", n, 1, n, [] {}, [&] { world.query<position, const velocity>().each(update); });
+        for (std::size_t threads = 2; threads <= max_threads; threads *= 2) {
+            // the caller participates in parallel_for, so the pool gets one fewer worker
+            mk::thread_pool pool(threads - 1);
+            measure("parallel_iterate_2", "ecs", n, threads, n, [] {}, [&] {
+                world.query<position, const velocity>().each_parallel(pool, update);
+            });
+        }
+    }
+
+    std::vector<std::size_t> parse_sizes(std::string_view list) {
+        std::vector<std::size_t> sizes;
+        while (!list.empty()) {
+            auto comma = list.find(',');
+            sizes.push_back(std::stoull(std::string(list.substr(0, comma))));
+            list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+        }
+        return sizes;
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::size_t> sizes{ 1'000, 100'000, 10'000'000 };
+    std::size_t max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string_view option = argv[i];
+        if (option == "--sizes") sizes = bench::parse_sizes(argv[i + 1]);
+        else if (option == "--threads") max_threads = std::max<std::size_t>(std::stoull(argv[i + 1]), 1);
+        else {
+            std::cerr << "Unknown option " << option << '\n';
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (auto n : sizes) {
+        bench::create_destroy(n);
+        bench::add_remove(n);
+        bench::iterate(n);
+        bench::random_access(n);
+        bench::query_construction(n);
+        bench::parallel_scaling(n, max_threads);
+    }
+}
@@ -0,0 +1,943 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace mk::ecs {
+    /*
+     * Change ticks. Every mutable access stamps the touched chunk with world::now(); a reader that
+     * remembers the tick returned by world::checkpoint() sees exactly the writes made after it.
+     */
+    using tick = std::uint64_t;
+
+    struct entity {
+        static constexpr std::uint32_t invalid_index = std::numeric_limits<std::uint32_t>::max();
+
+        std::uint32_t index = invalid_index;
+        std::uint32_t generation = 0;
+
+        bool operator==(const entity &) const = default;
+        explicit operator bool() const noexcept { return index != invalid_index; }
+    };
+
+    inline constexpr std::size_t chunk_size = 256;
+
+    namespace detail {
+        inline std::size_t next_component_id() {
+            static std::atomic<std::size_t> next{ 0 };
+            return next.fetch_add(1);
+        }
+    }
+
+    template <typename T>
+    std::size_t component_id() {
+        static const std::size_t id = detail::next_component_id();
+        return id;
+    }
+
+    class pool_base {
+    public:
+        virtual ~pool_base() = default;
+        virtual bool contains(entity e) const noexcept = 0;
+        virtual bool remove(entity e, tick now) = 0;
+        virtual void end_frame() = 0;
+        virtual std::size_t size() const noexcept = 0;
+
+        /* A frozen copy sharing every chunk with this pool; see world::capture(). */
+        virtual std::unique_ptr<pool_base> share() const = 0;
+        /* Takes over the chunks of a pool made by share() and rebuilds the sparse index from them. */
+        virtual void assign(const pool_base &frozen) = 0;
+        virtual void clear() = 0;
+        /* Chunk memory nobody but this pool holds on to. */
+        virtual std::size_t exclusive_bytes() const noexcept = 0;
+    };
+
+    /*
+     * Sparse set: m_sparse maps an entity index to its dense slot, components are packed in chunks
+     * of chunk_size with one change version each. Removal swaps the last component into the hole,
+     * so both affected chunks count as changed.
+     *
+     * Chunks are shared with snapshots and copied on the first write after one is taken. Writes
+     * from view::each_parallel() are made safe by detaching the chunks up front, see view.
+     */
+    template <typename T>
+    class component_pool final : public pool_base {
+    public:
+        static constexpr std::uint32_t npos = std::numeric_limits<std::uint32_t>::max();
+
+        template <typename... Args>
+        T &emplace(entity e, tick now, Args &&...args) {
+            if (contains(e)) throw std::runtime_error("Entity already has this component.");
+            if (e.index >= m_sparse.size()) m_sparse.resize(static_cast<std::size_t>(e.index) + 1, { npos, 0 });
+
+            std::size_t slot = m_size;
+            if (slot % chunk_size == 0) {
+                m_chunks.push_back(std::make_shared<chunk>());
+                m_chunks.back()->data.reserve(chunk_size);
+                m_chunks.back()->entities.reserve(chunk_size);
+            }
+            auto &&c = writable(m_chunks.size() - 1);
+            c.data.emplace_back(std::forward<Args>(args)...);
+            c.entities.push_back(e);
+            c.version.store(now, std::memory_order_relaxed);
+            m_sparse[e.index] = { static_cast<std::uint32_t>(slot), e.generation };
+            ++m_size;
+            m_added.push_back(e);
+            return c.data.back();
+        }
+
+        /* Adds `value` to every entity in `targets`; see append(). */
+        void emplace_n(std::span<const entity> targets, tick now, const T &value) {
+            append(targets, now, [&](std::vector<T> &data, std::size_t, std::size_t count) { data.insert(data.end(), count, value); });
+        }
+
+        /* Adds values[i] to targets[i]. */
+        void emplace_n(std::span<const entity> targets, tick now, std::span<const T> values) {
+            if (values.size() != targets.size()) throw std::runtime_error("Need one component per entity.");
+            append(targets, now, [&](std::vector<T> &data, std::size_t first, std::size_t count) {
+                data.insert(data.end(), values.begin() + static_cast<std::ptrdiff_t>(first), values.begin() + static_cast<std::ptrdiff_t>(first + count));
+            });
+        }
+
+        bool remove(entity e, tick now) override {
+            if (!contains(e)) return false;
+            std::size_t slot = m_sparse[e.index].slot;
+            std::size_t last = m_size - 1;
+            auto &&back = writable(m_chunks.size() - 1);
+            if (slot != last) {
+                auto &&hole = writable(slot / chunk_size);
+                hole.data[slot % chunk_size] = std::move(back.data.back());
+                hole.entities[slot % chunk_size] = back.entities.back();
+                m_sparse[back.entities.back().index].slot = static_cast<std::uint32_t>(slot);
+                hole.version.store(now, std::memory_order_relaxed);
+            }
+            back.data.pop_back();
+            back.entities.pop_back();
+            if (back.data.empty()) m_chunks.pop_back();
+            else back.version.store(now, std::memory_order_relaxed);
+            --m_size;
+            m_sparse[e.index].slot = npos;
+            m_removed.push_back(e);
+            return true;
+        }
+
+        bool contains(entity e) const noexcept override {
+            return e.index < m_sparse.size() && m_sparse[e.index].slot != npos && m_sparse[e.index].generation == e.generation;
+        }
+
+        /* Mutable access marks the entity's chunk as changed at `now`. */
+        T &get(entity e, tick now) {
+            std::size_t slot = m_sparse[e.index].slot;
+            auto &&c = writable(slot / chunk_size);
+            c.version.store(now, std::memory_order_relaxed);
+            return c.data[slot % chunk_size];
+        }
+
+        const T &read(entity e) const {
+            std::size_t slot = m_sparse[e.index].slot;
+            return m_chunks[slot / chunk_size]->data[slot % chunk_size];
+        }
+
+        /* Makes room for `count` components in total so bulk insertion does not reallocate on the way. */
+        void reserve(std::size_t count) {
+            m_chunks.reserve((count + chunk_size - 1) / chunk_size);
+        }
+
+        std::size_t size() const noexcept override { return m_size; }
+        std::size_t chunk_count() const noexcept { return m_chunks.size(); }
+        tick chunk_version(std::size_t c) const noexcept { return m_chunks[c]->version.load(std::memory_order_relaxed); }
+
+        std::span<T> chunk_data(std::size_t c, tick now) {
+            auto &&data = writable(c);
+            data.version.store(now, std::memory_order_relaxed);
+            return data.data;
+        }
+
+        std::span<const T> chunk_data(std::size_t c) const { return m_chunks[c]->data; }
+
+        std::span<const entity> chunk_entities(std::size_t c) const { return m_chunks[c]->entities; }
+
+        /* Copies every chunk still shared with a snapshot; no-op for chunks this pool owns alone. */
+        void detach() {
+            for (std::size_t c = 0; c < m_chunks.size(); ++c) writable(c);
+        }
+
+        /*
+         * Entities that gained or lost the component during the previous frame. An entity can be in
+         * both lists if it was added and removed within the same frame.
+         */
+        std::span<const entity> added() const noexcept { return m_added_last; }
+        std::span<const entity> removed() const noexcept { return m_removed_last; }
+
+        void end_frame() override {
+            std::swap(m_added, m_added_last);
+            std::swap(m_removed, m_removed_last);
+            m_added.clear();
+            m_removed.clear();
+        }
+
+        std::unique_ptr<pool_base> share() const override {
+            m_shared = true;
+            auto frozen = std::make_unique<component_pool<T>>();
+            frozen->m_chunks = m_chunks;
+            frozen->m_size = m_size;
+            return frozen;
+        }
+
+        /* Reports what the swap adds and removes through this frame's added/removed lists. */
+        void assign(const pool_base &frozen) override {
+            auto &&source = static_cast<const component_pool<T> &>(frozen);
+            for (auto &&c : source.m_chunks) {
+                for (auto e : c->entities) {
+                    if (!contains(e)) m_added.push_back(e);
+                }
+            }
+            std::vector<entity> before;
+            before.reserve(m_size);
+            for (auto &&c : m_chunks) before.insert(before.end(), c->entities.begin(), c->entities.end());
+
+            m_chunks = source.m_chunks;
+            m_size = source.m_size;
+            m_shared = true;
+            std::fill(m_sparse.begin(), m_sparse.end(), sparse_entry{ npos, 0 });
+            for (std::size_t c = 0; c < m_chunks.size(); ++c) {
+                auto &&entities = m_chunks[c]->entities;
+                for (std::size_t i = 0; i < entities.size(); ++i) {
+                    if (entities[i].index >= m_sparse.size()) m_sparse.resize(static_cast<std::size_t>(entities[i].index) + 1, { npos, 0 });
+                    m_sparse[entities[i].index] = { static_cast<std::uint32_t>(c * chunk_size + i), entities[i].generation };
+                }
+            }
+            for (auto e : before) {
+                if (!contains(e)) m_removed.push_back(e);
+            }
+        }
+
+        /* Every component is reported removed this frame. */
+        void clear() override {
+            for (auto &&c : m_chunks) m_removed.insert(m_removed.end(), c->entities.begin(), c->entities.end());
+            m_chunks.clear();
+            m_size = 0;
+            std::fill(m_sparse.begin(), m_sparse.end(), sparse_entry{ npos, 0 });
+        }
+
+        std::size_t exclusive_bytes() const noexcept override {
+            std::size_t bytes = 0;
+            for (auto &&c : m_chunks) {
+                if (c.use_count() == 1) bytes += sizeof(chunk) + c->data.capacity() * sizeof(T) + c->entities.capacity() * sizeof(entity);
+            }
+            return bytes;
+        }
+
+    private:
+        /*
+         * Bulk emplace: checks every target up front, grows the sparse index once and fills the tail
+         * chunk by whole runs with fill(data, first, count), `first` being the offset into `targets`.
+         */
+        template <typename Fill>
+        void append(std::span<const entity> targets, tick now, Fill &&fill) {
+            std::size_t sparse_size = m_sparse.size();
+            for (auto e : targets) {
+                if (contains(e)) throw std::runtime_error("Entity already has this component.");
+                sparse_size = std::max(sparse_size, static_cast<std::size_t>(e.index) + 1);
+            }
+            m_sparse.resize(sparse_size, { npos, 0 });
+            reserve(m_size + targets.size());
+
+            for (std::size_t first = 0; first < targets.size();) {
+                if (m_size % chunk_size == 0) {
+                    m_chunks.push_back(std::make_shared<chunk>());
+                    m_chunks.back()->data.reserve(chunk_size);
+                    m_chunks.back()->entities.reserve(chunk_size);
+                }
+                auto &&c = writable(m_chunks.size() - 1);
+                std::size_t count = std::min(chunk_size - m_size % chunk_size, targets.size() - first);
+                fill(c.data, first, count);
+                c.entities.insert(c.entities.end(), targets.begin() + static_cast<std::ptrdiff_t>(first), targets.begin() + static_cast<std::ptrdiff_t>(first + count));
+                c.version.store(now, std::memory_order_relaxed);
+                for (std::size_t i = 0; i < count; ++i) {
+                    auto e = targets[first + i];
+                    m_sparse[e.index] = { static_cast<std::uint32_t>(m_size + i), e.generation };
+                }
+                m_size += count;
+                first += count;
+            }
+            m_added.insert(m_added.end(), targets.begin(), targets.end());
+        }
+
+        struct chunk {
+            std::vector<T> data;
+            std::vector<entity> entities;
+            std::atomic<tick> version{ 0 };     // parallel queries stamp chunks of other pools concurrently
+
+            chunk() = default;
+            chunk(const chunk &other) : data(other.data), entities(other.entities), version(other.version.load(std::memory_order_relaxed)) { }
+        };
+
+        struct sparse_entry {
+            std::uint32_t slot;
+            std::uint32_t generation;
+        };
+
+        chunk &writable(std::size_t c) {
+            if (m_shared && m_chunks[c].use_count() > 1) m_chunks[c] = std::make_shared<chunk>(*m_chunks[c]);
+            return *m_chunks[c];
+        }
+
+        std::vector<sparse_entry> m_sparse;
+        std::vector<std::shared_ptr<chunk>> m_chunks;
+        std::size_t m_size = 0;
+        mutable bool m_shared = false;          // set once any chunk was handed to a snapshot
+        std::vector<entity> m_added, m_added_last;
+        std::vector<entity> m_removed, m_removed_last;
+    };
+
+    class world;
+
+    namespace detail {
+        inline constexpr std::size_t entity_page_size = 4096;
+
+        /* Generations plus an intrusive free list, so the entity table can be shared like chunks. */
+        struct entity_page {
+            std::array<std::uint32_t, entity_page_size> generations{};
+            std::array<std::uint32_t, entity_page_size> next_free{};
+        };
+    }
+
+    /*
+     * A world frozen at one tick. It shares every chunk and entity page with the world it was
+     * captured from; the world copies a chunk the first time it writes to it afterwards, so a
+     * capture costs a pointer per chunk and a snapshot's memory grows with what changed since.
+     */
+    class snapshot {
+    public:
+        tick at() const noexcept { return m_tick; }
+        std::size_t size() const noexcept { return m_alive; }
+
+        /* Chunks and pages that only this snapshot keeps alive; what it shares with others is not counted. */
+        std::size_t exclusive_bytes() const noexcept {
+            std::size_t bytes = 0;
+            for (auto &&p : m_pages) {
+                if (p.use_count() == 1) bytes += sizeof(detail::entity_page);
+            }
+            for (auto &&p : m_pools) {
+                if (p) bytes += p->exclusive_bytes();
+            }
+            return bytes;
+        }
+
+    private:
+        friend class world;
+
+        tick m_tick = 0;
+        std::vector<std::shared_ptr<detail::entity_page>> m_pages;
+        std::uint32_t m_index_count = 0;
+        std::uint32_t m_free_head = 0;
+        std::size_t m_alive = 0;
+        std::vector<std::unique_ptr<pool_base>> m_pools;
+    };
+
+    /*
+     * Records structural changes so they can be issued while a query is iterating, from whichever
+     * thread owns the buffer. create() returns a pending entity that is only meaningful to this
+     * buffer until playback assigns the real one.
+     */
+    class command_buffer {
+    public:
+        static constexpr std::uint32_t pending_generation = std::numeric_limits<std::uint32_t>::max();
+
+        entity create() {
+            return { static_cast<std::uint32_t>(m_created++), pending_generation };
+        }
+
+        void destroy(entity e) {
+            m_destroyed.push_back(e);
+        }
+
+        /* Adds the component, or replaces it if the entity already has one. */
+        template <typename T, typename... Args>
+        void emplace(entity e, Args &&...args) {
+            auto &&components = staged<T>();
+            components.targets.push_back(e);
+            components.values.emplace_back(std::forward<Args>(args)...);
+        }
+
+        template <typename T>
+        void remove(entity e) {
+            m_removed.push_back({ e, component_id<T>() });
+        }
+
+        bool empty() const noexcept {
+            return m_created == 0 && m_removed.empty() && m_destroyed.empty()
+                && std::all_of(m_staged.begin(), m_staged.end(), [](auto &&s) { return !s || s->size() == 0; });
+        }
+
+        void clear() {
+            m_created = 0;
+            for (auto &&s : m_staged) {
+                if (s) s->clear();
+            }
+            m_removed.clear();
+            m_destroyed.clear();
+        }
+
+    private:
+        friend class command_queue;
+
+        struct staged_base {
+            virtual ~staged_base() = default;
+            virtual std::size_t size() const noexcept = 0;
+            virtual void reserve(world &w, std::size_t additional) = 0;
+            virtual void apply(world &w, std::span<const entity> created) = 0;
+            virtual void clear() noexcept = 0;
+        };
+
+        template <typename T>
+        struct staged_components final : staged_base {
+            std::vector<entity> targets;
+            std::vector<T> values;
+
+            std::size_t size() const noexcept override { return targets.size(); }
+            void reserve(world &w, std::size_t additional) override;
+            void apply(world &w, std::span<const entity> created) override;
+            void clear() noexcept override {
+                targets.clear();
+                values.clear();
+            }
+        };
+
+        template <typename T>
+        staged_components<T> &staged() {
+            auto id = component_id<T>();
+            if (id >= m_staged.size()) m_staged.resize(id + 1);
+            if (!m_staged[id]) m_staged[id] = std::make_unique<staged_components<T>>();
+            return static_cast<staged_components<T> &>(*m_staged[id]);
+        }
+
+        static entity resolve(entity e, std::span<const entity> created) {
+            return e.generation == pending_generation ? created[e.index] : e;
+        }
+
+        std::size_t m_created = 0;
+        std::vector<std::unique_ptr<staged_base>> m_staged;     // indexed by component id
+        std::vector<std::pair<entity, std::size_t>> m_removed;
+        std::vector<entity> m_destroyed;
+    };
+
+    /*
+     * One command buffer per partition of a job (one per driving chunk for view::each_parallel),
+     * so recording takes no locks. playback() walks the partitions in index order, which makes the
+     * result independent of thread scheduling. Commands are applied by kind: all creates, then
+     * component additions with one pool reservation per type, then removals, then destroys.
+     */
+    class command_queue {
+    public:
+        void resize(std::size_t partitions) {
+            if (m_buffers.size() < partitions) m_buffers.resize(partitions);
+        }
+
+        command_buffer &operator[](std::size_t partition) { return m_buffers[partition]; }
+        std::size_t size() const noexcept { return m_buffers.size(); }
+
+        /* Applies and clears every buffer; returns the number of entities created. */
+        std::size_t playback(world &w);
+
+    private:
+        std::vector<command_buffer> m_buffers;
+        std::vector<std::vector<entity>> m_created;
+    };
+
+    /*
+     * A component set to stamp out with world::instantiate(). Each component is kept by value and
+     * copied into the pools a whole chunk run at a time, so N instances cost one entity range, one
+     * reservation and one fill per component type rather than N emplaces.
+     */
+    class prefab {
+    public:
+        /* Adds the component, or replaces the value the prefab already has. */
+        template <typename T, typename... Args>
+        prefab &set(Args &&...args) {
+            auto id = component_id<T>();
+            if (id >= m_components.size()) m_components.resize(id + 1);
+            m_components[id] = std::make_unique<component<T>>(T(std::forward<Args>(args)...));
+            return *this;
+        }
+
+        template <typename T>
+        void remove() {
+            auto id = component_id<T>();
+            if (id < m_components.size()) m_components[id].reset();
+        }
+
+        template <typename T>
+        bool has() const {
+            auto id = component_id<T>();
+            return id < m_components.size() && m_components[id];
+        }
+
+        template <typename T>
+        const T &read() const {
+            return static_cast<const component<T> &>(*m_components[component_id<T>()]).value;
+        }
+
+    private:
+        friend class world;
+
+        struct component_base {
+            virtual ~component_base() = default;
+            virtual void stamp(world &w, std::span<const entity> targets) const = 0;
+        };
+
+        template <typename T>
+        struct component final : component_base {
+            explicit component(T v) : value(std::move(v)) { }
+            void stamp(world &w, std::span<const entity> targets) const override;
+
+            T value;
+        };
+
+        std::vector<std::unique_ptr<component_base>> m_components;     // indexed by component id
+    };
+
+    /*
+     * Iterates entities that have every component in Ts, driven by the chunks of the first one.
+     * Non-const components are handed out mutable and stamp their chunks; declare read-only
+     * components const so they don't show up as changed. Structural changes (create, destroy,
+     * emplace, remove) are not allowed while iterating. After world::restore() every chunk counts
+     * as changed for a `since` older than the restore.
+     */
+    template <typename... Ts>
+    class view {
+    public:
+        explicit view(world &w);
+
+        /* Skips driving chunks that have not changed after tick `since`. */
+        view &changed_since(tick since) noexcept {
+            m_since = since < m_restored ? 0 : since;
+            return *this;
+        }
+
+        /* Calls fn(entity, Ts &...) for every match. */
+        template <typename Func>
+        void each(Func &&fn) {
+            auto &&first = std::get<0>(m_pools);
+            for (std::size_t c = 0; c < first.chunk_count(); ++c) visit_chunk(c, fn);
+        }
+
+        /* Same as each() with one driving chunk per task; fn must be safe to call concurrently. */
+        template <typename Func>
+        void each_parallel(thread_pool &pool, Func &&fn) {
+            detach_secondary();
+            pool.parallel_for(std::get<0>(m_pools).chunk_count(), 1, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t c = begin; c < end; ++c) visit_chunk(c, fn);
+            });
+        }
+
+        /* Like each_parallel(), fn(command_buffer &, entity, Ts &...) records into the chunk's own buffer. */
+        template <typename Func>
+        void each_parallel(thread_pool &pool, command_queue &commands, Func &&fn) {
+            auto chunk_count = std::get<0>(m_pools).chunk_count();
+            commands.resize(chunk_count);
+            detach_secondary();
+            pool.parallel_for(chunk_count, 1, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t c = begin; c < end; ++c) {
+                    auto &&buffer = commands[c];
+                    auto record = [&](entity e, auto &...components) { fn(buffer, e, components...); };
+                    visit_chunk(c, record);
+                }
+            });
+        }
+
+        /* Number of driving chunks, changed or not. */
+        std::size_t chunk_count() const noexcept { return std::get<0>(m_pools).chunk_count(); }
+
+        /* Number of driving chunks that pass the change filter; walks every chunk. */
+        std::size_t changed_chunk_count() const {
+            auto &&first = std::get<0>(m_pools);
+            std::size_t count = 0;
+            for (std::size_t c = 0; c < first.chunk_count(); ++c) count += first.chunk_version(c) > m_since;
+            return count;
+        }
+
+    private:
+        /*
+         * Each task writes its own driving chunks, but mutable secondary components are reached by
+         * entity and two tasks may land in one chunk, so those pools stop sharing chunks up front.
+         */
+        void detach_secondary() {
+            if constexpr (sizeof...(Ts) > 1) [&]<std::size_t... I>(std::index_sequence<I...>) {
+                auto detach = [&]<std::size_t J>() {
+                    if constexpr (!std::is_const_v<std::tuple_element_t<J, std::tuple<Ts...>>>) std::get<J>(m_pools).detach();
+                };
+                (detach.template operator()<I + 1>(), ...);
+            }(std::make_index_sequence<sizeof...(Ts) - 1>{});
+        }
+
+        template <typename Func>
+        void visit_chunk(std::size_t c, Func &fn) {
+            auto &&first = std::get<0>(m_pools);
+            if (first.chunk_version(c) <= m_since) return;
+
+            // the driving component is read straight from the chunk, only the others need a sparse lookup
+            using first_t = std::tuple_element_t<0, std::tuple<Ts...>>;
+            auto entities = first.chunk_entities(c);
+            std::span<first_t> data;
+            if constexpr (std::is_const_v<first_t>) data = std::as_const(first).chunk_data(c);
+            else data = first.chunk_data(c, m_now);
+
+            [&]<std::size_t... I>(std::index_sequence<I...>) {
+                for (std::size_t i = 0; i < entities.size(); ++i) {
+                    auto e = entities[i];
+                    if (!(std::get<I + 1>(m_pools).contains(e) && ...)) continue;
+                    fn(e, data[i], fetch<std::tuple_element_t<I + 1, std::tuple<Ts...>>>(e)...);
+                }
+            }(std::make_index_sequence<sizeof...(Ts) - 1>{});
+        }
+
+        template <typename T>
+        T &fetch(entity e) {
+            auto &&pool = std::get<component_pool<std::remove_const_t<T>> &>(m_pools);
+            if constexpr (std::is_const_v<T>) return pool.read(e);
+            else return pool.get(e, m_now);
+        }
+
+        std::tuple<component_pool<std::remove_const_t<Ts>> &...> m_pools;
+        tick m_now;
+        tick m_restored;
+        tick m_since = 0;
+    };
+
+    class world {
+    public:
+        world() = default;
+        world(const world &) = delete;
+        world &operator=(const world &) = delete;
+
+        entity create() {
+            ++m_alive;
+            if (m_free_head != no_free) {
+                auto index = m_free_head;
+                auto &&page = writable_page(index);
+                m_free_head = page.next_free[index % detail::entity_page_size];
+                return { index, page.generations[index % detail::entity_page_size] };
+            }
+            auto index = m_index_count++;
+            if (index % detail::entity_page_size == 0) m_pages.push_back(std::make_shared<detail::entity_page>());
+            writable_page(index).generations[index % detail::entity_page_size] = 0;
+            return { index, 0 };
+        }
+
+        /* Fills `out` with new entities: freed indices first, then one contiguous range of fresh ones. */
+        void create(std::span<entity> out) {
+            std::size_t i = 0;
+            for (; i < out.size() && m_free_head != no_free; ++i) out[i] = create();
+            std::size_t count = out.size() - i;
+            if (count == 0) return;
+            if (count > no_free - m_index_count) throw std::runtime_error("Out of entity indices.");
+
+            std::uint32_t index = m_index_count;
+            std::uint32_t last = m_index_count + static_cast<std::uint32_t>(count);
+            while (m_pages.size() * detail::entity_page_size < last) m_pages.push_back(std::make_shared<detail::entity_page>());
+            while (index < last) {
+                auto &&page = writable_page(index);
+                auto page_end = std::min<std::uint32_t>(last, (index / detail::entity_page_size + 1) * detail::entity_page_size);
+                std::fill(page.generations.begin() + index % detail::entity_page_size,
+                    page.generations.begin() + (page_end - 1) % detail::entity_page_size + 1, 0u);
+                for (; index < page_end; ++index) out[i++] = { index, 0 };
+            }
+            m_index_count = last;
+            m_alive += count;
+        }
+
+        /*
+         * Creates `count` entities with every component of `p`. Each span in `overrides` holds one
+         * value per instance, in creation order, and takes the place of the prefab's component of
+         * that type (or adds the type if the prefab lacks it). Returns the new entities.
+         */
+        template <typename... Overrides>
+        std::vector<entity> instantiate(const prefab &p, std::size_t count, std::span<const Overrides>... overrides) {
+            if (((overrides.size() != count) || ...)) throw std::runtime_error("Prefab overrides need one value per instance.");
+            std::vector<entity> created(count);
+            create(created);
+            std::array<std::size_t, sizeof...(Overrides)> overridden{ component_id<Overrides>()... };
+            for (std::size_t id = 0; id < p.m_components.size(); ++id) {
+                if (p.m_components[id] && std::find(overridden.begin(), overridden.end(), id) == overridden.end()) p.m_components[id]->stamp(*this, created);
+            }
+            (pool<Overrides>().emplace_n(created, m_tick, overrides), ...);
+            return created;
+        }
+
+        void destroy(entity e) {
+            if (!alive(e)) return;
+            for (auto &&components : m_pools) {
+                if (components) components->remove(e, m_tick);
+            }
+            auto &&page = writable_page(e.index);
+            ++page.generations[e.index % detail::entity_page_size];
+            page.next_free[e.index % detail::entity_page_size] = m_free_head;
+            m_free_head = e.index;
+            --m_alive;
+        }
+
+        bool alive(entity e) const noexcept {
+            return e.index < m_index_count && m_pages[e.index / detail::entity_page_size]->generations[e.index % detail::entity_page_size] == e.generation;
+        }
+
+        template <typename T, typename... Args>
+        T &emplace(entity e, Args &&...args) {
+            if (!alive(e)) throw std::runtime_error("Cannot add a component to a destroyed entity.");
+            return pool<T>().emplace(e, m_tick, std::forward<Args>(args)...);
+        }
+
+        template <typename T>
+        bool remove(entity e) {
+            return pool<T>().remove(e, m_tick);
+        }
+
+        bool remove_component(entity e, std::size_t component) {
+            return component < m_pools.size() && m_pools[component] && m_pools[component]->remove(e, m_tick);
+        }
+
+        template <typename T>
+        bool has(entity e) const {
+            auto id = component_id<T>();
+            return id < m_pools.size() && m_pools[id] && m_pools[id]->contains(e);
+        }
+
+        /* Mutable access, marks the entity's chunk as changed. */
+        template <typename T>
+        T &get(entity e) {
+            return pool<T>().get(e, m_tick);
+        }
+
+        template <typename T>
+        const T &read(entity e) {
+            return pool<T>().read(e);
+        }
+
+        template <typename T>
+        component_pool<T> &pool() {
+            auto id = component_id<T>();
+            if (id >= m_pools.size()) m_pools.resize(id + 1);
+            if (!m_pools[id]) m_pools[id] = std::make_unique<component_pool<T>>();
+            return static_cast<component_pool<T> &>(*m_pools[id]);
+        }
+
+        template <typename... Ts>
+        view<Ts...> query() {
+            return view<Ts...>(*this);
+        }
+
+        template <typename T>
+        std::span<const entity> added() { return pool<T>().added(); }
+
+        template <typename T>
+        std::span<const entity> removed() { return pool<T>().removed(); }
+
+        tick now() const noexcept { return m_tick; }
+
+        /* Returns the current tick and advances it; writes from now on compare greater than the result. */
+        tick checkpoint() noexcept { return m_tick++; }
+
+        /* Publishes this frame's added/removed lists and starts a new tick. */
+        void end_frame() {
+            for (auto &&components : m_pools) {
+                if (components) components->end_frame();
+            }
+            ++m_tick;
+        }
+
+        std::size_t size() const noexcept { return m_alive; }
+
+        /* Entity indices handed out so far, alive or not; every index is below this. */
+        std::size_t index_count() const noexcept { return m_index_count; }
+
+        /* O(chunks): shares every chunk and entity page, nothing is copied until the world writes. */
+        snapshot capture() const {
+            snapshot s;
+            s.m_tick = m_tick;
+            s.m_pages = m_pages;
+            s.m_index_count = m_index_count;
+            s.m_free_head = m_free_head;
+            s.m_alive = m_alive;
+            s.m_pools.resize(m_pools.size());
+            for (std::size_t id = 0; id < m_pools.size(); ++id) {
+                if (m_pools[id]) s.m_pools[id] = m_pools[id]->share();
+            }
+            return s;
+        }
+
+        /*
+         * Puts the world back to `s`, which stays valid. Entity handles and component pools keep
+         * their identity. Components that exist in `s` but not before, or the other way round, go
+         * into this frame's added/removed lists, so listeners can follow the jump; an entity the
+         * frame already touched may show up in both. The tick keeps counting forward and every view
+         * filtering on an older tick sees all chunks as changed.
+         */
+        void restore(const snapshot &s) {
+            m_pages = s.m_pages;
+            m_index_count = s.m_index_count;
+            m_free_head = s.m_free_head;
+            m_alive = s.m_alive;
+            for (std::size_t id = 0; id < m_pools.size(); ++id) {
+                if (!m_pools[id]) continue;
+                if (id < s.m_pools.size() && s.m_pools[id]) m_pools[id]->assign(*s.m_pools[id]);
+                else m_pools[id]->clear();
+            }
+            m_restored = m_tick;
+        }
+
+        /* Tick of the last restore(); changes after it are tracked per chunk again. */
+        tick restored_at() const noexcept { return m_restored; }
+
+    private:
+        static constexpr std::uint32_t no_free = std::numeric_limits<std::uint32_t>::max();
+
+        detail::entity_page &writable_page(std::uint32_t index) {
+            auto &&page = m_pages[index / detail::entity_page_size];
+            if (page.use_count() > 1) page = std::make_shared<detail::entity_page>(*page);
+            return *page;
+        }
+
+        std::vector<std::shared_ptr<detail::entity_page>> m_pages;
+        std::uint32_t m_index_count = 0;
+        std::uint32_t m_free_head = no_free;
+        std::vector<std::unique_ptr<pool_base>> m_pools;
+        tick m_tick = 1;
+        tick m_restored = 0;
+        std::size_t m_alive = 0;
+    };
+
+    /* The last `capacity` snapshots of a world, oldest first. */
+    class history {
+    public:
+        explicit history(std::size_t capacity) : m_capacity(std::max<std::size_t>(capacity, 1)) { }
+
+        void record(const world &w) {
+            if (m_snapshots.size() == m_capacity) m_snapshots.pop_front();
+            m_snapshots.push_back(w.capture());
+        }
+
+        /* Keeps the oldest `count` snapshots, e.g. to branch off after rewinding. */
+        void truncate(std::size_t count) {
+            if (count < m_snapshots.size()) m_snapshots.erase(m_snapshots.begin() + static_cast<std::ptrdiff_t>(count), m_snapshots.end());
+        }
+
+        void clear() { m_snapshots.clear(); }
+
+        const snapshot &operator[](std::size_t index) const { return m_snapshots[index]; }
+        std::size_t size() const noexcept { return m_snapshots.size(); }
+        std::size_t capacity() const noexcept { return m_capacity; }
+
+        std::size_t exclusive_bytes() const noexcept {
+            std::size_t bytes = 0;
+            for (auto &&s : m_snapshots) bytes += s.exclusive_bytes();
+            return bytes;
+        }
+
+    private:
+        std::size_t m_capacity;
+        std::deque<snapshot> m_snapshots;
+    };
+
+    template <typename... Ts>
+    view<Ts...>::view(world &w) : m_pools(w.pool<std::remove_const_t<Ts>>()...), m_now(w.now()), m_restored(w.restored_at()) { }
+
+    template <typename T>
+    void prefab::component<T>::stamp(world &w, std::span<const entity> targets) const {
+        w.pool<T>().emplace_n(targets, w.now(), value);
+    }
+
+    template <typename T>
+    void command_buffer::staged_components<T>::reserve(world &w, std::size_t additional) {
+        auto &&pool = w.pool<T>();
+        pool.reserve(pool.size() + additional);
+    }
+
+    /*
+     * Runs of entities this buffer created, staged in creation order, go into the pool with one
+     * emplace_n each: none of them can have the component yet and none repeats within the run.
+     * Everything else (existing entities, a second value for the same entity) is applied one by one.
+     */
+    template <typename T>
+    void command_buffer::staged_components<T>::apply(world &w, std::span<const entity> created) {
+        auto &&pool = w.pool<T>();
+        std::int64_t newest = -1;       // highest pending index that got the component so far
+        for (std::size_t i = 0; i < targets.size();) {
+            std::size_t end = i;
+            while (end < targets.size() && targets[end].generation == pending_generation && targets[end].index > newest) {
+                newest = targets[end].index;
+                targets[end] = created[targets[end].index];
+                ++end;
+            }
+            if (end > i) {
+                pool.emplace_n(std::span<const entity>(targets).subspan(i, end - i), w.now(), std::span<const T>(values).subspan(i, end - i));
+                i = end;
+                continue;
+            }
+
+            auto e = resolve(targets[i], created);
+            if (w.alive(e)) {
+                if (pool.contains(e)) pool.get(e, w.now()) = std::move(values[i]);
+                else pool.emplace(e, w.now(), std::move(values[i]));
+            }
+            ++i;
+        }
+    }
+
+    inline std::size_t command_queue::playback(world &w) {
+        std::size_t created_count = 0;
+        m_created.resize(m_buffers.size());
+        for (std::size_t p = 0; p < m_buffers.size(); ++p) {
+            m_created[p].resize(m_buffers[p].m_created);
+            w.create(m_created[p]);
+            created_count += m_created[p].size();
+        }
+
+        std::size_t type_count = 0;
+        for (auto &&buffer : m_buffers) type_count = std::max(type_count, buffer.m_staged.size());
+        for (std::size_t id = 0; id < type_count; ++id) {
+            auto staged = [&](std::size_t p) -> command_buffer::staged_base * {
+                auto &&all = m_buffers[p].m_staged;
+                return id < all.size() && all[id] && all[id]->size() != 0 ? all[id].get() : nullptr;
+            };
+            std::size_t total = 0;
+            command_buffer::staged_base *any = nullptr;
+            for (std::size_t p = 0; p < m_buffers.size(); ++p) {
+                if (auto s = staged(p)) {
+                    total += s->size();
+                    any = s;
+                }
+            }
+            if (any == nullptr) continue;
+            any->reserve(w, total);
+            for (std::size_t p = 0; p < m_buffers.size(); ++p) {
+                if (auto s = staged(p)) s->apply(w, m_created[p]);
+            }
+        }
+
+        for (std::size_t p = 0; p < m_buffers.size(); ++p) {
+            for (auto &&[e, component] : m_buffers[p].m_removed) {
+                w.remove_component(command_buffer::resolve(e, m_created[p]), component);
+            }
+        }
+        for (std::size_t p = 0; p < m_buffers.size(); ++p) {
+            for (auto &&e : m_buffers[p].m_destroyed) w.destroy(command_buffer::resolve(e, m_created[p]));
+        }
+
+        for (auto &&buffer : m_buffers) buffer.clear();
+        return created_count;
+    }
+}
@@ -0,0 +1,201 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace mk {
+    /*
+     * Fixed set of worker threads. The main thread is expected to participate in parallel_for,
+     * so by default one fewer worker than hardware threads is spawned.
+     */
+    class thread_pool {
+    public:
+        explicit thread_pool(std::size_t thread_count) {
+            for (std::size_t i = 0; i < std::max<std::size_t>(thread_count, 1); ++i) {
+                m_workers.emplace_back([this] { worker_loop(); });
+            }
+        }
+
+        ~thread_pool() {
+            {
+                std::lock_guard lock(m_mutex);
+                m_stopping = true;
+            }
+            m_cv.notify_all();
+            for (auto &&worker : m_workers) worker.join();
+        }
+
+        thread_pool(const thread_pool &) = delete;
+        thread_pool &operator=(const thread_pool &) = delete;
+
+        template <typename Func>
+        auto submit(Func &&task) -> std::future<std::invoke_result_t<Func>> {
+            using result_t = std::invoke_result_t<Func>;
+            auto packaged = std::make_shared<std::packaged_task<result_t()>>(std::forward<Func>(task));
+            auto future = packaged->get_future();
+            post([packaged] { (*packaged)(); });
+            return future;
+        }
+
+        /*
+         * Queues `task` without a future. Once the queue has grown to its working size this does not
+         * allocate, as long as the callable fits std::function's small buffer (two pointers).
+         */
+        template <typename Func>
+        void post(Func &&task) {
+            {
+                std::lock_guard lock(m_mutex);
+                push(std::forward<Func>(task));
+            }
+            m_cv.notify_one();
+        }
+
+        /*
+         * Calls body(begin, end) over [0, count) split into ranges of at least `grain` items.
+         * The caller works through ranges too and only waits on ranges, never on helper tasks,
+         * so nesting a parallel_for inside a pool task cannot deadlock.
+         */
+        template <typename Func>
+        void parallel_for(std::size_t count, std::size_t grain, Func &&body) {
+            if (count == 0) return;
+            grain = std::max<std::size_t>(grain, 1);
+            std::size_t range_count = (count + grain - 1) / grain;
+            if (range_count == 1) {
+                body(std::size_t{ 0 }, count);
+                return;
+            }
+
+            using body_t = std::remove_reference_t<Func>;
+            std::size_t helpers = std::min(range_count - 1, m_workers.size());
+            parallel_state *state;
+            {
+                std::lock_guard lock(m_mutex);
+                state = acquire_state();
+                state->next.store(0);
+                state->done.store(0);
+                state->users.store(helpers + 1);
+                state->count = count;
+                state->grain = grain;
+                state->range_count = range_count;
+                state->body = const_cast<void *>(static_cast<const void *>(std::addressof(body)));
+                state->invoke = [](void *b, std::size_t begin, std::size_t end) { (*static_cast<body_t *>(b))(begin, end); };
+                for (std::size_t i = 0; i < helpers; ++i) {
+                    push([this, state] {
+                        run_ranges(*state);
+                        release_state(*state);
+                    });
+                }
+            }
+            m_cv.notify_all();
+
+            run_ranges(*state);
+            {
+                std::unique_lock lock(state->mutex);
+                state->cv.wait(lock, [&] { return state->done.load() == range_count; });
+            }
+            release_state(*state);
+        }
+
+        std::size_t size() const noexcept { return m_workers.size(); }
+
+    private:
+        /*
+         * One parallel_for call. States are recycled through m_free_states rather than freed: the
+         * caller returns once every range is done, but helper tasks may still be on their way out,
+         * so whoever drops `users` to zero hands the state back.
+         */
+        struct parallel_state {
+            std::atomic<std::size_t> next{ 0 };
+            std::atomic<std::size_t> done{ 0 };
+            std::atomic<std::size_t> users{ 0 };
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::size_t count = 0;
+            std::size_t grain = 0;
+            std::size_t range_count = 0;
+            void *body = nullptr;
+            void (*invoke)(void *, std::size_t, std::size_t) = nullptr;
+        };
+
+        static void run_ranges(parallel_state &state) {
+            for (std::size_t r; (r = state.next.fetch_add(1)) < state.range_count; ) {
+                std::size_t begin = r * state.grain;
+                state.invoke(state.body, begin, std::min(begin + state.grain, state.count));
+                if (state.done.fetch_add(1) + 1 == state.range_count) {
+                    std::lock_guard lock(state.mutex);
+                    state.cv.notify_all();
+                }
+            }
+        }
+
+        /* Call with m_mutex held. */
+        parallel_state *acquire_state() {
+            if (m_free_states.empty()) {
+                m_states.push_back(std::make_unique<parallel_state>());
+                m_free_states.reserve(m_states.size());
+                return m_states.back().get();
+            }
+            auto *state = m_free_states.back();
+            m_free_states.pop_back();
+            return state;
+        }
+
+        void release_state(parallel_state &state) {
+            if (state.users.fetch_sub(1) != 1) return;
+            std::lock_guard lock(m_mutex);
+            m_free_states.push_back(&state);
+        }
+
+        /* Call with m_mutex held. The queue is a ring that only ever grows. */
+        template <typename Func>
+        void push(Func &&task) {
+            if (m_queued == m_tasks.size()) {
+                std::vector<std::function<void()>> grown(std::max<std::size_t>(m_tasks.size() * 2, 64));
+                for (std::size_t i = 0; i < m_queued; ++i) grown[i] = std::move(m_tasks[(m_head + i) % m_tasks.size()]);
+                m_tasks = std::move(grown);
+                m_head = 0;
+            }
+            m_tasks[(m_head + m_queued) % m_tasks.size()] = std::forward<Func>(task);
+            ++m_queued;
+        }
+
+        void worker_loop() {
+            for (;;) {
+                std::function<void()> task;
+                {
+                    std::unique_lock lock(m_mutex);
+                    m_cv.wait(lock, [this] { return m_stopping || m_queued != 0; });
+                    if (m_stopping && m_queued == 0) return;
+                    task = std::move(m_tasks[m_head]);
+                    m_tasks[m_head] = nullptr;
+                    m_head = (m_head + 1) % m_tasks.size();
+                    --m_queued;
+                }
+                task();
+            }
+        }
+
+        std::vector<std::thread> m_workers;
+        std::vector<std::function<void()>> m_tasks;
+        std::size_t m_head = 0;
+        std::size_t m_queued = 0;
+        std::vector<std::unique_ptr<parallel_state>> m_states;
+        std::vector<parallel_state *> m_free_states;
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_stopping = false;
+    };
+
+    inline thread_pool &default_thread_pool() {
+        static thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u) - 1);
+        return pool;
+    }
+}